@@ -0,0 +1,114 @@
+// Benchmark.cpp
+// CSCE 463-500
+
+#include "pch.h"
+
+// Creates a benchmark of resolvers configured by setup (and pointed at server) using the backend
+Benchmark::Benchmark(FakeServer& server, IOBackend backend, ResolverSetup setup) : server(server), backend(backend), setup(setup)
+{
+}
+
+// Returns the CPU time in microseconds the process has taken so far
+double Benchmark::ProcessCPUTime()
+{
+	FILETIME created, exited, kernel, user;
+	if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user))
+		return 0;
+
+	// FILETIME counts 100 ns intervals
+	ULONGLONG ticks = ((ULONGLONG) kernel.dwHighDateTime << 32 | kernel.dwLowDateTime)
+		+ ((ULONGLONG) user.dwHighDateTime << 32 | user.dwLowDateTime);
+	return ticks / 10.0;
+}
+
+// Returns a source of 'count' names of the form "b<run>-<worker>-<n>.bench.test"
+BatchSource Benchmark::Names(int worker, int count)
+{
+	int run = runs;
+	int next = 0;
+	return [run, worker, count, next](char* line, int line_size, DNSQuestion& question) mutable
+	{
+		if (next >= count)
+			return -1;
+		return sprintf_s(line, line_size, "b%d-%d-%d.bench.test", run, worker, next++);
+	};
+}
+
+// Resolves 'lookups' names with the given window on the given number of worker threads
+// and prints the outcome as one line. Returns -1 if a socket error stopped the run or 0 otherwise.
+int Benchmark::RunMode(const char* mode, int threads, int window, int lookups)
+{
+	runs++;
+	std::unique_ptr<DNSResolver> resolver;
+	std::unique_ptr<ShardedResolver> sharded;
+	if (threads == 1)
+	{
+		resolver.reset(new DNSResolver(backend));
+		if (!setup(*resolver) || resolver->SetWindow(window) != 0)
+			return -1;
+		resolver->SetQuiet(true);
+	}
+	else
+	{
+		sharded.reset(new ShardedResolver(threads, backend));
+		for (int i = 0; i < threads; i++)
+		{
+			if (!setup(sharded->At(i)))
+				return -1;
+			sharded->At(i).SetQuiet(true);
+		}
+	}
+
+	// lookups are split evenly, the first workers take the remainder
+	std::vector<BatchSource> sources;
+	for (int i = 0; i < threads; i++)
+		sources.push_back(Names(i, lookups / threads + ((i < lookups % threads) ? 1 : 0)));
+
+	BatchStats stats;
+	double cpu_start = ProcessCPUTime() - server.CPUTime();
+	auto start = std::chrono::steady_clock::now();
+	int result = (threads == 1) ? resolver->RunBatch(sources[0], stats) : sharded->RunBatch(window, sources, stats);
+	double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	double cpu_us = ProcessCPUTime() - server.CPUTime() - cpu_start;
+
+	std::vector<double>& latencies = stats.latencies;
+	std::sort(latencies.begin(), latencies.end());
+	size_t count = latencies.size();
+	double p50 = (count > 0) ? latencies[(count - 1) / 2] : 0;
+	double p99 = (count > 0) ? latencies[(count - 1) * 99 / 100] : 0;
+	double p999 = (count > 0) ? latencies[(count - 1) * 999 / 1000] : 0;
+	printf("Bench   : %-6s %2d thread%s, window %4d: %d lookups, %d failed, %llu sent, %llu over TCP in %.0f ms, "
+		"%.0f lookups/s, p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, %.1f us CPU per lookup\n", mode, threads, (threads == 1) ? " " : "s",
+		window, stats.lookups, stats.failures, stats.sent, stats.tcp_queries, elapsed_ms,
+		(elapsed_ms > 0) ? stats.lookups * 1000.0 / elapsed_ms : 0.0, p50, p99, p999, (stats.lookups > 0) ? cpu_us / stats.lookups : 0.0);
+
+	// how well the engine batches: datagrams moved per system call, and system calls per lookup
+	printf("Syscalls: %-6s %.2f per lookup, %.2f datagrams per send call (%llu calls), %.2f per receive call (%llu calls)\n", mode,
+		(stats.lookups > 0) ? (double) stats.syscalls / stats.lookups : 0.0,
+		(stats.send_calls > 0) ? (double) stats.datagrams_sent / stats.send_calls : 0.0, stats.send_calls,
+		(stats.receive_calls > 0) ? (double) stats.datagrams_received / stats.receive_calls : 0.0, stats.receive_calls);
+	fflush(stdout);
+	return result;
+}
+
+// Runs the single query, batch and multi-threaded benchmarks one after another. The single
+// query run resolves a tenth of the lookups of the others. Returns -1 if a run failed or 0 otherwise.
+int Benchmark::Run(int lookups, int window, int threads)
+{
+	printf("Server  : %s (fake)\n", server.Address().c_str());
+	printf("Engine  : %s\n", IOEngine::BackendName(backend));
+	printf("********************************\n");
+
+	int result = 0;
+	if (RunMode("single", 1, 1, std::max(lookups / 10, 1)) != 0)
+		result = -1;
+	if (RunMode("batch", 1, window, lookups) != 0)
+		result = -1;
+	if (RunMode("multi", threads, window, lookups) != 0)
+		result = -1;
+
+	printf("********************************\n");
+	server.Stop();
+	server.PrintStats();
+	return result;
+}
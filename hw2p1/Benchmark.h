@@ -0,0 +1,41 @@
+#pragma once
+
+// Configures a resolver the way the command line asks, the server list aside.
+// Returns false if the resolver could not be configured.
+typedef std::function<bool(DNSResolver& resolver)> ResolverSetup;
+
+/*
+ * The Benchmark class measures the resolver against a FakeServer on the loopback interface:
+ * one query at a time, a batch keeping the window full on one thread, and a batch spread
+ * over several worker threads. Every lookup is for a name of its own, so nothing is answered
+ * from the cache. Each run reports lookups per second, the p50, p99 and p99.9 latency of the
+ * replies and the CPU time the resolver took per lookup, which leaves out the fake server.
+ */
+class Benchmark
+{
+	FakeServer& server;
+	IOBackend backend;
+	ResolverSetup setup;
+
+	// Runs counted so far, part of every generated name so that no run hits the cache of another
+	int runs = 0;
+
+	// Returns the CPU time in microseconds the process has taken so far
+	static double ProcessCPUTime();
+
+	// Returns a source of 'count' names of the form "b<run>-<worker>-<n>.bench.test"
+	BatchSource Names(int worker, int count);
+
+	// Resolves 'lookups' names with the given window on the given number of worker threads
+	// and prints the outcome as one line. Returns -1 if a socket error stopped the run or 0 otherwise.
+	int RunMode(const char* mode, int threads, int window, int lookups);
+
+public:
+
+	// Creates a benchmark of resolvers configured by setup (and pointed at server) using the backend
+	Benchmark(FakeServer& server, IOBackend backend, ResolverSetup setup);
+
+	// Runs the single query, batch and multi-threaded benchmarks one after another. The single
+	// query run resolves a tenth of the lookups of the others. Returns -1 if a run failed or 0 otherwise.
+	int Run(int lookups, int window, int threads);
+};
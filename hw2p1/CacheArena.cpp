@@ -0,0 +1,119 @@
+// CacheArena.cpp
+// CSCE 463-500
+
+#include "pch.h"
+
+// Creates an arena that allocates at most 'budget' bytes of pages
+CacheArena::CacheArena(size_t budget) : budget(budget)
+{
+}
+
+// Returns the size class of a record of 'size' bytes, or -1 if it is larger than a page allows
+int CacheArena::ClassOf(int size)
+{
+	int size_class = 0;
+	while (size_class < ARENA_CLASSES && BlockSize(size_class) < size)
+		size_class++;
+	return (size_class < ARENA_CLASSES) ? size_class : -1;
+}
+
+// Returns the handle of a block of at least 'size' bytes, or ARENA_NONE if the block would
+// take the arena over its budget. The contents of the block are undefined.
+UINT CacheArena::Allocate(int size)
+{
+	int size_class = ClassOf(size);
+	if (size_class < 0)
+		return ARENA_NONE;
+
+	// a page of the class with room left, else an empty page, else a new page within the budget
+	int page_index;
+	if (!partial[size_class].empty())
+		page_index = partial[size_class].back();
+	else if (!empty_pages.empty())
+	{
+		page_index = empty_pages.back();
+		empty_pages.pop_back();
+	}
+	else if (BytesReserved() + ARENA_PAGE_SIZE <= budget)
+	{
+		pages.emplace_back();
+		pages.back().memory.reset(new char[ARENA_PAGE_SIZE]);
+		page_index = (int) pages.size() - 1;
+	}
+	else
+		return ARENA_NONE;
+
+	Page& page = pages[page_index];
+	if (page.live == 0 && !page.partial)
+	{
+		page.size_class = size_class;
+		page.free_head = -1;
+		page.unused = 0;
+		page.partial = true;
+		partial[size_class].push_back(page_index);
+	}
+
+	int block;
+	if (page.free_head >= 0)
+	{
+		block = page.free_head;
+		memcpy(&page.free_head, page.memory.get() + block * BlockSize(size_class), sizeof(int));
+	}
+	else
+		block = page.unused++;
+	page.live++;
+	bytes_used += BlockSize(size_class);
+
+	// a full page leaves the list of its class until a block of it is freed
+	if (page.free_head < 0 && page.unused * BlockSize(size_class) >= ARENA_PAGE_SIZE)
+	{
+		partial[size_class].pop_back();
+		page.partial = false;
+	}
+	return (UINT) (page_index * ARENA_BLOCKS_PER_PAGE + block);
+}
+
+// Returns the page in use with the fewest live blocks, or -1 if no page is in use
+int CacheArena::EmptiestPage()
+{
+	int emptiest = -1;
+	for (size_t i = 0; i < pages.size(); i++)
+	{
+		if (pages[i].live > 0 && (emptiest < 0 || pages[i].live < pages[emptiest].live))
+			emptiest = (int) i;
+	}
+	return emptiest;
+}
+
+// Returns a block to its page
+void CacheArena::Free(UINT handle)
+{
+	int page_index = (int) (handle / ARENA_BLOCKS_PER_PAGE);
+	int block = (int) (handle % ARENA_BLOCKS_PER_PAGE);
+	Page& page = pages[page_index];
+	int size_class = page.size_class;
+	bytes_used -= BlockSize(size_class);
+	page.live--;
+
+	// a page without live blocks can be taken by any class
+	if (page.live == 0)
+	{
+		if (page.partial)
+		{
+			std::vector<int>& list = partial[size_class];
+			list.erase(std::find(list.begin(), list.end(), page_index));
+		}
+		page.partial = false;
+		page.size_class = -1;
+		empty_pages.push_back(page_index);
+		return;
+	}
+
+	memcpy(page.memory.get() + block * BlockSize(size_class), &page.free_head, sizeof(int));
+	page.free_head = block;
+	if (!page.partial)
+	{
+		page.partial = true;
+		partial[size_class].push_back(page_index);
+	}
+}
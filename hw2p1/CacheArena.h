@@ -0,0 +1,73 @@
+#pragma once
+
+#define ARENA_NONE 0xFFFFFFFF     /* handle returned when no block could be allocated */
+
+/*
+ * The CacheArena class stores cached records packed in wire form in fixed-size pages, each
+ * split into blocks of one size class (powers of two from ARENA_MIN_BLOCK bytes), instead of
+ * as separate heap objects. Free blocks are chained through their own first bytes. Pages are
+ * only allocated while the total stays within the byte budget, and a page whose blocks have
+ * all been freed goes back to a pool from which any size class can take it.
+ */
+class CacheArena
+{
+	struct Page
+	{
+		std::unique_ptr<char[]> memory;
+		int size_class = -1;
+		int live = 0;
+
+		// First free block of the page (-1 for none), and the first block never handed out
+		int free_head = -1;
+		int unused = 0;
+		bool partial = false;
+	};
+
+	std::vector<Page> pages;
+
+	// Pages of each size class with a free block, and pages of no class
+	std::vector<int> partial[ARENA_CLASSES];
+	std::vector<int> empty_pages;
+
+	size_t budget;
+	size_t bytes_used = 0;
+
+	// Returns the size of the blocks of a size class
+	static int BlockSize(int size_class) { return ARENA_MIN_BLOCK << size_class; }
+
+public:
+
+	// Creates an arena that allocates at most 'budget' bytes of pages
+	CacheArena(size_t budget);
+
+	// Returns the handle of a block of at least 'size' bytes, or ARENA_NONE if the block would
+	// take the arena over its budget. The contents of the block are undefined.
+	UINT Allocate(int size);
+
+	// Returns a block to its page
+	void Free(UINT handle);
+
+	// Returns the size class of a record of 'size' bytes, or -1 if it is larger than a page allows
+	static int ClassOf(int size);
+
+	// Returns the page a block belongs to
+	static int PageOf(UINT handle) { return (int) (handle / ARENA_BLOCKS_PER_PAGE); }
+
+	// Returns the page in use with the fewest live blocks, or -1 if no page is in use
+	int EmptiestPage();
+
+	// Returns the memory of a block
+	char* At(UINT handle) { return pages[handle / ARENA_BLOCKS_PER_PAGE].memory.get() +
+		(handle % ARENA_BLOCKS_PER_PAGE) * BlockSize(pages[handle / ARENA_BLOCKS_PER_PAGE].size_class); }
+
+	// Returns the size of the block a record of 'size' bytes would take, or 0 if none can hold it
+	static int Footprint(int size) { return (ClassOf(size) < 0) ? 0 : BlockSize(ClassOf(size)); }
+
+	// Changes the budget, pages already allocated beyond a lower budget are kept
+	void SetBudget(size_t bytes) { budget = bytes; }
+	size_t Budget() { return budget; }
+
+	// Bytes of the blocks handed out, and of all pages allocated
+	size_t BytesUsed() { return bytes_used; }
+	size_t BytesReserved() { return pages.size() * ARENA_PAGE_SIZE; }
+};
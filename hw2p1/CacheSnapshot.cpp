@@ -0,0 +1,176 @@
+// CacheSnapshot.cpp
+// CSCE 463-500
+
+#include "pch.h"
+
+// Returns the record at a file offset, or NULL if it does not fit in the file
+const SnapshotRecord* CacheSnapshot::RecordAt(UINT offset)
+{
+	if (offset % 8 != 0 || offset + sizeof(SnapshotRecord) > view_size)
+		return NULL;
+	const SnapshotRecord* record = (const SnapshotRecord*) (view + offset);
+	if (offset + sizeof(SnapshotRecord) + record->question_size + record->message_size > view_size)
+		return NULL;
+	return record;
+}
+
+// Maps the snapshot at path. Returns the number of records, -1 if the file cannot be
+// opened or mapped, or -2 if it is not a snapshot of this version.
+int CacheSnapshot::Open(const char* path)
+{
+	Close();
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return -1;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart < (LONGLONG) sizeof(SnapshotHeader) || size.QuadPart > UINT_MAX)
+	{
+		Close();
+		return -2;
+	}
+
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping != NULL)
+		view = (const char*) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (view == NULL)
+	{
+		Close();
+		return -1;
+	}
+	view_size = (ULONGLONG) size.QuadPart;
+
+	// the bucket array is used in place, so everything it is indexed with must be checked here
+	const SnapshotHeader* header = (const SnapshotHeader*) view;
+	if (header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION || header->header_size != sizeof(SnapshotHeader)
+		|| header->file_size != view_size || header->buckets == 0 || (header->buckets & (header->buckets - 1)) != 0
+		|| sizeof(SnapshotHeader) + (ULONGLONG) header->buckets * sizeof(UINT) > view_size)
+	{
+		Close();
+		return -2;
+	}
+	buckets = (const UINT*) (view + sizeof(SnapshotHeader));
+	bucket_count = header->buckets;
+	return (int) header->records;
+}
+
+// Unmaps the snapshot, if one is open
+void CacheSnapshot::Close()
+{
+	if (view != NULL)
+		UnmapViewOfFile(view);
+	if (mapping != NULL)
+		CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+	view = NULL;
+	mapping = NULL;
+	file = INVALID_HANDLE_VALUE;
+	view_size = 0;
+	buckets = NULL;
+	bucket_count = 0;
+}
+
+// Returns the record of a question (without regard to case), or NULL if there is none.
+// The record and the question and message that follow it stay valid until Close.
+const SnapshotRecord* CacheSnapshot::Find(const char* question, int question_size)
+{
+	if (view == NULL)
+		return NULL;
+
+	UINT mask = bucket_count - 1;
+	UINT bucket = (UINT) QuestionHash()(question, question_size) & mask;
+
+	// linear probing, the table is at most half full so an empty bucket ends every search
+	for (UINT probes = 0; probes < bucket_count && buckets[bucket] != 0; probes++)
+	{
+		const SnapshotRecord* record = RecordAt(buckets[bucket]);
+		if (record == NULL)
+			return NULL;
+		if (record->question_size == question_size && QuestionEqual()((const char*) (record + 1), question, question_size))
+			return record;
+		bucket = (bucket + 1) & mask;
+	}
+	return NULL;
+}
+
+// Lays the given responses out as a snapshot file in image
+void CacheSnapshot::Format(std::vector<SnapshotEntry>& entries, std::vector<char>& image)
+{
+	UINT bucket_count = 16;
+	while (bucket_count < entries.size() * 2)
+		bucket_count *= 2;
+
+	std::vector<UINT> table(bucket_count, 0);
+	size_t offset = sizeof(SnapshotHeader) + bucket_count * sizeof(UINT);
+	offset = (offset + 7) & ~(size_t) 7;
+	image.assign(offset, 0);
+
+	UINT records = 0;
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		SnapshotEntry& entry = entries[i];
+		SnapshotRecord record;
+		memset(&record, 0, sizeof(record));
+		record.inserted = entry.inserted;
+		record.expires = entry.expires;
+		record.question_size = (USHORT) entry.question_size;
+		record.message_size = (USHORT) entry.message_size;
+		record.negative = entry.negative ? 1 : 0;
+
+		// offsets are 32-bit, a cache larger than that is only partly saved
+		size_t size = sizeof(SnapshotRecord) + entry.question_size + entry.message_size;
+		if (offset + size > UINT_MAX)
+			break;
+
+		UINT mask = bucket_count - 1;
+		UINT bucket = (UINT) QuestionHash()(entry.question, entry.question_size) & mask;
+		while (table[bucket] != 0)
+			bucket = (bucket + 1) & mask;
+		table[bucket] = (UINT) offset;
+
+		image.insert(image.end(), (char*) &record, (char*) &record + sizeof(record));
+		image.insert(image.end(), entry.question, entry.question + entry.question_size);
+		image.insert(image.end(), entry.message, entry.message + entry.message_size);
+		offset += size;
+		offset = (offset + 7) & ~(size_t) 7;
+		image.resize(offset, 0);
+		records++;
+	}
+
+	SnapshotHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = SNAPSHOT_MAGIC;
+	header.version = SNAPSHOT_VERSION;
+	header.header_size = sizeof(SnapshotHeader);
+	header.buckets = bucket_count;
+	header.records = records;
+	header.saved = Now();
+	header.file_size = image.size();
+	memcpy(image.data(), &header, sizeof(header));
+	memcpy(image.data() + sizeof(header), table.data(), bucket_count * sizeof(UINT));
+}
+
+// Replaces the file at path with a formatted snapshot by writing it next to the file and
+// renaming it over the file, which must not be mapped. Returns -1 if it could not be written.
+int CacheSnapshot::Write(const char* path, std::vector<char>& image)
+{
+	// a process that stops mid-write leaves the previous snapshot intact
+	std::string temp_path = std::string(path) + ".tmp";
+	FILE* output = NULL;
+	if (fopen_s(&output, temp_path.c_str(), "wb") != 0)
+		return -1;
+	size_t written = fwrite(image.data(), 1, image.size(), output);
+	if (fclose(output) != 0 || written != image.size())
+		return -1;
+	if (!MoveFileExA(temp_path.c_str(), path, MOVEFILE_REPLACE_EXISTING))
+		return -1;
+	return 0;
+}
+
+// Returns the current time in seconds since the epoch, the clock snapshot times use
+ULONGLONG CacheSnapshot::Now()
+{
+	return (ULONGLONG) std::chrono::duration_cast<std::chrono::seconds>
+		(std::chrono::system_clock::now().time_since_epoch()).count();
+}
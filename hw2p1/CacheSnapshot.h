@@ -0,0 +1,95 @@
+#pragma once
+
+#define SNAPSHOT_MAGIC   0x534E5344 /* "DSNS" in host byte order */
+#define SNAPSHOT_VERSION 1
+
+// Start of a snapshot file, followed by the bucket array and the records. Files are written
+// in host byte order and rejected unless the magic, version and sizes all match.
+struct SnapshotHeader
+{
+	UINT magic;
+	USHORT version;
+	USHORT header_size;
+
+	// Number of buckets (a power of two) and of records
+	UINT buckets;
+	UINT records;
+
+	// Time the snapshot was written and size of the whole file
+	ULONGLONG saved;
+	ULONGLONG file_size;
+};
+
+// A cached response in a snapshot file, followed by its question and its message. Times are
+// in seconds since the epoch so that they survive restarts. Records start 8-byte aligned.
+struct SnapshotRecord
+{
+	ULONGLONG inserted, expires;
+	USHORT question_size;
+	USHORT message_size;
+	UCHAR negative;
+	UCHAR reserved[3];
+};
+
+// A response handed to CacheSnapshot::Write
+struct SnapshotEntry
+{
+	const char* question;
+	int question_size;
+	const char* message;
+	int message_size;
+	bool negative;
+	ULONGLONG inserted, expires;
+};
+
+/*
+ * The CacheSnapshot class maps a snapshot of the answer cache written by an earlier process
+ * into memory read-only and looks responses up in place. The file holds an open-addressing
+ * table of record offsets, indexed by the case-insensitive hash of the question, so opening
+ * a snapshot reads nothing but its header and lookups touch only the pages they need.
+ */
+class CacheSnapshot
+{
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+	const char* view = NULL;
+	ULONGLONG view_size = 0;
+
+	// Bucket array of the mapped file, each the offset of a record or 0 if empty
+	const UINT* buckets = NULL;
+	UINT bucket_count = 0;
+
+	// Returns the record at a file offset, or NULL if it does not fit in the file
+	const SnapshotRecord* RecordAt(UINT offset);
+
+public:
+
+	~CacheSnapshot() { Close(); }
+
+	// Maps the snapshot at path. Returns the number of records, -1 if the file cannot be
+	// opened or mapped, or -2 if it is not a snapshot of this version.
+	int Open(const char* path);
+
+	// Unmaps the snapshot, if one is open
+	void Close();
+
+	bool IsOpen() { return view != NULL; }
+
+	// Returns the record of a question (without regard to case), or NULL if there is none.
+	// The record and the question and message that follow it stay valid until Close.
+	const SnapshotRecord* Find(const char* question, int question_size);
+
+	// Returns the record in the given bucket (0 to Buckets() - 1), or NULL if it is empty
+	const SnapshotRecord* Bucket(UINT bucket) { return (buckets[bucket] == 0) ? NULL : RecordAt(buckets[bucket]); }
+	UINT Buckets() { return bucket_count; }
+
+	// Lays the given responses out as a snapshot file in image
+	static void Format(std::vector<SnapshotEntry>& entries, std::vector<char>& image);
+
+	// Replaces the file at path with a formatted snapshot by writing it next to the file and
+	// renaming it over the file, which must not be mapped. Returns -1 if it could not be written.
+	static int Write(const char* path, std::vector<char>& image);
+
+	// Returns the current time in seconds since the epoch, the clock snapshot times use
+	static ULONGLONG Now();
+};
@@ -10,8 +10,77 @@
 #define DNS_INET        1 
 #define MAX_ATTEMPTS    3
 #define TIMEOUT_SECONDS 10
+#define INITIAL_RTO_MS  1000      /* retransmission timeout before the first RTT sample */
+#define MIN_RTO_MS      10
+#define MAX_RTO_MS      (TIMEOUT_SECONDS * 1000)
+
+#define MAX_UPSTREAMS   32        /* servers that can be queried, one bit each in a mask */
+#define UPSTREAM_PROBE_INTERVAL 64 /* every Nth selection goes to the least recently used server */
+#define LOSS_WEIGHT     0.1       /* weight of the newest attempt in the loss estimate */
+#define LATENCY_WINDOW  256       /* recent answer times kept per server for percentiles */
+#define LATENCY_REFRESH 16        /* new answer times before a percentile is recomputed */
+#define MIN_LATENCY_SAMPLES 20    /* answer times needed before hedging from a percentile */
 #define DNS_PORT        53   
-#define MAX_DNS_SIZE    512
+#define MAX_DNS_SIZE    512       /* largest message without EDNS(0) */
+#define MAX_UDP_SIZE    4096      /* largest datagram received, and EDNS(0) payload advertised */
+#define DEFAULT_EDNS_SIZE 1232    /* EDNS(0) payload advertised by default, avoids fragmentation */
+#define MAX_NAME_SIZE   256
+#define MAX_LABEL_SIZE  63
+
+#define DEFAULT_WINDOW  1000      /* queries kept in flight in batch mode */
+#define MAX_WINDOW      32768     /* upper bound on the in-flight window */
+#define MAX_THREADS     64        /* worker threads of the sharded batch mode */
+#define MAX_WAITERS     256       /* lookups that can join one outstanding query */
+#define SERVER_REPORT_MS 10000    /* interval of the statistics printed in server mode */
+#define SNAPSHOT_INTERVAL_MS 60000 /* interval at which the cache is saved in server mode */
+#define METRICS_INTERVAL_MS 10000 /* interval at which the metrics file is rewritten */
+#define SOCKET_BUFFER   (4 << 20) /* receive buffer requested for the engine socket */
+
+#define WHEEL_SLOTS     4096      /* one millisecond slots of the timer wheel */
+#define RECEIVE_DEPTH   64        /* receives kept posted to the completion port */
+#define RECEIVE_BATCH   256       /* datagrams drained per readiness notification */
+#define RIO_RECEIVE_DEPTH 256     /* receives kept posted with Registered I/O */
+#define RIO_SEND_DEPTH  256       /* sends that may be outstanding with Registered I/O */
+#define RIO_SEND_SPINS  1000      /* checks for a finished send before a datagram is dropped */
+#define RIO_SLOT_SIZE   (MAX_UDP_SIZE + sizeof(SOCKADDR_INET)) /* registered datagram buffer and peer address */
+#define MAX_WAIT_MS     1000      /* longest single wait of the event loop */
+#define WATCH_POLL_MS   5         /* longest completion port wait while other sockets are watched */
+#define TCP_CONNECTIONS 2         /* persistent TCP connections kept per server */
+#define TCP_PIPELINE    32        /* queries outstanding on one TCP connection before another is used */
+#define TCP_IDLE_MS     10000     /* TCP connections without traffic for this long are closed */
+#define TCP_MIN_TIMEOUT_MS 1000   /* shortest timeout of a query sent over TCP */
+#define LATE_REPLY_MS   (MAX_RTO_MS * 2) /* replies to a query this long after it completed are counted as late */
+#define MAX_TCP_SIZE    65535     /* largest length-prefixed message on a TCP connection */
+#define MAX_CACHE_TTL   86400     /* cached answers are kept for at most one day */
+#define MAX_NEGATIVE_TTL 3600     /* and negative answers for at most one hour */
+#define PREFETCH_MIN_HITS 3       /* hits before a cached answer is refreshed ahead of its expiry */
+#define DEFAULT_CACHE_MB 64       /* memory budget of the answer cache */
+#define DEFAULT_CACHE_BYTES ((size_t) DEFAULT_CACHE_MB << 20)
+#define ARENA_PAGE_SIZE (64 << 10) /* cache arena page, split into blocks of one size class */
+#define ARENA_MIN_BLOCK 64        /* smallest block, the classes double up to 8 KB */
+#define ARENA_CLASSES   8
+#define ARENA_BLOCKS_PER_PAGE (ARENA_PAGE_SIZE / ARENA_MIN_BLOCK)
+#define SMALL_QUEUE_PERCENT 10    /* share of the entries of a size class held by its S3-FIFO small queue */
+#define CACHE_MAX_EVICTIONS 64    /* entries one insert may evict, the insert is dropped past that */
+#define CACHE_AVERAGE_ENTRY 256   /* arena bytes per entry the metadata share of the cache budget is sized for */
+#define CACHE_GHOST_BYTES 56      /* bytes a ghost takes in the ghost queue and its hash table */
+#define INDEX_EMPTY     -1        /* markers of the open-addressing cache index */
+#define INDEX_REMOVED   -2
+#define NAME_MEMO_SLOTS 64        /* decoded name suffixes remembered per message */
+#define NAME_MEMO_BYTES 2048      /* text of the decoded names remembered per message */
+#define HISTOGRAM_SUB_BUCKETS 4   /* buckets per power of two of microseconds of a latency histogram */
+#define HISTOGRAM_BUCKETS 104     /* up to 2^27 us (134 s), later latencies only count towards the total */
+#define HISTOGRAM_MAX_US  (1ULL << 27)
+#define TRACE_RECORDS   65536     /* lookups kept in the trace ring of a resolver */
+#define TRACE_TICK_NS   100       /* resolution of trace timestamps, that of the Windows performance counter */
+#define TRACE_SLOWEST   10        /* slowest lookups printed from a trace */
+#define OUTPUT_FLUSH_SIZE (1 << 20) /* bytes of formatted lookups buffered before they are written */
+#define MAX_SWEEP_SIZE  (1 << 24) /* most addresses in one CIDR block of a reverse sweep */
+#define FAKE_MAX_ANSWERS 32       /* most records in a response of the benchmark server */
+#define FAKE_TTL        3600      /* TTL of the records of the benchmark server */
+#define FAKE_SEED       463       /* seed of the faults the benchmark server injects, for repeatable runs */
+#define BENCH_THREADS   4         /* worker threads of the multi-threaded benchmark unless -threads is given */
+#define DEFAULT_BENCH_LOOKUPS 20000 /* lookups of the batch benchmarks, the single query benchmark runs a tenth */
 
 #define DNS_OK          0
 #define DNS_FORMAT      1
@@ -23,9 +92,12 @@
 #define DNS_A       1	  /* name -> IP */
 #define DNS_NS      2	  /* name server */
 #define DNS_CNAME	5	  /* canonical name */
+#define DNS_SOA     6	  /* start of authority */
 #define DNS_PTR     12	  /* IP -> name */
 #define DNS_HINFO   13	  /* host info/SOA */
 #define DNS_MX      15	  /* mail exchange */
+#define DNS_TXT     16	  /* text strings */
 #define DNS_AAAA    28
+#define DNS_OPT     41	  /* EDNS(0) pseudo-record */
 #define DNS_AXFR    252	  /* request for zone transfer */
 #define DNS_ANY     255	  /* all records */
@@ -0,0 +1,736 @@
+// DNSCache.cpp
+// CSCE 463-500
+
+#include "pch.h"
+
+// Case-insensitive FNV-1a hash of a question
+size_t QuestionHash::operator()(const char* key, size_t size) const
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= (unsigned long long) tolower((UCHAR) key[i]);
+		hash *= 1099511628211ULL;
+	}
+	return (size_t) hash;
+}
+
+// Case-insensitive comparison of two questions of 'size' bytes
+bool QuestionEqual::operator()(const char* a, const char* b, size_t size) const
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		if (tolower((UCHAR) a[i]) != tolower((UCHAR) b[i]))
+			return false;
+	}
+	return true;
+}
+
+// Creates a cache that takes at most 'budget' bytes of arena pages and metadata
+DNSCache::DNSCache(size_t budget) : arena(0)
+{
+	SetBudget(budget);
+}
+
+// Changes the byte budget, of which the metadata of the entries it allows is set aside and 
+// the rest given to the arena. Lowering it only limits what is allocated from then on.
+void DNSCache::SetBudget(size_t bytes)
+{
+	// besides the share of every entry, the index has at least 1024 slots (and up to 8 more
+	// than 8 per entry) and the queues up to 1024 positions of removed entries beyond theirs
+	byte_budget = bytes;
+	entry_limit = bytes / (CACHE_AVERAGE_ENTRY + EntryMetadata());
+	size_t metadata = entry_limit * EntryMetadata() + (1024 + 8) * sizeof(int) + 1024 * sizeof(std::pair<int, UINT>);
+	arena.SetBudget((bytes > metadata) ? bytes - metadata : 0);
+}
+
+// Returns the entry number stored under a key of the given kind, or -1 if there is none
+int DNSCache::FindEntry(UCHAR kind, const char* key, int key_size)
+{
+	if (index.empty())
+		return -1;
+
+	size_t hash = QuestionHash()(key, key_size);
+	size_t mask = index.size() - 1;
+	for (size_t slot = hash & mask; index[slot] != INDEX_EMPTY; slot = (slot + 1) & mask)
+	{
+		if (index[slot] == INDEX_REMOVED)
+			continue;
+		CacheEntry& entry = entries[index[slot]];
+		if (entry.hash == hash && entry.kind == kind && entry.key_size == key_size
+			&& QuestionEqual()(KeyOf(entry), key, key_size))
+			return index[slot];
+	}
+	return -1;
+}
+
+// Stores a record under a key of the given kind, replacing any entry already stored under
+// it and evicting others while the arena is out of budget, at most CACHE_MAX_EVICTIONS of
+// them. Returns the entry number, or -1 if the record cannot be stored, in which case the
+// entry it would have replaced is kept.
+int DNSCache::StoreEntry(UCHAR kind, const char* key, int key_size, const char* record, int record_size)
+{
+	int size = key_size + record_size;
+	int size_class = CacheArena::ClassOf(size);
+	if (size_class < 0)
+		return -1;
+
+	// a replaced entry keeps its place among the entries that are used again, and is only
+	// removed once its replacement has a block, so a dropped insert does not lose it
+	bool in_main = false;
+	UCHAR frequency = 0;
+	int existing = FindEntry(kind, key, key_size);
+	size_t replaced = (existing >= 0) ? 1 : 0;
+	if (existing >= 0)
+	{
+		in_main = entries[existing].in_main;
+		frequency = entries[existing].frequency;
+	}
+
+	// room is made by evicting records of the same size class, whose blocks the record can take,
+	// or if the class has none by emptying the page of another class that has the fewest left.
+	// Past the entry limit, a class without entries evicts from the one with the most instead.
+	UINT block = (answer_count + nxdomain_count - replaced < entry_limit) ? arena.Allocate(size) : ARENA_NONE;
+	int evicted = 0;
+	while (block == ARENA_NONE && evicted < CACHE_MAX_EVICTIONS)
+	{
+		int victim = size_class;
+		for (int c = 0; c < ARENA_CLASSES && class_entries[size_class] == 0; c++)
+		{
+			if (class_entries[c] > class_entries[victim])
+				victim = c;
+		}
+		if (answer_count + nxdomain_count - replaced >= entry_limit && EvictOne(victim))
+			evicted++;
+		else if (EvictOne(size_class))
+			evicted++;
+		else
+		{
+			int count = ReclaimPage(CACHE_MAX_EVICTIONS - evicted);
+			if (count < 0)
+				break;
+			evicted += count;
+		}
+		block = (answer_count + nxdomain_count - replaced < entry_limit) ? arena.Allocate(size) : ARENA_NONE;
+	}
+	if (block == ARENA_NONE)
+	{
+		dropped++;
+		return -1;
+	}
+
+	// the entry may have been evicted itself while room was made
+	existing = FindEntry(kind, key, key_size);
+	if (existing >= 0)
+		RemoveEntry(existing);
+	memcpy(arena.At(block), key, key_size);
+	memcpy(arena.At(block) + key_size, record, record_size);
+
+	int number;
+	if (free_entries.empty())
+	{
+		// grown by hand so that the capacity stays within the entry limit
+		if (entries.size() == entries.capacity())
+		{
+			size_t capacity = std::min(std::max(entries.size() * 2, (size_t) 1024), std::max(entry_limit, entries.size() + 1));
+			entries.reserve(capacity);
+			free_entries.reserve(capacity);
+		}
+		number = (int) entries.size();
+		entries.emplace_back();
+	}
+	else
+	{
+		number = free_entries.back();
+		free_entries.pop_back();
+	}
+	CacheEntry& entry = entries[number];
+	UINT generation = entry.generation;
+	entry = CacheEntry();
+	entry.generation = generation;
+	entry.kind = kind;
+	entry.key_size = (USHORT) key_size;
+	entry.record_size = (USHORT) record_size;
+	entry.block = block;
+	entry.size_class = (UCHAR) size_class;
+	entry.hash = QuestionHash()(key, key_size);
+	(kind == ENTRY_ANSWER) ? answer_count++ : nxdomain_count++;
+	class_entries[size_class]++;
+
+	// removed markers count towards the load, so that every search ends at an empty slot
+	if ((index_used + 1) * 2 > index.size())
+		GrowIndex();
+	size_t mask = index.size() - 1;
+	size_t slot = entry.hash & mask;
+	while (index[slot] >= 0)
+		slot = (slot + 1) & mask;
+	if (index[slot] == INDEX_EMPTY)
+		index_used++;
+	index[slot] = number;
+	entry.slot = (int) slot;
+
+	// keys evicted from the small queue not long ago have proven they are asked for again
+	entry.in_main = in_main || ghosts.count(entry.hash) > 0;
+	entry.frequency = frequency;
+	size_t bytes = CacheArena::Footprint(size);
+	if (entry.in_main)
+	{
+		main_queue[size_class].push_back(std::make_pair(number, entry.generation));
+		main_bytes[size_class] += bytes;
+	}
+	else
+	{
+		small_queue[size_class].push_back(std::make_pair(number, entry.generation));
+		small_bytes[size_class] += bytes;
+	}
+	CompactQueues();
+	return number;
+}
+
+// Removes an entry from the index and returns its block to the arena
+void DNSCache::RemoveEntry(int number)
+{
+	CacheEntry& entry = entries[number];
+	size_t bytes = CacheArena::Footprint(entry.key_size + entry.record_size);
+	(entry.in_main ? main_bytes : small_bytes)[entry.size_class] -= bytes;
+	(entry.kind == ENTRY_ANSWER) ? answer_count-- : nxdomain_count--;
+	class_entries[entry.size_class]--;
+	arena.Free(entry.block);
+	index[entry.slot] = INDEX_REMOVED;
+
+	// the queue position of the entry is skipped when it is reached
+	entry.kind = ENTRY_FREE;
+	entry.block = ARENA_NONE;
+	entry.slot = -1;
+	entry.generation++;
+	free_entries.push_back(number);
+	stale_positions++;
+}
+
+// Evicts one entry of a size class as S3-FIFO does. Returns false if the class has no entries.
+bool DNSCache::EvictOne(int size_class)
+{
+	std::deque<std::pair<int, UINT>>& small = small_queue[size_class];
+	std::deque<std::pair<int, UINT>>& main = main_queue[size_class];
+	while (!small.empty() || !main.empty())
+	{
+		// the small queue is trimmed to its share of the class first, the main queue otherwise
+		bool from_small = !small.empty() && (main.empty() || small_bytes[size_class] * 100
+			> (small_bytes[size_class] + main_bytes[size_class]) * SMALL_QUEUE_PERCENT);
+		std::deque<std::pair<int, UINT>>& queue = from_small ? small : main;
+		std::pair<int, UINT> position = queue.front();
+		queue.pop_front();
+
+		CacheEntry& entry = entries[position.first];
+		if (entry.kind == ENTRY_FREE || entry.generation != position.second)
+		{
+			stale_positions--;
+			continue;
+		}
+
+		// entries hit since they were queued get another round, in the main queue
+		size_t bytes = CacheArena::Footprint(entry.key_size + entry.record_size);
+		if (entry.frequency > 0)
+		{
+			if (from_small)
+			{
+				entry.in_main = true;
+				small_bytes[size_class] -= bytes;
+				main_bytes[size_class] += bytes;
+				entry.frequency = 0;
+			}
+			else
+				entry.frequency--;
+			main.push_back(position);
+			continue;
+		}
+
+		if (from_small)
+			AddGhost(entry.hash);
+
+		// the position was already taken off the queue
+		RemoveEntry(position.first);
+		stale_positions--;
+		evictions++;
+		return true;
+	}
+	return false;
+}
+
+// Empties the arena page with the fewest live blocks, if it has at most max_evictions, by
+// evicting the entries stored in it. Returns the number of entries evicted, or -1 if no
+// page is empty enough.
+int DNSCache::ReclaimPage(int max_evictions)
+{
+	int page = arena.EmptiestPage();
+	if (page < 0)
+		return -1;
+
+	// only needed when a size class has no entries left, so the entries are simply searched
+	int count = 0;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		for (size_t i = 0; i < entries.size() && count < max_evictions; i++)
+		{
+			CacheEntry& entry = entries[i];
+			bool cold = !entry.in_main && entry.frequency == 0;
+			if (entry.kind == ENTRY_FREE || CacheArena::PageOf(entry.block) != page || (pass == 0 && !cold))
+				continue;
+			if (!entry.in_main)
+				AddGhost(entry.hash);
+			RemoveEntry((int) i);
+			evictions++;
+			count++;
+		}
+	}
+	return count;
+}
+
+// Remembers the hash of a key evicted from the small queue, forgetting the oldest ones
+// beyond the entry limit
+void DNSCache::AddGhost(size_t hash)
+{
+	ghost_queue.push_back(hash);
+	ghosts[hash]++;
+	while (ghost_queue.size() > entry_limit)
+	{
+		auto ghost = ghosts.find(ghost_queue.front());
+		if (--ghost->second == 0)
+			ghosts.erase(ghost);
+		ghost_queue.pop_front();
+	}
+}
+
+// Rebuilds the index with room for twice the entries, dropping the removed markers
+void DNSCache::GrowIndex()
+{
+	size_t size = 1024;
+	while (size < (answer_count + nxdomain_count + 1) * 4)
+		size *= 2;
+	index.assign(size, INDEX_EMPTY);
+	index_used = 0;
+
+	size_t mask = size - 1;
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		if (entries[i].kind == ENTRY_FREE)
+			continue;
+		size_t slot = entries[i].hash & mask;
+		while (index[slot] != INDEX_EMPTY)
+			slot = (slot + 1) & mask;
+		index[slot] = (int) i;
+		entries[i].slot = (int) slot;
+		index_used++;
+	}
+}
+
+// Drops the positions of removed entries from the queues once they outnumber the entries
+void DNSCache::CompactQueues()
+{
+	if (stale_positions <= answer_count + nxdomain_count + 1024)
+		return;
+
+	for (int q = 0; q < 2 * ARENA_CLASSES; q++)
+	{
+		std::deque<std::pair<int, UINT>>& queue = (q < ARENA_CLASSES) ? small_queue[q] : main_queue[q - ARENA_CLASSES];
+		std::deque<std::pair<int, UINT>> live;
+		for (size_t i = 0; i < queue.size(); i++)
+		{
+			std::pair<int, UINT>& position = queue[i];
+			if (entries[position.first].kind != ENTRY_FREE && entries[position.first].generation == position.second)
+				live.push_back(position);
+		}
+		queue.swap(live);
+	}
+	stale_positions = 0;
+}
+
+// Returns the bytes of metadata allocated, estimated from the sizes of its elements
+size_t DNSCache::MetadataBytes()
+{
+	size_t positions = 0;
+	for (int c = 0; c < ARENA_CLASSES; c++)
+		positions += small_queue[c].size() + main_queue[c].size();
+	return entries.capacity() * sizeof(CacheEntry) + (free_entries.capacity() + index.capacity()) * sizeof(int)
+		+ positions * sizeof(std::pair<int, UINT>) + ghost_queue.size() * CACHE_GHOST_BYTES;
+}
+
+// Walks every resource record of a response, reducing each TTL by 'age' seconds 
+// (never below 0) when age is non-zero, and stores the smallest TTL of the answer 
+// section in min_answer_ttl and the offset of the first SOA record of the authority
+// section (or -1) in soa_offset. Returns -1 if the response is malformed or 0 for success.
+int DNSCache::ScanRecords(char* buf, int size, UINT age, UINT& min_answer_ttl, int& soa_offset)
+{
+	DNSMessage message(buf, size);
+	DNSRecord record;
+	min_answer_ttl = 0xFFFFFFFF;
+	soa_offset = -1;
+
+	while (message.Next(record))
+	{
+		// the TTL field of the OPT pseudo-record holds EDNS(0) flags rather than a TTL
+		if (record.section == SECTION_QUESTION || record.type == DNS_OPT)
+			continue;
+
+		if (soa_offset < 0 && record.section == SECTION_AUTHORITY && record.type == DNS_SOA)
+			soa_offset = record.offset;
+		UINT ttl = record.ttl;
+		if (age > 0)
+		{
+			ttl = (ttl > age) ? ttl - age : 0;
+			((ResourceRecord*)(buf + record.fixed_offset))->rTTL = htonl(ttl);
+		}
+		if (record.section == SECTION_ANSWER && ttl < min_answer_ttl)
+			min_answer_ttl = ttl;
+	}
+	return (message.Error() == PARSE_OK) ? 0 : -1;
+}
+
+// Returns the negative TTL of a response from its SOA record (at soa_offset), capped at 
+// MAX_NEGATIVE_TTL, or 0 if the SOA record is malformed
+UINT DNSCache::NegativeTTL(const char* buf, int size, int soa_offset)
+{
+	int offset = DNSMessage::SkipName(buf, size, soa_offset);
+	if (offset < 0 || offset + (int) sizeof(ResourceRecord) > size)
+		return 0;
+
+	// the MINIMUM field is the last of the five 32-bit values ending the SOA rdata
+	ResourceRecord* record = (ResourceRecord*)(buf + offset);
+	int rdata_end = offset + (int) sizeof(ResourceRecord) + ntohs(record->rLength);
+	if (ntohs(record->rLength) < 5 * sizeof(UINT) + 2 || rdata_end > size)
+		return 0;
+
+	UINT minimum = ntohl(*(UINT*)(buf + rdata_end - sizeof(UINT)));
+	UINT ttl = ntohl(record->rTTL);
+	if (minimum < ttl)
+		ttl = minimum;
+	return (ttl > MAX_NEGATIVE_TTL) ? MAX_NEGATIVE_TTL : ttl;
+}
+
+// Stores the SOA record of an NXDOMAIN response under the name that does not exist
+void DNSCache::InsertNXDomain(const char* question, int question_size, const char* buf, int size, int soa_offset, UINT ttl)
+{
+	// the synthesized responses carry a different question, so the record must not contain compression pointers
+	char record[MAX_UDP_SIZE];
+	DNSName name;
+	name.buf = buf;
+	name.size = size;
+	name.offset = soa_offset;
+	int written = name.Expand(record, MAX_NAME_SIZE);
+	int offset = DNSMessage::SkipName(buf, size, soa_offset);
+	if (written < 0 || offset < 0)
+		return;
+
+	ResourceRecord header = *(ResourceRecord*)(buf + offset);
+	int rdata = offset + (int) sizeof(ResourceRecord);
+	int header_offset = written;
+	written += sizeof(ResourceRecord);
+
+	// MNAME and RNAME followed by the five 32-bit values
+	for (int i = 0; i < 2; i++)
+	{
+		name.offset = rdata;
+		int name_size = name.Expand(record + written, MAX_NAME_SIZE);
+		rdata = DNSMessage::SkipName(buf, size, rdata);
+		if (name_size < 0 || rdata < 0)
+			return;
+		written += name_size;
+	}
+	if (rdata + 5 * (int) sizeof(UINT) > size)
+		return;
+	memcpy(record + written, buf + rdata, 5 * sizeof(UINT));
+	written += 5 * sizeof(UINT);
+
+	header.rTTL = htonl(ttl);
+	header.rLength = htons((USHORT) (written - header_offset - sizeof(ResourceRecord)));
+	memcpy(record + header_offset, &header, sizeof(ResourceRecord));
+
+	int number = StoreEntry(ENTRY_NXDOMAIN, question, question_size - (int) sizeof(QueryHeader), record, written);
+	if (number < 0)
+		return;
+	CacheEntry& entry = entries[number];
+	entry.negative = true;
+	entry.inserted = std::chrono::steady_clock::now();
+	entry.expires = entry.inserted + std::chrono::seconds(ttl);
+}
+
+// Stores a response to the given question if it is a complete, successful answer 
+// with a non-zero TTL, or a negative answer (NXDOMAIN or NODATA) with an SOA record. 
+// Any previous response to the same question is replaced. 'prefetched' marks responses
+// to a refresh, so that refreshes which were hit afterwards can be counted.
+void DNSCache::Insert(const char* question, int question_size, const char* buf, int size, bool prefetched)
+{
+	if (size < sizeof(DNSHeader) || size > MAX_UDP_SIZE)
+		return;
+
+	DNSHeader* header = (DNSHeader*)buf;
+	if ((header->result != DNS_OK && header->result != DNS_ERROR) || header->TC)
+		return;
+
+	// records are only rewritten when they are aged, so the response is scanned where it is
+	UINT ttl = 0;
+	int soa_offset = -1;
+	if (ScanRecords((char*) buf, size, 0, ttl, soa_offset) != 0)
+		return;
+
+	// NXDOMAIN, or NODATA (no error but no answers), is only cached along with its SOA
+	bool negative = (header->result != DNS_OK || header->answers == 0);
+	if (negative)
+	{
+		if (soa_offset < 0)
+			return;
+		ttl = NegativeTTL(buf, size, soa_offset);
+	}
+	if (ttl == 0)
+		return;
+	if (ttl > MAX_CACHE_TTL)
+		ttl = MAX_CACHE_TTL;
+
+	// with a CNAME chain in the answer it is the last target that does not exist, not the
+	// question, so only the response itself is cached
+	if (header->result == DNS_ERROR && header->answers == 0)
+		InsertNXDomain(question, question_size, buf, size, soa_offset, ttl);
+
+	int number = StoreEntry(ENTRY_ANSWER, question, question_size, buf, size);
+	if (number < 0)
+		return;
+	CacheEntry& entry = entries[number];
+	entry.negative = negative;
+	entry.inserted = std::chrono::steady_clock::now();
+	entry.expires = entry.inserted + std::chrono::seconds(ttl);
+	entry.prefetched = prefetched;
+	insertions++;
+}
+
+// Copies the cached response to a question into buf (of buf_size bytes) with its TTLs 
+// aged by the time spent in the cache. Expired responses are removed as they are found.
+// If refresh is not NULL it is set when the caller should re-resolve the question ahead
+// of its expiry, which is only asked once until the entry is replaced or the refresh is 
+// cancelled. Returns the size of the response, or 0 if there is no usable response in the cache.
+int DNSCache::Lookup(const char* question, int question_size, char* buf, int buf_size, bool* refresh)
+{
+	int number = FindEntry(ENTRY_ANSWER, question, question_size);
+	auto now = std::chrono::steady_clock::now();
+	if (number >= 0 && now >= entries[number].expires)
+	{
+		RemoveEntry(number);
+		number = -1;
+		expirations++;
+	}
+
+	if (number < 0 || entries[number].record_size > buf_size)
+	{
+		// responses saved by an earlier process are used where they are mapped
+		int size = snapshot.IsOpen() ? LookupSnapshot(question, question_size, buf, buf_size) : 0;
+		if (size > 0)
+		{
+			hits++;
+			snapshot_hits++;
+			if (((DNSHeader*) buf)->result != DNS_OK || ((DNSHeader*) buf)->answers == 0)
+				negative_hits++;
+			return size;
+		}
+
+		// a name (or a name above it) that does not exist answers every type of question
+		if (nxdomain_count > 0)
+			size = LookupNXDomain(question, question_size, buf, buf_size);
+		if (size == 0)
+		{
+			misses++;
+			return 0;
+		}
+		hits++;
+		negative_hits++;
+		return size;
+	}
+
+	CacheEntry& entry = entries[number];
+	int size = entry.record_size;
+	memcpy(buf, RecordOf(entry), size);
+	UINT age = (UINT) std::chrono::duration_cast<std::chrono::seconds>(now - entry.inserted).count();
+	UINT ttl = 0;
+	int soa_offset = -1;
+	if (age > 0)
+		ScanRecords(buf, size, age, ttl, soa_offset);
+
+	hits++;
+	if (entry.negative)
+		negative_hits++;
+	entry.hits++;
+	if (entry.frequency < 3)
+		entry.frequency++;
+	if (entry.prefetched)
+	{
+		prefetches_used++;
+		entry.prefetched = false;
+	}
+
+	// popular entries are refreshed once they are into the last part of their TTL
+	if (refresh != NULL && prefetch_percent > 0 && !entry.refreshing && entry.hits >= PREFETCH_MIN_HITS
+		&& (entry.expires - now) * 100 <= (entry.expires - entry.inserted) * prefetch_percent)
+	{
+		entry.refreshing = true;
+		*refresh = true;
+	}
+	return size;
+}
+
+// Copies the response to a question from the snapshot into buf, aged by the time since
+// it was stored. Returns its size, or 0 if it is missing or has expired.
+int DNSCache::LookupSnapshot(const char* question, int question_size, char* buf, int buf_size)
+{
+	const SnapshotRecord* record = snapshot.Find(question, question_size);
+	if (record == NULL || record->message_size > buf_size)
+		return 0;
+
+	// the mapping is read-only, expired responses are left behind and not saved again
+	ULONGLONG now = CacheSnapshot::Now();
+	if (now >= record->expires)
+	{
+		snapshot_expired++;
+		return 0;
+	}
+
+	int size = record->message_size;
+	memcpy(buf, (const char*) (record + 1) + record->question_size, size);
+	UINT age = (now > record->inserted) ? (UINT) (now - record->inserted) : 0;
+	UINT ttl = 0;
+	int soa_offset = -1;
+	if (age > 0)
+		ScanRecords(buf, size, age, ttl, soa_offset);
+	return size;
+}
+
+// Saves the unexpired responses of the given caches, including those of their snapshots
+// that were not replaced in memory, to a snapshot at path that the caches then map in
+// place of their previous one. Returns the number of responses saved, or -1 on failure.
+int DNSCache::SaveSnapshot(const char* path, std::vector<DNSCache*>& caches)
+{
+	// the times of entries in memory are moved from the steady clock to the wall clock
+	auto now = std::chrono::steady_clock::now();
+	ULONGLONG wall_now = CacheSnapshot::Now();
+	std::unordered_map<std::string, int, QuestionHash, QuestionEqual> saved;
+	std::vector<SnapshotEntry> records;
+	for (size_t c = 0; c < caches.size(); c++)
+	{
+		DNSCache& cache = *caches[c];
+		for (size_t i = 0; i < cache.entries.size(); i++)
+		{
+			CacheEntry& entry = cache.entries[i];
+			if (entry.kind != ENTRY_ANSWER || now >= entry.expires)
+				continue;
+			std::string key(cache.KeyOf(entry), entry.key_size);
+			if (saved.count(key) > 0)
+				continue;
+			saved[key] = 1;
+
+			SnapshotEntry record;
+			record.question = cache.KeyOf(entry);
+			record.question_size = entry.key_size;
+			record.message = cache.RecordOf(entry);
+			record.message_size = entry.record_size;
+			record.negative = entry.negative;
+			record.inserted = wall_now - std::chrono::duration_cast<std::chrono::seconds>(now - entry.inserted).count();
+			record.expires = wall_now + std::chrono::duration_cast<std::chrono::seconds>(entry.expires - now).count();
+			records.push_back(record);
+		}
+	}
+
+	// responses still only in the previous snapshot are carried over
+	for (size_t c = 0; c < caches.size(); c++)
+	{
+		CacheSnapshot& previous = caches[c]->snapshot;
+		for (UINT b = 0; previous.IsOpen() && b < previous.Buckets(); b++)
+		{
+			const SnapshotRecord* stored = previous.Bucket(b);
+			if (stored == NULL || wall_now >= stored->expires)
+				continue;
+			std::string key((const char*) (stored + 1), stored->question_size);
+			if (saved.count(key) > 0)
+				continue;
+			saved[key] = 1;
+
+			SnapshotEntry record;
+			record.question = (const char*) (stored + 1);
+			record.question_size = stored->question_size;
+			record.message = record.question + stored->question_size;
+			record.message_size = stored->message_size;
+			record.negative = (stored->negative != 0);
+			record.inserted = stored->inserted;
+			record.expires = stored->expires;
+			records.push_back(record);
+		}
+	}
+
+	// the image holds copies of everything, so the previous snapshot can be released before it is replaced
+	std::vector<char> image;
+	CacheSnapshot::Format(records, image);
+	for (size_t c = 0; c < caches.size(); c++)
+		caches[c]->snapshot.Close();
+	int result = CacheSnapshot::Write(path, image);
+	for (size_t c = 0; c < caches.size(); c++)
+		caches[c]->snapshot.Open(path);
+	return (result == 0) ? (int) records.size() : -1;
+}
+
+// Allows a refresh of the entry of a question to be asked for again, e.g. after it failed
+void DNSCache::CancelRefresh(const char* question, int question_size)
+{
+	int number = FindEntry(ENTRY_ANSWER, question, question_size);
+	if (number >= 0)
+		entries[number].refreshing = false;
+}
+
+// Looks for an NXDOMAIN entry for the name of a question or any name above it, and if one 
+// is found synthesizes an NXDOMAIN response to the question into buf. Returns the size 
+// of the response, or 0 if none of the names are known not to exist.
+int DNSCache::LookupNXDomain(const char* question, int question_size, char* buf, int buf_size)
+{
+	int name_size = question_size - (int) sizeof(QueryHeader);
+	auto now = std::chrono::steady_clock::now();
+
+	// strip one label at a time, the root itself is never treated as nonexistent
+	for (int offset = 0; offset < name_size - 1; offset += (UCHAR) question[offset] + 1)
+	{
+		int number = FindEntry(ENTRY_NXDOMAIN, question + offset, name_size - offset);
+		if (number < 0)
+			continue;
+
+		CacheEntry& entry = entries[number];
+		if (now >= entry.expires)
+		{
+			RemoveEntry(number);
+			expirations++;
+			continue;
+		}
+		if (entry.frequency < 3)
+			entry.frequency++;
+
+		int record_size = entry.record_size;
+		int size = (int) sizeof(DNSHeader) + question_size + record_size;
+		if (size > buf_size)
+			return 0;
+
+		DNSHeader header;
+		memset(&header, 0, sizeof(header));
+		header.QR = 1;
+		header.RD = 1;
+		header.RA = 1;
+		header.result = DNS_ERROR;
+		header.questions = htons(1);
+		header.authority = htons(1);
+
+		memcpy(buf, &header, sizeof(DNSHeader));
+		memcpy(buf + sizeof(DNSHeader), question, question_size);
+		memcpy(buf + sizeof(DNSHeader) + question_size, RecordOf(entry), record_size);
+
+		// age the TTL of the SOA record
+		UINT age = (UINT) std::chrono::duration_cast<std::chrono::seconds>(now - entry.inserted).count();
+		UINT ttl = 0;
+		int soa_offset = -1;
+		if (age > 0)
+			ScanRecords(buf, size, age, ttl, soa_offset);
+		return size;
+	}
+	return 0;
+}
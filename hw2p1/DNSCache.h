@@ -0,0 +1,246 @@
+#pragma once
+
+// Case-insensitive FNV-1a hash of a question
+struct QuestionHash
+{
+	size_t operator()(const std::string& key) const { return (*this)(key.data(), key.size()); }
+	size_t operator()(const char* key, size_t size) const;
+};
+
+// Case-insensitive comparison of two questions
+struct QuestionEqual
+{
+	bool operator()(const std::string& a, const std::string& b) const { return a.size() == b.size() && (*this)(a.data(), b.data(), a.size()); }
+	bool operator()(const char* a, const char* b, size_t size) const;
+};
+
+/*
+ * The DNSCache class keeps successful responses in memory, keyed by the question section 
+ * they answer (the wire-format name from FormatTypeAQuery followed by qtype and qclass). 
+ * Names are hashed and compared without regard to case. Each response lives for the 
+ * smallest TTL among its answer records, and the TTLs handed out on a hit are reduced 
+ * by the time the response has spent in the cache.
+ *
+ * Negative answers are cached as described in RFC 2308: NXDOMAIN and NODATA responses that 
+ * carry an SOA record in the authority section live for the smaller of the SOA TTL and its 
+ * MINIMUM field. An NXDOMAIN also covers every name below the one that does not exist 
+ * (RFC 8020), so lookups for such names are answered with a synthesized NXDOMAIN.
+ *
+ * With refresh-ahead enabled, a lookup that hits an entry used at least PREFETCH_MIN_HITS
+ * times and within the last part of its TTL asks the caller to re-resolve the question in 
+ * the background, so that popular answers are replaced before they expire.
+ *
+ * The cache can be saved to a snapshot file and a snapshot mapped back in by a later process.
+ * Questions missing from memory are then looked up in the mapped file in place, and its 
+ * responses whose TTL ran out in the meantime are skipped as they are found.
+ *
+ * Memory is bounded: every response is stored with its key in a block of a CacheArena, and
+ * an open-addressing table of entry numbers indexes them. The budget covers this metadata as
+ * well: the entries, index slots, queue positions and ghosts of as many entries as it holds
+ * at CACHE_AVERAGE_ENTRY bytes each are set aside, their number is held to that, and the 
+ * arena gets the rest. Once either runs out, entries are evicted S3-FIFO style. New 
+ * entries go to a small FIFO queue and are evicted
+ * from there unless hit again before they reach its head, in which case they move to the 
+ * main queue, where entries are kept for as long as they are hit between visits of its head.
+ * Keys of entries evicted from the small queue are remembered for a while in a ghost queue,
+ * and entries for those go straight to the main queue. One-off names from a sweep thus only
+ * pass through the small queue and do not push out the names that are used again.
+ *
+ * Every size class of the arena has queues of its own, and room for a record is made by
+ * evicting records of its class, whose blocks it can take, so a burst of responses of one
+ * size never evicts the hot entries of another. A class without entries takes the page of
+ * another class with the fewest live blocks, evicting what is left on it. An insert evicts at
+ * most CACHE_MAX_EVICTIONS entries and is dropped if that makes no room yet, in which case
+ * the entry it would replace is kept and the next insert carries on emptying the page.
+ */
+class DNSCache
+{
+	enum EntryKind : UCHAR { ENTRY_FREE, ENTRY_ANSWER, ENTRY_NXDOMAIN };
+
+	// A cached response to a question, or for NXDOMAIN names the uncompressed SOA record that 
+	// a synthesized response for the name or any name below it carries. The key (question or
+	// name) and the record are stored back to back in an arena block.
+	struct CacheEntry
+	{
+		UCHAR kind = ENTRY_FREE;
+		bool negative = false;
+		USHORT key_size = 0, record_size = 0;
+		UINT block = ARENA_NONE;
+		size_t hash = 0;
+		std::chrono::steady_clock::time_point inserted, expires;
+
+		// Slot of the entry in the index, bumped whenever the entry is removed so that queue 
+		// positions of an earlier use of the entry number can be told apart
+		int slot = -1;
+		UINT generation = 0;
+
+		// Size class of the arena block, whether the entry is in the main queue of the class and
+		// how often it was hit since it was last at the head of a queue (at most 3)
+		UCHAR size_class = 0;
+		bool in_main = false;
+		UCHAR frequency = 0;
+
+		// Hits since the response was stored, whether a refresh of it is outstanding and 
+		// whether it was stored by a refresh and has not been hit since
+		UINT hits = 0;
+		bool refreshing = false;
+		bool prefetched = false;
+	};
+
+	CacheArena arena;
+	std::vector<CacheEntry> entries;
+	std::vector<int> free_entries;
+	size_t answer_count = 0, nxdomain_count = 0;
+
+	// Bytes the cache may take in all, and the number of entries its metadata share allows
+	size_t byte_budget = 0, entry_limit = 0;
+
+	// Open-addressing index of entry numbers, with INDEX_EMPTY and INDEX_REMOVED markers
+	std::vector<int> index;
+	size_t index_used = 0;
+
+	// S3-FIFO queues of entry numbers and generations of every size class of the arena, the bytes
+	// of the live entries in the small and main queue of each, and the number of queue positions
+	// left behind by removed entries
+	std::deque<std::pair<int, UINT>> small_queue[ARENA_CLASSES], main_queue[ARENA_CLASSES];
+	size_t small_bytes[ARENA_CLASSES] = {}, main_bytes[ARENA_CLASSES] = {};
+	size_t class_entries[ARENA_CLASSES] = {};
+	size_t stale_positions = 0;
+
+	// Hashes of keys recently evicted from the small queue, no more than the entry limit, with
+	// a count per hash
+	std::deque<size_t> ghost_queue;
+	std::unordered_map<size_t, int> ghosts;
+
+	// Returns the entry number stored under a key of the given kind, or -1 if there is none
+	int FindEntry(UCHAR kind, const char* key, int key_size);
+
+	// Stores a record under a key of the given kind, replacing any entry already stored under
+	// it and evicting others while the arena is out of budget, at most CACHE_MAX_EVICTIONS of
+	// them. Returns the entry number, or -1 if the record cannot be stored, in which case the
+	// entry it would have replaced is kept.
+	int StoreEntry(UCHAR kind, const char* key, int key_size, const char* record, int record_size);
+
+	// Removes an entry from the index and returns its block to the arena
+	void RemoveEntry(int entry);
+
+	// Evicts one entry of a size class as S3-FIFO does. Returns false if the class has no entries.
+	bool EvictOne(int size_class);
+
+	// Evicts up to max_evictions entries stored in the arena page with the fewest live blocks,
+	// those not hit since they were queued first, so that the page is emptied over as many 
+	// inserts as it takes. Returns the number of entries evicted, or -1 if no page is in use.
+	int ReclaimPage(int max_evictions);
+
+	// Remembers the hash of a key evicted from the small queue, forgetting the oldest ones
+	// beyond the entry limit
+	void AddGhost(size_t hash);
+
+	// Rebuilds the index with room for twice the entries, dropping the removed markers
+	void GrowIndex();
+
+	// Drops the positions of removed entries from the queues once they outnumber the entries
+	void CompactQueues();
+
+	// Returns the bytes of metadata an entry takes at most: the entry itself, a free list slot,
+	// 8 index slots (the index is grown to 4 to 8 per entry), two queue positions and a ghost
+	static size_t EntryMetadata() { return sizeof(CacheEntry) + 9 * sizeof(int) + 2 * sizeof(std::pair<int, UINT>) + CACHE_GHOST_BYTES; }
+
+	// Returns the bytes of metadata allocated, estimated from the sizes of its elements
+	size_t MetadataBytes();
+
+	// Returns the key and the record of an entry
+	const char* KeyOf(CacheEntry& entry) { return arena.At(entry.block); }
+	const char* RecordOf(CacheEntry& entry) { return arena.At(entry.block) + entry.key_size; }
+
+	ULONGLONG hits = 0, misses = 0, negative_hits = 0, insertions = 0, expirations = 0, evictions = 0, dropped = 0;
+	ULONGLONG prefetches_used = 0;
+
+	// Snapshot of an earlier process, consulted on a miss, and what became of its responses
+	CacheSnapshot snapshot;
+	ULONGLONG snapshot_hits = 0, snapshot_expired = 0;
+
+	// Percentage of the TTL at the end of which popular entries are refreshed, 0 if disabled
+	int prefetch_percent = 0;
+
+	// Returns the negative TTL of a response from its SOA record (at soa_offset), capped at 
+	// MAX_NEGATIVE_TTL, or 0 if the SOA record is malformed
+	static UINT NegativeTTL(const char* buf, int size, int soa_offset);
+
+	// Stores the SOA record of an NXDOMAIN response under the name that does not exist
+	void InsertNXDomain(const char* question, int question_size, const char* buf, int size, int soa_offset, UINT ttl);
+
+	// Looks for an NXDOMAIN entry for the name of a question or any name above it, and if one 
+	// is found synthesizes an NXDOMAIN response to the question into buf. Returns the size 
+	// of the response, or 0 if none of the names are known not to exist.
+	int LookupNXDomain(const char* question, int question_size, char* buf, int buf_size);
+
+	// Copies the response to a question from the snapshot into buf, aged by the time since
+	// it was stored. Returns its size, or 0 if it is missing or has expired.
+	int LookupSnapshot(const char* question, int question_size, char* buf, int buf_size);
+
+public:
+
+	// Creates a cache that takes at most 'budget' bytes of arena pages and metadata
+	DNSCache(size_t budget = DEFAULT_CACHE_BYTES);
+
+	// Changes the byte budget, of which the metadata of the entries it allows is set aside and 
+	// the rest given to the arena. Lowering it only limits what is allocated from then on.
+	void SetBudget(size_t bytes);
+
+	// Walks every resource record of a response, reducing each TTL by 'age' seconds 
+	// (never below 0) when age is non-zero, and stores the smallest TTL of the answer 
+	// section in min_answer_ttl and the offset of the first SOA record of the authority
+	// section (or -1) in soa_offset. Returns -1 if the response is malformed or 0 for success.
+	static int ScanRecords(char* buf, int size, UINT age, UINT& min_answer_ttl, int& soa_offset);
+
+	// Stores a response to the given question if it is a complete, successful answer 
+	// with a non-zero TTL, or a negative answer (NXDOMAIN or NODATA) with an SOA record. 
+	// Any previous response to the same question is replaced. 'prefetched' marks responses
+	// to a refresh, so that refreshes which were hit afterwards can be counted.
+	void Insert(const char* question, int question_size, const char* buf, int size, bool prefetched = false);
+
+	// Copies the cached response to a question into buf (of buf_size bytes) with its TTLs 
+	// aged by the time spent in the cache. Expired responses are removed as they are found.
+	// If refresh is not NULL it is set when the caller should re-resolve the question ahead
+	// of its expiry, which is only asked once until the entry is replaced or the refresh is 
+	// cancelled. Returns the size of the response, or 0 if there is no usable response in the cache.
+	int Lookup(const char* question, int question_size, char* buf, int buf_size, bool* refresh = NULL);
+
+	// Allows a refresh of the entry of a question to be asked for again, e.g. after it failed
+	void CancelRefresh(const char* question, int question_size);
+
+	// Maps the snapshot at path and answers questions missing from memory from it. Returns
+	// the number of responses in it, -1 if the file cannot be mapped or -2 if it is not a snapshot.
+	int OpenSnapshot(const char* path) { return snapshot.Open(path); }
+
+	// Saves the unexpired responses of the given caches, including those of their snapshots
+	// that were not replaced in memory, to a snapshot at path that the caches then map in
+	// place of their previous one. Returns the number of responses saved, or -1 on failure.
+	static int SaveSnapshot(const char* path, std::vector<DNSCache*>& caches);
+
+	// Refreshes popular entries within the last 'percent' percent of their TTL, 0 to disable
+	void SetPrefetch(int percent) { prefetch_percent = percent; }
+	int PrefetchPercent() { return prefetch_percent; }
+
+	size_t Size() { return answer_count; }
+	size_t NXDomains() { return nxdomain_count; }
+	ULONGLONG Hits() { return hits; }
+	ULONGLONG NegativeHits() { return negative_hits; }
+	ULONGLONG Misses() { return misses; }
+	ULONGLONG Insertions() { return insertions; }
+	ULONGLONG Expirations() { return expirations; }
+	ULONGLONG Evictions() { return evictions; }
+
+	// Inserts given up on because CACHE_MAX_EVICTIONS evictions did not make room for them
+	ULONGLONG Dropped() { return dropped; }
+
+	// Bytes of the arena blocks holding entries, of the arena pages and of the budget, each
+	// with the metadata of the entries
+	size_t BytesUsed() { return arena.BytesUsed() + MetadataBytes(); }
+	size_t BytesReserved() { return arena.BytesReserved() + MetadataBytes(); }
+	size_t Budget() { return byte_budget; }
+	ULONGLONG PrefetchesUsed() { return prefetches_used; }
+	ULONGLONG SnapshotHits() { return snapshot_hits; }
+	ULONGLONG SnapshotExpired() { return snapshot_expired; }
+};
@@ -0,0 +1,397 @@
+// DNSMessage.cpp
+// CSCE 463-500
+
+#include "pch.h"
+
+DNSNameMemo::DNSNameMemo()
+{
+	for (int i = 0; i < NAME_MEMO_SLOTS; i++)
+		entries[i].offset = -1;
+}
+
+// Looks up the decoded text of the suffix starting at 'offset'. Returns false if it is not known.
+bool DNSNameMemo::Find(int offset, const char*& suffix, int& length)
+{
+	if (count == 0)
+		return false;
+
+	for (int i = 0; i < NAME_MEMO_SLOTS; i++)
+	{
+		Entry& entry = entries[(offset + i) & (NAME_MEMO_SLOTS - 1)];
+		if (entry.offset == -1)
+			return false;
+		if (entry.offset == offset)
+		{
+			suffix = text + entry.start;
+			length = entry.length;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Remembers a decoded name of 'length' characters whose labels start at the given message
+// offsets and at the given positions in the text
+void DNSNameMemo::Store(const char* name, int length, const int* offsets, const int* starts, int labels)
+{
+	if (labels == 0 || used + length > NAME_MEMO_BYTES)
+		return;
+
+	int base = used;
+	memcpy(text + used, name, length);
+	used += length;
+
+	// keep the table at most half full so that probes stay short
+	for (int label = 0; label < labels && count < NAME_MEMO_SLOTS / 2; label++)
+	{
+		for (int i = 0; i < NAME_MEMO_SLOTS; i++)
+		{
+			Entry& entry = entries[(offsets[label] + i) & (NAME_MEMO_SLOTS - 1)];
+			if (entry.offset == offsets[label])
+				break;
+			if (entry.offset != -1)
+				continue;
+
+			entry.offset = offsets[label];
+			entry.start = (USHORT) (base + starts[label]);
+			entry.length = (USHORT) (length - starts[label]);
+			count++;
+			break;
+		}
+	}
+}
+
+// Walks the (possibly compressed) name starting at 'offset', writing it to out either as
+// dotted text or as an uncompressed wire-format name. The number of bytes written is stored
+// in 'written'. Compression pointers must point strictly before the previous one, which 
+// rules out loops while accepting any number of hops. Text of suffixes already in the memo 
+// is copied rather than decoded, and the suffixes of a decoded name are added to it.
+// Returns PARSE_OK or the reason the name is malformed or does not fit.
+static int WalkName(const char* buf, int size, int offset, char* out, int out_size, bool text, int& written, DNSNameMemo* memo)
+{
+	int limit = offset;
+	int wire_size = 0;
+	written = 0;
+
+	// message offsets and text positions of the labels decoded so far
+	int label_offsets[MAX_NAME_SIZE / 2];
+	int label_starts[MAX_NAME_SIZE / 2];
+	int labels = 0;
+
+	while (true)
+	{
+		if (offset >= size)
+			return PARSE_TRUNCATED_NAME;
+
+		UCHAR length = (UCHAR) buf[offset];
+		if (length >= 0xC0)
+		{
+			if (offset + 1 >= size)
+				return PARSE_TRUNCATED_JUMP;
+
+			int target = ((length & 0x3F) << 8) | (UCHAR) buf[offset + 1];
+			if (target < (int) sizeof(DNSHeader))
+				return PARSE_JUMP_HEADER;
+			if (target >= size)
+				return PARSE_JUMP_BEYOND;
+			if (target >= limit)
+				return PARSE_JUMP_LOOP;
+			offset = limit = target;
+			continue;
+		}
+
+		const char* suffix = NULL;
+		int suffix_length = 0;
+		if (text && memo != NULL && memo->Find(offset, suffix, suffix_length))
+		{
+			// the text of a name is two bytes shorter than its wire form
+			int needed = ((written > 0) ? 1 : 0) + suffix_length + 1;
+			if (written + needed - 1 > MAX_NAME_SIZE - 3)
+				return PARSE_NAME_TOO_LONG;
+			if (written + needed > out_size)
+				return PARSE_NAME_TOO_LONG;
+			if (written > 0 && suffix_length > 0)
+				out[written++] = '.';
+			memcpy(out + written, suffix, suffix_length);
+			written += suffix_length;
+			out[written] = 0;
+			memo->Store(out, written, label_offsets, label_starts, labels);
+			return PARSE_OK;
+		}
+
+		if (length > MAX_LABEL_SIZE)
+			return PARSE_BAD_LABEL;
+		if (offset + 1 + length > size)
+			return PARSE_TRUNCATED_NAME;
+		wire_size += length + 1;
+		if (wire_size > MAX_NAME_SIZE - 1)
+			return PARSE_NAME_TOO_LONG;
+
+		if (text)
+		{
+			// labels are separated by '.', the root label ends the text
+			int needed = ((written > 0) ? 1 : 0) + length + 1;
+			if (written + needed > out_size)
+				return PARSE_NAME_TOO_LONG;
+			if (length == 0)
+			{
+				out[written] = 0;
+				if (memo != NULL)
+					memo->Store(out, written, label_offsets, label_starts, labels);
+				return PARSE_OK;
+			}
+			if (written > 0)
+				out[written++] = '.';
+			label_offsets[labels] = offset;
+			label_starts[labels++] = written;
+			memcpy(out + written, buf + offset + 1, length);
+			written += length;
+		}
+		else
+		{
+			if (written + length + 1 > out_size)
+				return PARSE_NAME_TOO_LONG;
+			memcpy(out + written, buf + offset, (size_t) length + 1);
+			written += length + 1;
+			if (length == 0)
+				return PARSE_OK;
+		}
+		offset += length + 1;
+	}
+}
+
+// Decodes the name into out (of out_size bytes) as dotted text, following compression
+// pointers, each of which must point before the previous one so that every name is read
+// in a bounded number of steps. Returns PARSE_OK or the reason the name is malformed or 
+// does not fit.
+int DNSName::Decode(char* out, int out_size) const
+{
+	int written = 0;
+	return WalkName(buf, size, offset, out, out_size, true, written, memo);
+}
+
+// Copies the name into out (of out_size bytes) as an uncompressed wire-format name.
+// Returns the number of bytes written, or -1 if the name is malformed or does not fit.
+int DNSName::Expand(char* out, int out_size) const
+{
+	int written = 0;
+	if (WalkName(buf, size, offset, out, out_size, false, written, NULL) != PARSE_OK)
+		return -1;
+	return written;
+}
+
+// Returns a view of a name stored in the rdata of the record (e.g. of CNAME, NS or PTR
+// records), 'skip' bytes into the rdata. Questions have no rdata, their view is empty.
+DNSName DNSRecord::RdataName(int skip) const
+{
+	DNSName rdata_name;
+	rdata_name.buf = name.buf;
+	rdata_name.size = name.size;
+	rdata_name.offset = (rdata != NULL) ? (int) (rdata - name.buf) + skip : name.size;
+	rdata_name.memo = name.memo;
+	return rdata_name;
+}
+
+// Reads the EDNS(0) fields of an OPT record, which keeps the advertised payload size in
+// its class and the extended RCODE, version and flags in its TTL. Returns false if the 
+// record is not an OPT record of the additional section.
+bool DNSRecord::ReadEDNS(EDNSInfo& info) const
+{
+	if (type != DNS_OPT || section != SECTION_ADDITIONAL)
+		return false;
+
+	info.payload_size = rclass;
+	info.extended_rcode = (UCHAR) (ttl >> 24);
+	info.version = (UCHAR) (ttl >> 16);
+	info.dnssec_ok = (ttl & 0x8000) != 0;
+	return true;
+}
+
+// Starts reading a message of 'size' bytes at buf. The buffer must stay valid while the
+// message and the records read from it are used.
+DNSMessage::DNSMessage(const char* buf, int size) : buf(buf), size(size)
+{
+	offset = sizeof(DNSHeader);
+	section = SECTION_QUESTION;
+	remaining = 0;
+	if (size < (int) sizeof(DNSHeader))
+		error = PARSE_SHORT_HEADER;
+	else
+		remaining = Count(SECTION_QUESTION);
+}
+
+// Returns the number of questions or records the header announces for a section
+USHORT DNSMessage::Count(DNSSection which) const
+{
+	if (size < (int) sizeof(DNSHeader))
+		return 0;
+
+	const DNSHeader* header = Header();
+	switch (which)
+	{
+	case SECTION_QUESTION:
+		return ntohs(header->questions);
+	case SECTION_ANSWER:
+		return ntohs(header->answers);
+	case SECTION_AUTHORITY:
+		return ntohs(header->authority);
+	case SECTION_ADDITIONAL:
+		return ntohs(header->additional);
+	default:
+		return 0;
+	}
+}
+
+// Reads the next question or record into 'record'. Returns false once every section has
+// been read or if the message is malformed, in which case Error() returns the reason.
+bool DNSMessage::Next(DNSRecord& record)
+{
+	if (error != PARSE_OK)
+		return false;
+
+	while (remaining == 0)
+	{
+		if (++section >= SECTION_COUNT)
+			return false;
+		remaining = Count((DNSSection) section);
+	}
+
+	// check if we reached end of packet in the middle of a section
+	if (offset >= size)
+	{
+		error = PARSE_NOT_ENOUGH_RECORDS;
+		return false;
+	}
+
+	record.section = (DNSSection) section;
+	record.offset = offset;
+	record.name.buf = buf;
+	record.name.size = size;
+	record.name.offset = offset;
+	record.name.memo = &memo;
+
+	int end = SkipName(buf, size, offset);
+	if (end < 0)
+	{
+		error = PARSE_TRUNCATED_NAME;
+		return false;
+	}
+	record.fixed_offset = end;
+
+	if (section == SECTION_QUESTION)
+	{
+		if (end + (int) sizeof(QueryHeader) > size)
+		{
+			error = PARSE_TRUNCATED_QUESTION;
+			return false;
+		}
+
+		const QueryHeader* question = (const QueryHeader*) (buf + end);
+		record.type = ntohs(question->qType);
+		record.rclass = ntohs(question->qClass);
+		record.ttl = 0;
+		record.rdata = NULL;
+		record.rdlength = 0;
+		offset = end + sizeof(QueryHeader);
+	}
+	else
+	{
+		if (end + (int) sizeof(ResourceRecord) > size)
+		{
+			error = PARSE_TRUNCATED_RR;
+			return false;
+		}
+
+		const ResourceRecord* fixed = (const ResourceRecord*) (buf + end);
+		record.type = ntohs(fixed->rType);
+		record.rclass = ntohs(fixed->rClass);
+		record.ttl = ntohl(fixed->rTTL);
+		record.rdlength = ntohs(fixed->rLength);
+		record.rdata = buf + end + sizeof(ResourceRecord);
+
+		// the length field must not indicate content past the packet boundary
+		offset = end + (int) sizeof(ResourceRecord) + record.rdlength;
+		if (offset > size)
+		{
+			error = PARSE_RDATA_BEYOND;
+			return false;
+		}
+	}
+
+	remaining--;
+	return true;
+}
+
+// Returns the offset just past the (possibly compressed) name starting at 'offset'
+// in a message of 'size' bytes, or -1 if the name runs past the end of the message.
+int DNSMessage::SkipName(const char* buf, int size, int offset)
+{
+	while (offset < size)
+	{
+		UCHAR length = (UCHAR) buf[offset];
+		// a compression pointer ends the name after its two bytes
+		if (length >= 0xC0)
+			return (offset + 2 <= size) ? offset + 2 : -1;
+		if (length > MAX_LABEL_SIZE)
+			return -1;
+		if (length == 0)
+			return offset + 1;
+		offset += length + 1;
+	}
+	return -1;
+}
+
+// Looks for an OPT record in the additional section of a message and reads its EDNS(0) fields.
+// Returns 1 if one was found, 0 if the message has none or -1 if the message is malformed.
+int DNSMessage::FindEDNS(const char* buf, int size, EDNSInfo& info)
+{
+	DNSMessage message(buf, size);
+	if (message.Count(SECTION_ADDITIONAL) == 0)
+		return 0;
+
+	DNSRecord record;
+	while (message.Next(record))
+	{
+		if (record.ReadEDNS(info))
+			return 1;
+	}
+	return (message.Error() == PARSE_OK) ? 0 : -1;
+}
+
+// Returns a description of a parse error, as printed after "++ "
+const char* DNSMessage::ErrorText(int error)
+{
+	switch (error)
+	{
+	case PARSE_OK:
+		return "no error";
+	case PARSE_SHORT_HEADER:
+		return "invalid reply: smaller than fixed header";
+	case PARSE_NOT_ENOUGH_RECORDS:
+		return "invalid section: not enough records";
+	case PARSE_TRUNCATED_QUESTION:
+		return "invalid record: truncated fixed query header";
+	case PARSE_TRUNCATED_RR:
+		return "invalid record: truncated fixed RR header";
+	case PARSE_RDATA_BEYOND:
+		return "invalid record: RR value length beyond packet";
+	case PARSE_BAD_RDATA:
+		return "invalid record: RR value length does not match its type";
+	case PARSE_TRUNCATED_NAME:
+		return "invalid record: truncated name";
+	case PARSE_TRUNCATED_JUMP:
+		return "invalid record: truncated jump offset";
+	case PARSE_JUMP_HEADER:
+		return "invalid record: jump into fixed header";
+	case PARSE_JUMP_BEYOND:
+		return "invalid record: jump beyond packet boundary";
+	case PARSE_JUMP_LOOP:
+		return "invalid record: jump loop (pointer does not point backwards)";
+	case PARSE_BAD_LABEL:
+		return "invalid record: unknown label type";
+	case PARSE_NAME_TOO_LONG:
+		return "invalid record: name longer than 255 bytes";
+	default:
+		return "invalid reply: unknown error";
+	}
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+// Sections of a DNS message in the order they appear on the wire
+enum DNSSection
+{
+	SECTION_QUESTION,
+	SECTION_ANSWER,
+	SECTION_AUTHORITY,
+	SECTION_ADDITIONAL,
+	SECTION_COUNT
+};
+
+// Reasons a message (or a name inside it) could not be parsed
+enum DNSParseError
+{
+	PARSE_OK,
+	PARSE_SHORT_HEADER,
+	PARSE_NOT_ENOUGH_RECORDS,
+	PARSE_TRUNCATED_QUESTION,
+	PARSE_TRUNCATED_RR,
+	PARSE_RDATA_BEYOND,
+	PARSE_BAD_RDATA,
+	PARSE_TRUNCATED_NAME,
+	PARSE_TRUNCATED_JUMP,
+	PARSE_JUMP_HEADER,
+	PARSE_JUMP_BEYOND,
+	PARSE_JUMP_LOOP,
+	PARSE_BAD_LABEL,
+	PARSE_NAME_TOO_LONG
+};
+
+/*
+ * The DNSNameMemo class remembers the text of every name suffix decoded from one message,
+ * keyed by the offset of its first label. Records that point back to a name decoded before
+ * (e.g. dozens of answers compressed against the question) then copy its text instead of
+ * walking the labels again. Storage is fixed, once it is used up names are decoded as usual.
+ */
+class DNSNameMemo
+{
+	struct Entry
+	{
+		int offset;
+		USHORT start;
+		USHORT length;
+	};
+
+	Entry entries[NAME_MEMO_SLOTS];
+	char text[NAME_MEMO_BYTES];
+	int used = 0;
+	int count = 0;
+
+public:
+
+	DNSNameMemo();
+
+	// Looks up the decoded text of the suffix starting at 'offset'. Returns false if it is not known.
+	bool Find(int offset, const char*& suffix, int& length);
+
+	// Remembers a decoded name of 'length' characters whose labels start at the given message
+	// offsets and at the given positions in the text
+	void Store(const char* name, int length, const int* offsets, const int* starts, int labels);
+};
+
+// A (possibly compressed) name inside a message. Nothing is decoded until it is asked for.
+struct DNSName
+{
+	const char* buf = NULL;
+	int size = 0;
+	int offset = 0;
+
+	// Suffixes decoded from the same message, or NULL
+	DNSNameMemo* memo = NULL;
+
+	// Decodes the name into out (of out_size bytes) as dotted text, following compression
+	// pointers, each of which must point before the previous one so that every name is read
+	// in a bounded number of steps. Returns PARSE_OK or the reason the name is malformed or 
+	// does not fit.
+	int Decode(char* out, int out_size) const;
+
+	// Copies the name into out (of out_size bytes) as an uncompressed wire-format name.
+	// Returns the number of bytes written, or -1 if the name is malformed or does not fit.
+	int Expand(char* out, int out_size) const;
+};
+
+// Contents of the EDNS(0) OPT pseudo-record of a message (RFC 6891)
+struct EDNSInfo
+{
+	USHORT payload_size = 0;
+	UCHAR extended_rcode = 0;
+	UCHAR version = 0;
+	bool dnssec_ok = false;
+};
+
+// A question or resource record of a message. The fixed fields are read out of the message,
+// the name and rdata are views into it. Questions have no TTL and no rdata.
+struct DNSRecord
+{
+	DNSSection section = SECTION_QUESTION;
+	DNSName name;
+	USHORT type = 0;
+	USHORT rclass = 0;
+	UINT ttl = 0;
+	const char* rdata = NULL;
+	USHORT rdlength = 0;
+
+	// Offset of the record itself and of its fixed fields (type, class, TTL, length) within the message
+	int offset = 0;
+	int fixed_offset = 0;
+
+	// Returns a view of a name stored in the rdata of the record (e.g. of CNAME, NS or PTR
+	// records), 'skip' bytes into the rdata. Questions have no rdata, their view is empty.
+	DNSName RdataName(int skip = 0) const;
+
+	// Reads the EDNS(0) fields of an OPT record, which keeps the advertised payload size in
+	// its class and the extended RCODE, version and flags in its TTL. Returns false if the 
+	// record is not an OPT record of the additional section.
+	bool ReadEDNS(EDNSInfo& info) const;
+};
+
+/*
+ * The DNSMessage class is a zero-copy reader over a DNS message held in a receive buffer.
+ * Questions and records are returned one at a time, in wire order, as DNSRecord views that
+ * point back into the buffer; names are only skipped over until someone decodes them, and
+ * suffixes already decoded are remembered for the rest of the message. The reader keeps no 
+ * state outside of itself, so any number of messages can be read at once from any number 
+ * of threads, and reading never copies or allocates.
+ */
+class DNSMessage
+{
+	const char* buf;
+	int size;
+
+	int offset;
+	int section;
+	int remaining;
+	int error = PARSE_OK;
+
+	DNSNameMemo memo;
+
+public:
+
+	// Starts reading a message of 'size' bytes at buf. The buffer must stay valid while the
+	// message and the records read from it are used.
+	DNSMessage(const char* buf, int size);
+
+	// Records hold a pointer to the memo of their message, so it must not be copied
+	DNSMessage(const DNSMessage&) = delete;
+	DNSMessage& operator=(const DNSMessage&) = delete;
+
+	// Reads the next question or record into 'record'. Returns false once every section has
+	// been read or if the message is malformed, in which case Error() returns the reason.
+	bool Next(DNSRecord& record);
+
+	// Returns the number of questions or records the header announces for a section
+	USHORT Count(DNSSection which) const;
+
+	const DNSHeader* Header() const { return (const DNSHeader*) buf; }
+	const char* Data() const { return buf; }
+	int Size() const { return size; }
+	int Error() const { return error; }
+
+	// Returns the offset just past the (possibly compressed) name starting at 'offset'
+	// in a message of 'size' bytes, or -1 if the name runs past the end of the message.
+	static int SkipName(const char* buf, int size, int offset);
+
+	// Looks for an OPT record in the additional section of a message and reads its EDNS(0) fields.
+	// Returns 1 if one was found, 0 if the message has none or -1 if the message is malformed.
+	static int FindEDNS(const char* buf, int size, EDNSInfo& info);
+
+	// Returns a description of a parse error, as printed after "++ "
+	static const char* ErrorText(int error);
+};
@@ -5,13 +5,12 @@
 
 #include "pch.h"
 
-// Basic constructor for the DNS resolver class Initializes WinSock and opens and binds a UDP socket
-DNSResolver::DNSResolver()
+// Basic constructor for the DNS resolver class. Initializes WinSock and opens the UDP socket
+// of the I/O engine using the given backend.
+DNSResolver::DNSResolver(IOBackend backend) : tcp(engine)
 {
 	WSADATA wsa_data;
 	WORD w_ver_requested;
-	struct sockaddr_in local;
-	memset(&local, 0, sizeof(local));
 
 	// Initialize WinSock
 	w_ver_requested = MAKEWORD(2, 2);
@@ -21,42 +20,36 @@ DNSResolver::DNSResolver()
 		exit(EXIT_FAILURE);
 	}
 
-	// Open a UDP socket
-	sock = socket(AF_INET, SOCK_DGRAM, NULL);
-	if (sock == INVALID_SOCKET)
+	// Open and bind the UDP socket owned by the I/O engine
+	if (engine.Open(backend) != 0)
 	{
-		printf("  ++ program error: socket() generated error %d\n", WSAGetLastError());
 		WSACleanup();
 		exit(EXIT_FAILURE);
 	}
+	engine.SetMetrics(&metrics);
+	engine.SetDatagramHandler([this](char* buf, int size, struct sockaddr_in& from) { ReceiveDNSQuery(buf, size, from); });
+	tcp.SetMessageHandler([this](char* buf, int size, int upstream) { ReceiveDNSQuery(buf, size, upstreams.At(upstream).addr); });
 
-	// Bind socket to local machine
-	local.sin_family = AF_INET;
-	local.sin_addr.s_addr = INADDR_ANY;
-	local.sin_port = htons(0);
-
-	if (bind(sock, (struct sockaddr*) &local, sizeof(local)) == SOCKET_ERROR)
-	{
-		printf("  ++ program error: bind() generated error %d\n", WSAGetLastError());
-		WSACleanup();
-		exit(EXIT_FAILURE);
-	}
-
-	// Set up address for local DNS server
-	memset(&remote, 0, sizeof(remote));
-	remote.sin_family = AF_INET;
-	remote.sin_port = htons(DNS_PORT);
-
-	srand( (unsigned) time(NULL));
-	curr_id = (rand() % 65535) + 1;
+	table.reset(new InFlightTable(DEFAULT_WINDOW));
 }
 
-// Destructor cleans up winsock and closes socket
+// Destructor closes the socket of the I/O engine and cleans up winsock
 DNSResolver::~DNSResolver()
 {
-	if (packet != NULL)
-		free(packet);
-	closesocket(sock);
+	tcp.CloseAll();
+	if (listen_sock != INVALID_SOCKET)
+	{
+		engine.Unwatch(listen_sock);
+		closesocket(listen_sock);
+	}
+	if (stream_listen_sock != INVALID_SOCKET)
+	{
+		engine.Unwatch(stream_listen_sock);
+		closesocket(stream_listen_sock);
+	}
+	while (!client_streams.empty())
+		CloseClientStream(client_streams.begin()->first);
+	engine.Close();
 	WSACleanup();
 }
 
@@ -71,213 +64,609 @@ int DNSResolver::printAndReturn(const char* msg, bool wsa = false)
 	return -1;
 }
 
-// Create valid Type A query string based on supplied hostname string (e.x. www.google.com -> 3www6google3com0)
-// Returns the dynamically allocated formatted query string of NULL in the event of an error
-char* DNSResolver::FormatTypeAQuery(char* lookup_string)
+// Write the label-encoded form of a hostname into buf (e.x. www.google.com -> 3www6google3com0) in a 
+// single pass. A single trailing '.' is accepted. Returns the number of bytes written, or -1 if a label
+// is empty or longer than MAX_LABEL_SIZE, or the encoded name does not fit in bufsize bytes.
+int DNSResolver::FormatTypeAQuery(const char* lookup_string, char* buf, int bufsize)
 {
-	UCHAR counter = 0;
-	DWORD start_index = 0;
-
-	// Allocate memory for the formatted query string
-	char* query_string = (char*) malloc(strlen(lookup_string) + 2);
-	if (query_string == NULL)
-		return NULL;
-
-	// Find the next '.' in the lookup string and update the query string with the number of characters found
-	for (unsigned i = 0; i < strlen(lookup_string); i++)
+	// the length byte of the current label is filled in once the label ends
+	int label_start = 0;
+	int position = 1;
+	for (const char* c = lookup_string; *c != 0; c++)
 	{
-		if (lookup_string[i] == '.')
+		// leave room for the terminating root label
+		if (position >= bufsize - 1)
+			return -1;
+
+		if (*c != '.')
 		{
-			query_string[start_index] = counter;
-			memcpy(query_string + start_index + 1, lookup_string + start_index, (size_t) i - start_index);
-			start_index = i + 1;
-				counter = 0;
+			buf[position++] = *c;
 			continue;
 		}
-		counter++;
+
+		int label_size = position - label_start - 1;
+		if (label_size == 0 || label_size > MAX_LABEL_SIZE)
+			return -1;
+		buf[label_start] = (char) label_size;
+		label_start = position++;
+
+		// a trailing '.' names the root explicitly
+		if (c[1] == 0)
+		{
+			buf[label_start] = 0;
+			return position;
+		}
+	}
+
+	int label_size = position - label_start - 1;
+	if (label_size == 0 || label_size > MAX_LABEL_SIZE)
+		return -1;
+	buf[label_start] = (char) label_size;
+	buf[position++] = 0;
+	return position;
+}
+
+// Write a basic recursive DNS query header with the given TXID to the start of buf
+void DNSResolver::CreateDNSHeader(USHORT txid, char* buf)
+{
+	DNSHeader* header = (DNSHeader*) buf;
+	header->ID         = htons(txid);
+	header->QR         = 0;
+	header->opcode     = 0;
+	header->AA         = 0;
+	header->TC         = 0;
+	header->RD         = 1;
+	header->RA         = 0;
+	header->reserved   = 0;
+	header->result     = 0;
+	header->questions  = htons(1);
+	header->answers    = 0;
+	header->authority  = 0;
+	header->additional = 0;
+}
+
+// Create the question section (label-encoded name followed by the query header) for a lookup
+// of the given type (A, or PTR for an IPv4 or IPv6 address) directly in the question buffers, along 
+// with the dotted form of the question. The encoded question doubles as the cache key of the lookup.
+// Returns the size of the question or -1 if the lookup could not be encoded.
+int DNSResolver::CreateDNSQuestion(DWORD query_type, char* lookup, DNSQuestion& question)
+{
+	// the reverse name is written straight into the question
+	if (query_type == DNS_PTR)
+	{
+		UCHAR address[16];
+		bool ipv6;
+		if (!ReverseSweep::ParseAddress(lookup, address, ipv6))
+			return -1;
+		ReverseSweep::EncodeReverse(address, ipv6, question);
+		return question.size;
 	}
 
-	/*
-	 * Update the last size indicator to be equal to the number of characters 
-	 * left in the lookup string, copy characters and null terminate the query string
-	 *
-	 * Warning C6386 because we're writing to a string with size 
-	 * strlen(lookup_string) + 2 bytes but 2 bytes might be written.
-	 * This will not cause buffer overrun because strlen(lookup_string) >= 0
-	 */ 
-	query_string[start_index] = counter;
-	memcpy(query_string + start_index + 1, lookup_string + start_index, strlen(lookup_string) - start_index);
-	query_string[strlen(lookup_string) + 1] = 0;
+	question.type = query_type;
+	if (strcpy_s(question.text, MAX_NAME_SIZE, lookup) != 0)
+		return -1;
+	int name_size = FormatTypeAQuery(lookup, question.wire, MAX_NAME_SIZE - 1);
+	if (name_size < 0)
+		return -1;
+
+	QueryHeader* qheader = (QueryHeader*) (question.wire + name_size);
+	qheader->qType = (query_type == DNS_A) ? htons(DNS_A) : htons(DNS_PTR);
+	qheader->qClass = htons(1);
+	question.size = name_size + (int) sizeof(QueryHeader);
+	return question.size;
+}
+
+// Initialize a valid DNS Query packet in the packet buffer of the query slot from a basic recursive
+// header and an encoded question, followed by an OPT record advertising the EDNS(0) payload size
+// if EDNS is on. Returns the final size of the formatted DNS packet.
+int DNSResolver::CreateDNSQueryPacket(PendingQuery& query, DNSQuestion& question)
+{
+	CreateDNSHeader(query.txid, query.packet);
+	memcpy(query.packet + sizeof(DNSHeader), question.wire, question.size);
+	query.question_size = question.size;
+	query.packet_size = (int) sizeof(DNSHeader) + question.size;
+	query.edns = (edns_size > 0);
+	if (!query.edns)
+		return query.packet_size;
+
+	// the OPT record has the root as its name, the payload size as its class and the extended 
+	// RCODE, version and flags (all 0) in place of its TTL
+	ResourceRecord opt;
+	opt.rType = htons(DNS_OPT);
+	opt.rClass = htons(edns_size);
+	opt.rTTL = 0;
+	opt.rLength = 0;
+	query.packet[query.packet_size++] = 0;
+	memcpy(query.packet + query.packet_size, &opt, sizeof(ResourceRecord));
+	query.packet_size += sizeof(ResourceRecord);
+	((DNSHeader*) query.packet)->additional = htons(1);
+	return query.packet_size;
+}
+
+// Looks up the question of a lookup in the answer cache. On a hit, the aged response is copied
+// into buf (MAX_UDP_SIZE bytes) and 'hit' is filled in as if the response had been received for
+// it. A popular answer near its expiry is re-resolved in the background only if refresh_ahead
+// is set, i.e. if an event loop will run to receive it. Returns the size of the cached response,
+// or 0 on a miss.
+int DNSResolver::LookupCache(char* lookup, DNSQuestion& question, PendingQuery& hit, char* buf, bool refresh_ahead)
+{
+	if (!cache_enabled)
+		return 0;
+
+	bool refresh = false;
+	int size = cache.Lookup(question.wire, question.size, buf, MAX_UDP_SIZE, refresh_ahead ? &refresh : NULL);
+	metrics.Add((size > 0) ? METRIC_CACHE_HITS : METRIC_CACHE_MISSES);
+	if (size == 0)
+		return 0;
+	if (refresh)
+		RefreshAhead(question);
+
+	hit.from_cache = true;
+	hit.txid = ntohs(((DNSHeader*)buf)->ID);
+	hit.type = question.type;
+	strcpy_s(hit.lookup, MAX_NAME_SIZE, lookup);
+	strcpy_s(hit.question, MAX_NAME_SIZE, question.text);
+	hit.start_time = std::chrono::steady_clock::now();
+	return size;
+}
 
-	return query_string;
+// Re-resolves a cached question in the background so that its answer is replaced before it
+// expires. Nothing is sent if the question is already outstanding, and the refresh is left
+// to a later hit if the window is full.
+void DNSResolver::RefreshAhead(DNSQuestion& question)
+{
+	if (table->FindQuestion(question.wire, question.size) != NULL)
+		return;
+
+	// the response is cached as it arrives, a failed refresh may be tried again
+	PendingQuery* query = PrepareQuery(question.text, question, [this](PendingQuery& query, char* buf, int response_size)
+	{
+		if (response_size <= 0)
+			cache.CancelRefresh(query.packet + sizeof(DNSHeader), query.question_size);
+	});
+	if (query == NULL)
+	{
+		cache.CancelRefresh(question.wire, question.size);
+		return;
+	}
+
+	query->prefetch = true;
+	prefetches_sent++;
+	if (SendDNSQuery(*query) == SOCKET_ERROR)
+		CompleteQuery(*query, NULL, -1);
 }
 
-// Create valid Type PTR query string based on supplied IP string (e.x. 192.168.2.1 -> 1.2.168.192.in-addr.arpa)
-// Returns the dynamically allocated formatted query string of NULL in the event of an error
-char* DNSResolver::FormatTypePTRQuery(char* lookup_string)
+// Reserves an in-flight slot for an encoded question and creates its packet. The callback 
+// is called exactly once when the query is answered, times out or fails.
+// Returns NULL if the window is full.
+PendingQuery* DNSResolver::PrepareQuery(char* lookup, DNSQuestion& question, QueryCallback callback)
 {
-	// Allocate memory for the formatted query string
-	char* temp_query_string = (char*)malloc(strlen(lookup_string) + 14);
-	if (temp_query_string == NULL)
+	PendingQuery* query = table->Allocate();
+	if (query == NULL)
 		return NULL;
 
-	// Reverse IP of lookup string and copy it to temporary query string
-	DWORD rev_ip = inet_addr(lookup_string);
-	rev_ip = htonl(rev_ip);
-	struct in_addr lookup_addr;
-	lookup_addr.s_addr = rev_ip;
-	memcpy(temp_query_string, inet_ntoa(lookup_addr), strlen(lookup_string));
-
-	// Append ".in-addr.arpa" to temporary query string
-	char append_string[] = ".in-addr.arpa\0";
-	for (int i = 0; i < 14; i++)
-		temp_query_string[strlen(lookup_string) + i] = append_string[i];
-
-	// Print query and get the query string with explicit sizes in place of the '.' character
-	printf("Query   : %s, ", temp_query_string);
-	char* query_string = FormatTypeAQuery(temp_query_string);
-	// Free temporary query string
-	free(temp_query_string);
-
-	return query_string;
-}
-
-// Create and return basic recursive DNS query header
-DNSHeader DNSResolver::CreateDNSHeader()
-{
-	DNSHeader header;
-	header.ID         = htons(curr_id);
-	header.QR         = 0;
-	header.opcode     = 0;
-	header.AA         = 0;
-	header.TC         = 0;
-	header.RD         = 1;
-	header.RA         = 0;
-	header.reserved   = 0;
-	header.result     = 0;
-	header.questions  = htons(1);
-	header.answers    = 0;
-	header.authority  = 0;
-	header.additional = 0;
-	return header;
-}
-
-// Initialize a valid DNS Query packet given the type of query (A or PTR) and the lookup string.
-// Also take in the packet_size (initially 0) and modify it to reflect the final size of the 
-// formatted DNS packet.
-void DNSResolver::CreateDNSQueryPacket(DWORD query_type, char* lookup, int &packet_size)
-{
-	// Create query header
-	DNSHeader pheader = CreateDNSHeader();
-	QueryHeader qheader;
-	qheader.qClass = htons(1);
-	qheader.qType = (query_type == DNS_A) ? htons(DNS_A) : htons(DNS_PTR);
-
-	// Print information and get formatted lookup string
-	printf("Lookup  : %s\n", lookup);
-	char* formatted_lookup = (query_type == DNS_A) ? FormatTypeAQuery(lookup) : FormatTypePTRQuery(lookup);
-	if (formatted_lookup == NULL)
+	query->type = question.type;
+	strcpy_s(query->lookup, MAX_NAME_SIZE, lookup);
+	strcpy_s(query->question, MAX_NAME_SIZE, question.text);
+	CreateDNSQueryPacket(*query, question);
+	query->verbose = false;
+	query->from_cache = false;
+	query->tcp = false;
+	query->prefetch = false;
+	query->sent_mask = 0;
+	query->attempt_mask = 0;
+	query->hedge_mask = 0;
+	query->upstream = -1;
+	query->encode_time = query->send_time = query->receive_time = query->parse_time = std::chrono::steady_clock::time_point();
+	query->submit_time = std::chrono::steady_clock::now();
+	query->callback = callback;
+	table->IndexQuestion(query);
+	return query;
+}
+
+// Adds a lookup to the outstanding query for the same question (keyed by the question section 
+// of its packet), if there is one that can take another waiter, so that both are completed 
+// from one response. Returns true if the lookup joined a query.
+bool DNSResolver::JoinQuery(char* lookup, DNSQuestion& question, QueryCallback callback)
+{
+	PendingQuery* query = table->FindQuestion(question.wire, question.size);
+	if (query == NULL || query->waiters.size() >= MAX_WAITERS)
+		return false;
+
+	QueryWaiter waiter;
+	waiter.lookup = lookup;
+	waiter.submit_time = std::chrono::steady_clock::now();
+	waiter.callback = callback;
+	query->waiters.push_back(std::move(waiter));
+	queries_coalesced++;
+	return true;
+}
+
+// Submits (another) transmission of a DNS query to the I/O engine and arms its 
+// retransmission timer from the RTT estimate of the server. The attempt goes to the server
+// with the lowest expected answer time that this query has not been sent to yet, and when 
+// racing is on also to the runner-up. Queries whose answer was truncated go over TCP to a
+// single server instead. Returns -1 to indicate a problem sending the packet, or -2 to 
+// indicate that the packet has not been correctly created.
+int DNSResolver::SendDNSQuery(PendingQuery& query)
+{
+	if (query.packet_size <= 0)
+		return MISC_ERROR;
+
+	int primary = upstreams.Select(query.sent_mask);
+	query.upstream = primary;
+	query.attempt_mask = 1u << primary;
+	if (query.tcp)
+		return SendTCPQuery(query);
+	if (race && upstreams.Size() > 1)
+		query.attempt_mask |= 1u << upstreams.Select(query.sent_mask | query.attempt_mask);
+	if (upstreams.Size() > 1)
+	{
+		int probe = upstreams.Probe(query.sent_mask | query.attempt_mask);
+		if (probe >= 0)
+			query.attempt_mask |= 1u << probe;
+	}
+
+	if (query.verbose && upstreams.Size() > 1)
+		printf("Attempt %d with %d bytes to %s... ", query.attempts, query.packet_size, inet_ntoa(upstreams.At(primary).addr.sin_addr));
+	else if (query.verbose)
+		printf("Attempt %d with %d bytes... ", query.attempts, query.packet_size);
+	query.attempts++;
+	query.start_time = std::chrono::steady_clock::now();
+
+	for (int i = 0; i < upstreams.Size(); i++)
+	{
+		if ((query.attempt_mask & (1u << i)) == 0)
+			continue;
+
+		int result = engine.SendTo(query.packet, query.packet_size, upstreams.At(i).addr);
+		if (result == SOCKET_ERROR)
+			return result;
+		upstreams.At(i).sent++;
+		queries_sent++;
+		metrics.Add(METRIC_QUERIES_SENT);
+		metrics.Add(METRIC_BYTES_SENT, query.packet_size);
+	}
+	query.sent_mask |= query.attempt_mask;
+	if (tracer && query.attempts == 1)
+		query.send_time = std::chrono::steady_clock::now();
+
+	int slot = table->IndexOf(&query);
+	UINT serial = query.serial;
+	long long timeout_ms = upstreams.At(primary).rtt.Timeout(query.attempts - 1);
+	query.timer = engine.AddTimer(timeout_ms, [this, slot, serial]() { OnQueryTimeout(slot, serial); });
+
+	// hedge once the attempt has taken longer than most answers of the server do
+	query.hedge_mask = 0;
+	double hedge_ms = (hedge_percentile > 0) ? upstreams.At(primary).latency.Percentile(hedge_percentile) : -1;
+	if (hedge_ms >= 0 && (long long) ceil(hedge_ms) < timeout_ms)
+	{
+		int attempt = query.attempts;
+		query.hedge_timer = engine.AddTimer((hedge_ms < 1) ? 1 : (long long) ceil(hedge_ms),
+			[this, slot, serial, attempt]() { OnQueryHedge(slot, serial, attempt); });
+	}
+	return query.packet_size;
+}
+
+// Sends an attempt of a query to the server already chosen for it over one of the pooled
+// TCP connections to that server and arms its retransmission timer, which allows at least
+// TCP_MIN_TIMEOUT_MS for the connection to be set up. Returns -1 if no connection could be opened.
+int DNSResolver::SendTCPQuery(PendingQuery& query)
+{
+	int index = query.upstream;
+	if (query.verbose)
+		printf("Attempt %d with %d bytes over TCP to %s... ", query.attempts, query.packet_size, inet_ntoa(upstreams.At(index).addr.sin_addr));
+	query.attempts++;
+	query.start_time = std::chrono::steady_clock::now();
+
+	if (tcp.Send(index, upstreams.At(index).addr, query.packet, query.packet_size) != 0)
+		return SOCKET_ERROR;
+	upstreams.At(index).sent++;
+	queries_sent++;
+	metrics.Add(METRIC_QUERIES_SENT);
+	metrics.Add(METRIC_BYTES_SENT, query.packet_size);
+	query.sent_mask |= query.attempt_mask;
+	query.hedge_mask = 0;
+
+	int slot = table->IndexOf(&query);
+	UINT serial = query.serial;
+	long long timeout_ms = upstreams.At(index).rtt.Timeout(query.attempts - 1);
+	if (timeout_ms < TCP_MIN_TIMEOUT_MS)
+		timeout_ms = TCP_MIN_TIMEOUT_MS;
+	query.timer = engine.AddTimer(timeout_ms, [this, slot, serial]() { OnQueryTimeout(slot, serial); });
+	return query.packet_size;
+}
+
+// Timer callback for an attempt of the query in the given slot that has not been answered
+// within the hedging percentile of its server's recent latency. Sends a duplicate to the 
+// best server (preferring one the query has not been sent to), whichever reply comes first wins.
+void DNSResolver::OnQueryHedge(int slot, UINT serial, int attempt)
+{
+	PendingQuery* query = table->At(slot);
+	if (!query->in_use || query->serial != serial || query->attempts != attempt)
 		return;
 
-	// Calculate size of packet
-	packet_size = (DWORD) strlen(formatted_lookup) + 1 + sizeof(DNSHeader) + sizeof(QueryHeader);
-	packet = (char*) malloc(packet_size);
-	if (packet == NULL)
+	int index = upstreams.Select(query->sent_mask);
+	if (query->verbose)
+	{
+		printf("hedge to %s after %lld ms... ", inet_ntoa(upstreams.At(index).addr.sin_addr), std::chrono::duration_cast
+			<std::chrono::milliseconds>(std::chrono::steady_clock::now() - query->start_time).count());
+	}
+
+	// a failed hedge is not fatal, the retransmission timer of the attempt is still armed
+	if (engine.SendTo(query->packet, query->packet_size, upstreams.At(index).addr) == SOCKET_ERROR)
 		return;
+	upstreams.At(index).sent++;
+	queries_sent++;
+	hedges_sent++;
+	metrics.Add(METRIC_QUERIES_SENT);
+	metrics.Add(METRIC_BYTES_SENT, query->packet_size);
+	query->sent_mask |= 1u << index;
+	query->attempt_mask |= 1u << index;
+	query->hedge_mask |= 1u << index;
+}
 
-	if (query_type == DNS_A)
-		printf("Query   : %s, ", lookup);
-	printf("type %d, TXID 0x%.4X\n", query_type, ntohs(pheader.ID));
-	
-	/*
-	 * Copy header and query into the allocated packet
-	 *
-	 * Warning C6386 because we're copying 'sizeof(DNSHeader)' bytes but writable size is 'packet_size' bytes.
-	 * This is not an issue for reasonable lookup string lengths because packet_size is strictly > sizeof(DNSHeader) 
-	 */ 
-	memcpy(packet, &pheader, sizeof(DNSHeader));
-	memcpy(packet + sizeof(DNSHeader), formatted_lookup, strlen(formatted_lookup) + 1);
-	memcpy(packet + sizeof(DNSHeader) + strlen(formatted_lookup) + 1, &qheader, sizeof(QueryHeader));
-	free(formatted_lookup);
-}
-
-// Send DNS query to connected server through UDP socket.
-// Returns -1 to indicate a problem sending the packet, or -2 to indicate that 
-// the packet has not been correctly allocated.
-int DNSResolver::SendDNSQuery(DWORD packet_size)
-{
-	if (packet == NULL)
+// Datagram handler of the I/O engine, and message handler of the TCP connections. Replies
+// that did not originate from a server the query was sent to, or do not match an outstanding
+// query by TXID and question, are dropped. The first valid reply completes its query, unless
+// it was truncated, in which case the query is sent again over TCP, or it shows that the server
+// does not understand EDNS(0), in which case the query is sent again without it.
+void DNSResolver::ReceiveDNSQuery(char* buf, int response_size, struct sockaddr_in& from)
+{
+	auto received = tracer ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+	metrics.Add(METRIC_BYTES_RECEIVED, response_size);
+	int index = upstreams.Find(from);
+	if (index < 0)
+	{
+		metrics.Add(METRIC_WRONG_SOURCE);
+		return;
+	}
+
+	// late duplicates of queries that have already completed no longer match anything, and
+	// are told apart from stray replies by the TXIDs of the queries completed last
+	PendingQuery* query = table->Match(buf, response_size);
+	if (query == NULL)
+	{
+		metrics.Add(table->MatchCompleted(buf, response_size, index) ? METRIC_LATE_REPLIES : METRIC_TXID_MISMATCHES);
+		return;
+	}
+	if ((query->sent_mask & (1u << index)) == 0)
+	{
+		metrics.Add(METRIC_WRONG_SOURCE);
+		return;
+	}
+	query->receive_time = received;
+
+	// replies over TCP are never truncated, so a truncated reply to a query that has moved to
+	// TCP is a late answer to one of its datagrams
+	if (((DNSHeader*) buf)->TC && query->tcp)
+		return;
+
+	engine.CancelTimer(query->timer);
+	engine.CancelTimer(query->hedge_timer);
+	query->upstream = index;
+	bool hedged = (query->hedge_mask & (1u << index)) != 0;
+	if (hedged)
+		hedges_won++;
+
+	// only replies to a single transmission give an unambiguous RTT sample (Karn's algorithm),
+	// and TCP round trips (which may include a handshake) say nothing about UDP latency
+	double rtt_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - query->start_time).count();
+	upstreams.OnAnswer(index, rtt_ms, query->attempts == 1 && !hedged && !query->tcp);
+	metrics.upstream_rtt.Record(rtt_ms);
+	metrics.AddRcode(((DNSHeader*) buf)->result);
+
+	// a truncated answer is asked for again over TCP (RFC 7766), even after the last UDP attempt,
+	// since it is not an answer to complete the lookup with
+	if (((DNSHeader*) buf)->TC)
+	{
+		if (query->verbose)
+			printf("truncated... ");
+		query->tcp = true;
+		query->sent_mask = 0;
+		if (SendDNSQuery(*query) == SOCKET_ERROR)
+		{
+			printAndReturn("send encountered socket error", true);
+			CompleteQuery(*query, NULL, -1);
+		}
+		return;
+	}
+
+	// servers that do not implement EDNS(0) answer FORMERR without an OPT record (RFC 6891),
+	// so the query is sent again without one
+	EDNSInfo edns;
+	if (query->edns && ((DNSHeader*) buf)->result == DNS_FORMAT && DNSMessage::FindEDNS(buf, response_size, edns) == 0
+		&& query->attempts < MAX_ATTEMPTS)
+	{
+		if (query->verbose)
+			printf("FORMERR with EDNS... ");
+		query->edns = false;
+		query->packet_size = (int) sizeof(DNSHeader) + query->question_size;
+		((DNSHeader*) query->packet)->additional = 0;
+		query->sent_mask = 0;
+		if (SendDNSQuery(*query) == SOCKET_ERROR)
+		{
+			printAndReturn("send encountered socket error", true);
+			CompleteQuery(*query, NULL, -1);
+		}
+		return;
+	}
+	if (cache_enabled)
+		cache.Insert(query->packet + sizeof(DNSHeader), query->question_size, buf, response_size, query->prefetch);
+	if (tracer)
+		query->parse_time = std::chrono::steady_clock::now();
+	CompleteQuery(*query, buf, response_size);
+}
+
+// Timer callback for a transmission of the query in the given slot that went unanswered.
+// Retransmits the query, or completes it as timed out after MAX_ATTEMPTS attempts (or the
+// attempt over TCP that may follow a truncated answer to the last one).
+void DNSResolver::OnQueryTimeout(int slot, UINT serial)
+{
+	PendingQuery* query = table->At(slot);
+	if (!query->in_use || query->serial != serial)
+		return;
+	engine.CancelTimer(query->hedge_timer);
+
+	if (query->verbose)
+	{
+		printf("timeout in %lld ms\n", std::chrono::duration_cast<std::chrono::milliseconds>
+			(std::chrono::steady_clock::now() - query->start_time).count());
+	}
+
+	for (int i = 0; i < upstreams.Size(); i++)
+	{
+		if (query->attempt_mask & (1u << i))
+			upstreams.OnTimeout(i);
+	}
+	metrics.Add(METRIC_TIMEOUTS);
+
+	if (query->attempts >= MAX_ATTEMPTS)
+	{
+		metrics.Add(METRIC_LOOKUPS_TIMED_OUT);
+		CompleteQuery(*query, NULL, 0);
+		return;
+	}
+	metrics.Add(METRIC_RETRANSMITS);
+
+	if (SendDNSQuery(*query) == SOCKET_ERROR)
+	{
+		printAndReturn("send encountered socket error", true);
+		CompleteQuery(*query, NULL, -1);
+	}
+}
+
+// Hands the response (or NULL and 0 on timeout, -1 on error) to the callback of a
+// query, then to those of the lookups waiting on it, and releases its slot
+void DNSResolver::CompleteQuery(PendingQuery& query, char* buf, int response_size)
+{
+	// the callbacks may submit new queries, so this slot is only released once they return,
+	// and lookups submitted by them must not join a query that has already been answered
+	table->UnindexQuestion(&query);
+	QueryCallback callback = std::move(query.callback);
+	query.callback = nullptr;
+	std::vector<QueryWaiter> waiters = std::move(query.waiters);
+	query.waiters.clear();
+	auto now = std::chrono::steady_clock::now();
+	if (response_size > 0 && !query.prefetch)
+		metrics.lookup_latency.Record(std::chrono::duration<double, std::milli>(now - query.submit_time).count());
+	if (callback)
+		callback(query, buf, response_size);
+	if (tracer)
+	{
+		bool encoded = query.encode_time != std::chrono::steady_clock::time_point();
+		tracer->Record(query, encoded ? query.encode_time : query.submit_time, query.submit_time,
+			std::chrono::steady_clock::now(), buf, response_size, 0);
+	}
+
+	// every waiter sees the query as if it had been its own
+	for (size_t i = 0; i < waiters.size(); i++)
+	{
+		strcpy_s(query.lookup, MAX_NAME_SIZE, waiters[i].lookup.c_str());
+		query.submit_time = waiters[i].submit_time;
+		if (response_size > 0)
+			metrics.lookup_latency.Record(std::chrono::duration<double, std::milli>(now - query.submit_time).count());
+		if (waiters[i].callback)
+			waiters[i].callback(query, buf, response_size);
+		if (tracer)
+		{
+			tracer->Record(query, waiters[i].submit_time, std::chrono::steady_clock::time_point(),
+				std::chrono::steady_clock::now(), buf, response_size, TRACE_JOINED);
+		}
+	}
+	table->Release(&query);
+}
+
+// Reserves a slot for a query, creates its packet and submits it to the I/O engine. The 
+// callback is called from the event loop once the query completes, or right away if the
+// answer is cached, or with an error (NULL and -1) if the packet could not be sent.
+// Returns 0 if the query was submitted, or -2 if the lookup cannot be encoded or the window
+// is full.
+int DNSResolver::SubmitQuery(DWORD type, char* lookup, QueryCallback callback)
+{
+	auto encode_time = tracer ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+	DNSQuestion question;
+	if (CreateDNSQuestion(type, lookup, question) < 0)
 		return MISC_ERROR;
+	return SubmitEncoded(lookup, question, callback, encode_time);
+}
 
-	int result;
-	result = sendto(sock, packet, packet_size, NULL, (struct sockaddr*) & remote, sizeof(remote));
-	return result;
+// Submits a lookup whose question has already been encoded, as SubmitQuery does
+int DNSResolver::SubmitQuestion(char* lookup, DNSQuestion& question, QueryCallback callback)
+{
+	return SubmitEncoded(lookup, question, callback, tracer ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point());
 }
 
-// Attempts to receive a UDP packet response into character buffer buf. 
-// If a response is successfully read, return number of bytes read and 
-// return the buffer that was passed in by reference.
-// The timeout is set to 10 seconds by default.
-// Returns -1 if there was a network error recieving the packet, or 
-// -2 to indicate that the received packet did not originate from the 
-// originally contacted server.
-int DNSResolver::ReceiveDNSQuery(char buf[])
-{
-	// set timeout
-	struct timeval timeout;
-	timeout.tv_sec = TIMEOUT_SECONDS;
-	timeout.tv_usec = 0;
-
-	fd_set fd;
-	FD_ZERO(&fd);
-	FD_SET(sock, &fd);
-	
-	// create address struct for responder
-	struct sockaddr_in response_addr;
-	int response_size = sizeof(response_addr);
-		
-	int ret = 0;
-	ret = select(0, &fd, NULL, NULL, &timeout);
-	if (ret > 0)
-	{
-		// attempt to get response from server
-		int packet_size = recvfrom(sock, buf, MAX_DNS_SIZE, 0, (struct sockaddr*) &response_addr, &response_size);
-		if (packet_size == 0)
-			return SOCKET_ERROR;
-		if (response_addr.sin_addr.s_addr != remote.sin_addr.s_addr || response_addr.sin_port != remote.sin_port)
-			return MISC_ERROR;
-
-		return packet_size;
-	}
-	else if (ret == 0)
+// Submits a lookup whose question was encoded from encode_time on, as SubmitQuery does
+int DNSResolver::SubmitEncoded(char* lookup, DNSQuestion& question, QueryCallback callback, std::chrono::steady_clock::time_point encode_time)
+{
+	// cache hits never touch the in-flight table or the network
+	char buf[MAX_UDP_SIZE];
+	PendingQuery hit;
+	int size = LookupCache(lookup, question, hit, buf, true);
+	if (size > 0)
+	{
+		if (tracer)
+			hit.parse_time = std::chrono::steady_clock::now();
+		callback(hit, buf, size);
+		if (tracer)
+			tracer->Record(hit, encode_time, std::chrono::steady_clock::time_point(), std::chrono::steady_clock::now(), buf, size, TRACE_CACHE_HIT);
 		return 0;
-	else
-		return SOCKET_ERROR;
+	}
+
+	// identical questions already on their way are not sent again
+	if (JoinQuery(lookup, question, callback))
+		return 0;
+	PendingQuery* query = PrepareQuery(lookup, question, callback);
+	if (query == NULL)
+		return MISC_ERROR;
+	query->encode_time = encode_time;
+
+	// the lookup fails like any other, so that it is reported with the rest
+	if (SendDNSQuery(*query) == SOCKET_ERROR)
+	{
+		printAndReturn("send encountered socket error", true);
+		CompleteQuery(*query, NULL, -1);
+	}
+	return 0;
+}
+
+// Changes the number of queries that may be in flight at once. Only possible while no
+// query is outstanding, returns -1 otherwise or 0 for success.
+int DNSResolver::SetWindow(int window)
+{
+	if (table->Size() > 0)
+		return -1;
+	table.reset(new InFlightTable(window));
+	return 0;
+}
+
+// Sets the UDP payload size advertised with EDNS(0), between MAX_DNS_SIZE and MAX_UDP_SIZE,
+// or 0 to send queries without an OPT record. Returns -1 if the size is out of range.
+int DNSResolver::SetEDNS(int payload_size)
+{
+	if (payload_size != 0 && (payload_size < MAX_DNS_SIZE || payload_size > MAX_UDP_SIZE))
+		return -1;
+	edns_size = (USHORT) payload_size;
+	return 0;
 }
 
 // Takes a DNS response from the server as a character buffer in addition to the 
-// size of the response and validates the response against the original packet. 
+// size of the response and validates the response against the packet of the original query. 
 // If response is successfully validated, parse the DNS answers and print the results.
 // Prints a message and returns -1 in case of failure or 0 for success.
-int DNSResolver::ValidateAndParseResponse(char* buf, int response_size)
+int DNSResolver::ValidateAndParseResponse(char* buf, int response_size, PendingQuery& query)
 {
 	// check to make sure response size is at least as large as the fixed DNS header
 	if (response_size < sizeof(DNSHeader))
 		return printAndReturn("  ++ invalid reply: smaller than fixed header");
 
 	DNSHeader response = *(DNSHeader*)buf;
-	DNSHeader original = *(DNSHeader*)packet;
-
-	// get number of responses from the response packet
-	USHORT num_questions = ntohs(response.questions);
-	USHORT num_answers = ntohs(response.answers);
-	USHORT num_authority = ntohs(response.authority);
-	USHORT num_additional = ntohs(response.additional);
 
 	// check for TXID mismatch
-	if (ntohs(original.ID) != ntohs(response.ID))
+	if (query.txid != ntohs(response.ID))
 	{
-		printf("  ++ invalid reply: TXID mismatch, sent %.4X, received %.4X", ntohs(original.ID), ntohs(response.ID));
+		printf("  ++ invalid reply: TXID mismatch, sent %.4X, received %.4X", query.txid, ntohs(response.ID));
 		return printAndReturn("");
 	}
 
@@ -290,366 +679,957 @@ int DNSResolver::ValidateAndParseResponse(char* buf, int response_size)
 		return printAndReturn("");
 	}
 
-	char* cursor = buf + sizeof(DNSHeader);
-	char* name = NULL;
-
-	// Loop through questions
-	if (num_questions > 0)
-		printf("------------ [questions] ----------\n");
-	for (int i = 0; i < num_questions; i++)
+	// print every section the header announces records for, in wire order
+	static const char* section_names[SECTION_COUNT] = { "questions", "answers", "authority", "additional" };
+	DNSMessage message(buf, response_size);
+	for (int section = SECTION_QUESTION; section < SECTION_COUNT; section++)
 	{
-		// check if we reached end of packet in the middle of processing queries
-		if (cursor >= buf + response_size)
-			return printAndReturn("  ++ invalid section: not enough records");
-
-		// get the query text
-		name = GetName(cursor, buf, response_size);
-		if (name == NULL)
+		USHORT count = message.Count((DNSSection) section);
+		if (count > 0)
+			printf("------------ [%s] ----------\n", section_names[section]);
+		if (PrintResourceRecords(message, count) < 0)
 			return printAndReturn("");
-
-		// check to make sure there is space for the query header in the packet
-		if (cursor + sizeof(QueryHeader) > buf + response_size)
-			return printAndReturn("  ++ invalid record: truncated fixed query header");
-
-		// get query header information, print, and advance cursor
-		QueryHeader query = *(QueryHeader*)cursor;
-		printf("\t%s type %d class %d\n", name, (int) ntohs(query.qType), (int) ntohs(query.qClass));
-		cursor += sizeof(QueryHeader);
 	}
-
-	// loop through answers and print results
-	if (num_answers > 0)
-		printf("------------ [answers] ----------\n");
-	if (PrintResourceRecords(num_answers, buf, cursor, response_size) < 0)
-		return printAndReturn("");
-
-	// loop through authority and print results
-	if (num_authority > 0)
-		printf("------------ [authority] ----------\n");
-	if (PrintResourceRecords(num_authority, buf, cursor, response_size) < 0)
-		return printAndReturn("");
-
-	// loop through additional and print results
-	if (num_additional > 0)
-		printf("------------ [additional] ----------\n");
-	if (PrintResourceRecords(num_additional, buf, cursor, response_size) < 0)
-		return printAndReturn("");
 	return 0;
 }
 
-// Print N resource records from a given buffer with starting location given by cursor. 
-// Additionally, advance cursor by the amount advanced. 
-// Returns -1 in case an error was encountered or 0 if successful.
-int DNSResolver::PrintResourceRecords(USHORT num_records, char* buf, char* &cursor, int response_size)
+// Reads every record of a response and decodes its names the way PrintResponse does, without
+// printing anything. Returns -1 if the response failed or is malformed or 0 for success.
+int DNSResolver::CheckResponse(const char* buf, int response_size)
 {
-	// loop through all records of a given type
-	for (int i = 0; i < num_records; i++)
+	if (response_size < sizeof(DNSHeader) || ((const DNSHeader*) buf)->result != DNS_OK)
+		return -1;
+
+	char name[MAX_DNS_SIZE];
+	DNSMessage message(buf, response_size);
+	DNSRecord record;
+	while (message.Next(record))
 	{
-		// check if we reached end of packet in the middle of processing responses 
-		if (cursor >= buf + response_size)
-			return printAndReturn("\n  ++ invalid section: not enough records");
+		bool named = (record.type == DNS_PTR || record.type == DNS_CNAME || record.type == DNS_NS);
+		if (record.section != SECTION_QUESTION && record.type != DNS_A && !named)
+			continue;
+		if (record.name.Decode(name, MAX_DNS_SIZE) != PARSE_OK)
+			return -1;
+		if (record.section == SECTION_QUESTION)
+			continue;
+		if (record.type == DNS_A && record.rdlength != sizeof(DWORD))
+			return -1;
+		if (named && record.RdataName().Decode(name, MAX_DNS_SIZE) != PARSE_OK)
+			return -1;
+	}
+	return (message.Error() == PARSE_OK) ? 0 : -1;
+}
 
-		// get the query text the response is for
-		char* name = GetName(cursor, buf, response_size);
-		if (name == NULL)
-			return printAndReturn("");
+// Print the next N questions or resource records read from a message. Records of types 
+// other than A, PTR, CNAME, NS and OPT are skipped. Returns -1 in case an error was encountered 
+// or 0 if successful.
+int DNSResolver::PrintResourceRecords(DNSMessage& message, USHORT num_records)
+{
+	char name[MAX_DNS_SIZE], value[MAX_DNS_SIZE];
+	DNSRecord record;
+	EDNSInfo edns;
 
-		// check to make sure there is at least enough room in the packet for a RR header
-		if (cursor + sizeof(ResourceRecord) > buf + response_size)
-			return printAndReturn("\n  ++ invalid record: truncated fixed RR header");
-
-		ResourceRecord record = *(ResourceRecord*)cursor;
-		USHORT record_type = ntohs(record.rType);
-
-		// check to make sure RR header size and length field does not indicate content past the packet boundary
-		if (cursor + sizeof(ResourceRecord) + ntohs(record.rLength) > buf + response_size)
-			return printAndReturn("\n  ++ invalid record: RR value length beyond packet");
-
-		// check record type, skip if unrecognized
-		char type_indicator[6] = "";
-		if (record_type == DNS_A || record_type == DNS_PTR || record_type == DNS_CNAME || record_type == DNS_NS)
-			printf("\t%s ", name);
-		if (record_type == DNS_A)
-			strcpy_s(type_indicator, 6, "A");
-		else if (record_type == DNS_PTR)
-			strcpy_s(type_indicator, 6, "PTR");
-		else if (record_type == DNS_CNAME)
-			strcpy_s(type_indicator, 6, "CNAME");
-		else if (record_type == DNS_NS)
-			strcpy_s(type_indicator, 6, "NS");
-		else
+	for (int i = 0; i < num_records; i++)
+	{
+		if (!message.Next(record))
 		{
-			cursor += sizeof(ResourceRecord) + ntohs(record.rLength);
-			continue;
+			printf("\n  ++ %s", DNSMessage::ErrorText(message.Error()));
+			return -1;
 		}
 
-		// advance past RR header
-		cursor += sizeof(ResourceRecord);
-
-		// if the record type is A, read an IPv4 address. Otherwise, read a hostname.
-		if (record_type == DNS_A)
+		int error = PARSE_OK;
+		if (record.section == SECTION_QUESTION)
 		{
-			name = GetIPv4Address(cursor, buf, response_size);
-			if (name == NULL)
-				return printAndReturn("");
+			// get the query text and print it along with the query header
+			error = record.name.Decode(name, MAX_DNS_SIZE);
+			if (error == PARSE_OK)
+				printf("\t%s type %d class %d\n", name, (int) record.type, (int) record.rclass);
 		}
-		else
+		else if (record.ReadEDNS(edns))
 		{
-			name = GetName(cursor, buf, response_size);
-			if (name == NULL)
-				return printAndReturn("");
+			printf("\tOPT payload %d, version %d, extended rcode %d%s\n", (int) edns.payload_size, (int) edns.version,
+				(int) edns.extended_rcode, edns.dnssec_ok ? ", DNSSEC OK" : "");
 		}
+		else if (record.type == DNS_A || record.type == DNS_PTR || record.type == DNS_CNAME || record.type == DNS_NS)
+		{
+			const char* type_indicator = (record.type == DNS_A) ? "A" : (record.type == DNS_PTR) ? "PTR" :
+				(record.type == DNS_CNAME) ? "CNAME" : "NS";
 
-		// print record information
-		if (record_type == DNS_A || record_type == DNS_PTR || record_type == DNS_CNAME || record_type == DNS_NS)
-			printf("%s %s TTL = %d\n", type_indicator, name, ntohl(record.rTTL));
+			// if the record type is A, read an IPv4 address. Otherwise, read a hostname.
+			error = record.name.Decode(name, MAX_DNS_SIZE);
+			if (error == PARSE_OK && record.type == DNS_A)
+			{
+				if (record.rdlength != sizeof(DWORD))
+					error = PARSE_BAD_RDATA;
+				else
+				{
+					struct in_addr addr;
+					memcpy(&addr.s_addr, record.rdata, sizeof(DWORD));
+					inet_ntop(AF_INET, &addr, value, MAX_DNS_SIZE);
+				}
+			}
+			else if (error == PARSE_OK)
+				error = record.RdataName().Decode(value, MAX_DNS_SIZE);
+
+			// print record information
+			if (error == PARSE_OK)
+				printf("\t%s %s %s TTL = %d\n", name, type_indicator, value, record.ttl);
+		}
+
+		if (error != PARSE_OK)
+		{
+			printf("\n  ++ %s", DNSMessage::ErrorText(error));
+			return -1;
+		}
 	}
 	return 0;
 }
 
-// Gets an IPv4 address starting from the position indicated by cursor 
-// from the buffer starting at position 'start'. The total size of the 
-// buffer is indicated by response_size. In addition, advance the cursor
-// by the number of characters read. Return the buffer of characters read
-// or null if an error is encountered.
-char* DNSResolver::GetIPv4Address(char*& cursor, char* start, int response_size)
+// Prints the fixed header of a response followed by the validated and parsed records.
+// Returns -1 if the response was invalid or 0 for success.
+int DNSResolver::PrintResponse(char* buf, int response_size, PendingQuery& query)
+{
+	// check to make sure response size is at least as large as the fixed DNS header
+	if (response_size < sizeof(DNSHeader))
+		return printAndReturn("\n  ++ invalid reply: smaller than fixed header");
+
+	// form DNSHeader from result to print response information
+	DNSHeader response = *(DNSHeader*)buf;
+
+	printf("  TXID 0x%.4X, flags 0x%.2X%.2X, questions %d, answers %d, authority %d, additional %d\n",
+		ntohs(response.ID), (UCHAR)buf[2], (UCHAR)buf[3], ntohs(response.questions),
+		ntohs(response.answers), ntohs(response.authority), ntohs(response.additional));
+
+	// validate content of response packet and parse/print result records
+	if (ValidateAndParseResponse(buf, response_size, query) != 0)
+		return printAndReturn("");
+
+	return 0;
+}
+
+// Prints the list of configured servers
+void DNSResolver::PrintServers()
 {
-	static char ip_buf[MAX_DNS_SIZE];
-	if (cursor + sizeof(DWORD) > start + response_size)
+	printf("Server  : ");
+	for (int i = 0; i < upstreams.Size(); i++)
 	{
-		printf("\n  ++ invalid record: truncated name");
-		return NULL;
+		struct sockaddr_in& addr = upstreams.At(i).addr;
+		printf((i == 0) ? "%s" : ", %s", inet_ntoa(addr.sin_addr));
+		if (ntohs(addr.sin_port) != DNS_PORT)
+			printf(":%d", ntohs(addr.sin_port));
 	}
-	
-	// get 4 byte address from cursor and copy into buffer
-	struct in_addr addr;
-	addr.s_addr = *(DWORD*)cursor;
-	strcpy_s(ip_buf, MAX_DNS_SIZE, inet_ntoa(addr));
-
-	cursor += sizeof(DWORD);
-	return ip_buf;
+	printf((race && upstreams.Size() > 1) ? " (racing the best two)\n" : "\n");
 }
 
-// Checks the byte indicated by cursor in a buffer to see if the cursor needs 
-// to jump to another offset in the buffer. Continues jumping and checking the 
-// current position until an end position is found or 10 jumps are made 
-// (indicating a jump loop). Returns an updated cursor to the corresponding 
-// buffer offset and a status flag indicating if a jump was made. returns null
-// in case of failure.
-char* DNSResolver::SafeJump(char* cursor, char* buf, int response_size, bool &jumped, int jump_count)
+// Function to format, send, and parse a DNS query and display the resulting information. 
+// If an error is encountered, prints a message and gracefully terminates program execution.
+int DNSResolver::ResolveDNS(DWORD query_type, char* lookup)
 {
-	char* temp_cursor = cursor;
-	// make sure there is enough space to read the current byte of the cursor
-	if (cursor >= buf + response_size)
+	if (upstreams.Size() == 0)
+		return printAndReturn("  ++ program error: no DNS server configured");
+
+	bool done = false;
+	int result = 0;
+	QueryCallback on_complete = [this, &done, &result](PendingQuery& query, char* buf, int response_size)
 	{
-		printf("\n  ++ invalid record: truncated name");
-		return NULL;
+		done = true;
+		if (response_size > 0)
+		{
+			printf("response in %lld ms with %d bytes\n", std::chrono::duration_cast<std::chrono::milliseconds>
+				(std::chrono::steady_clock::now() - query.start_time).count(), response_size);
+			result = PrintResponse(buf, response_size, query);
+		}
+		else if (response_size == 0)
+			result = printAndReturn("  ++ no reply: no response from server");
+		else
+			result = -1;
+	};
+
+	// Create properly formatted DNS question, answer it from the cache if possible
+	printf("Lookup  : %s\n", lookup);
+	DNSQuestion question;
+	if (CreateDNSQuestion(query_type, lookup, question) < 0)
+		return printAndReturn("  ++ program error: failed to create DNS query packet");
+
+	// no event loop runs after a cache hit here, so a refresh would never be received
+	char buf[MAX_UDP_SIZE];
+	PendingQuery hit;
+	int size = LookupCache(lookup, question, hit, buf, false);
+	if (size > 0)
+	{
+		printf("Query   : %s, type %d, TXID 0x%.4X\n", hit.question, query_type, hit.txid);
+		PrintServers();
+		printf("********************************\n");
+		printf("Cache hit with %d bytes\n", size);
+		return PrintResponse(buf, size, hit);
 	}
 
-	// check jump count for loop
-	if (jump_count >= 10)
+	// Create properly formatted DNS query packet to send to server
+	PendingQuery* query = PrepareQuery(lookup, question, on_complete);
+	if (query == NULL)
+		return printAndReturn("  ++ program error: failed to create DNS query packet");
+	query->verbose = true;
+	printf("Query   : %s, type %d, TXID 0x%.4X\n", query->question, query_type, query->txid);
+	PrintServers();
+	printf("********************************\n");
+
+	// Submit the first attempt, retransmissions are made by the timer of the query
+	int status = SendDNSQuery(*query);
+	if (status == SOCKET_ERROR)
+		return printAndReturn("send encountered socket error", true);
+	else if (status == MISC_ERROR)
+		return printAndReturn("\n  ++ program error: attempted to send null packet");
+
+	if (engine.Run([&done]() { return done; }) != 0)
+		return -1;
+	return result;
+}
+
+// Returns the type of query for a lookup: PTR for an IPv4 or IPv6 address, A otherwise
+DWORD DNSResolver::LookupType(const char* lookup)
+{
+	UCHAR address[16];
+	bool ipv6;
+	return ReverseSweep::ParseAddress(lookup, address, ipv6) ? DNS_PTR : DNS_A;
+}
+
+// Reads the next lookup (hostname or IP) from a batch input stream into line, stripping 
+// surrounding whitespace. Blank lines and lines starting with '#' produce an empty lookup.
+// Returns the length of the lookup, or -1 once the end of the input has been reached.
+int DNSResolver::ReadBatchLine(FILE* input, char* line, int line_size)
+{
+	if (fgets(line, line_size, input) == NULL)
+		return -1;
+
+	// discard the remainder of lines that do not fit into the buffer
+	size_t length = strlen(line);
+	if (length == (size_t) line_size - 1 && line[length - 1] != '\n')
 	{
-		printf("\n  ++ invalid record: jump loop");
-		return NULL;
+		int c;
+		while ((c = fgetc(input)) != EOF && c != '\n');
+		printf("Lookup  : %.32s...\n  ++ invalid lookup: longer than %d characters\n", line, MAX_NAME_SIZE - 1);
+		return 0;
 	}
 
-	// see if jump is necessary
-	if ((UCHAR)* cursor >= 0xC0)
+	// strip trailing and leading whitespace
+	while (length > 0 && isspace((UCHAR) line[length - 1]))
+		line[--length] = 0;
+	size_t start = 0;
+	while (start < length && isspace((UCHAR) line[start]))
+		start++;
+	if (start > 0)
+		memmove(line, line + start, length - start + 1);
+	length -= start;
+
+	if (length > 0 && line[0] == '#')
+		return 0;
+	return (int) length;
+}
+
+// Prints the servers and window of a batch, ahead of the lookups
+void DNSResolver::PrintBatchHeader(int window)
+{
+	PrintServers();
+	printf("Window  : %d\n", window);
+	if (cache_enabled && snapshot_path != NULL)
+		printf("Snapshot: %d cached responses mapped from %s\n", snapshot_loaded, snapshot_path);
+	printf("********************************\n");
+}
+
+// Resolves lookups taken from next_lookup until it runs out, keeping the window of this resolver
+// full. Prints the parsed response (or failure) of every lookup, holding the output lock (if 
+// any) for each, or buffers it in the format set with SetOutput, and adds the outcome and the
+// counters of this resolver to stats.
+// Returns -1 if a socket error stopped the batch or 0 otherwise.
+int DNSResolver::RunBatch(BatchSource next_lookup, BatchStats& stats)
+{
+	char line[MAX_NAME_SIZE];
+	bool input_done = false;
+	int status = 0;
+	ULONGLONG hits = cache.Hits(), misses = cache.Misses(), negative_hits = cache.NegativeHits(), sent = queries_sent;
+	ULONGLONG evictions = cache.Evictions(), cache_dropped = cache.Dropped();
+	ULONGLONG hedges = hedges_sent, hedges_first = hedges_won;
+	ULONGLONG tcp_queries = tcp.Queries(), tcp_reused = tcp.Reused(), tcp_opened = tcp.Opened();
+	ULONGLONG syscalls = engine.Syscalls(), coalesced = queries_coalesced;
+	ULONGLONG datagrams_sent = metrics.Counter(METRIC_DATAGRAMS_SENT), datagrams_received = metrics.Counter(METRIC_DATAGRAMS_RECEIVED);
+	ULONGLONG send_calls = metrics.Counter(METRIC_SEND_CALLS), receive_calls = metrics.Counter(METRIC_RECEIVE_CALLS);
+	ULONGLONG prefetches = prefetches_sent, prefetches_used = cache.PrefetchesUsed();
+	ULONGLONG snapshot_hits = cache.SnapshotHits(), snapshot_expired = cache.SnapshotExpired();
+
+	// prints (or writes in the output format) the outcome of every lookup as it completes
+	QueryCallback on_complete = [this, &stats](PendingQuery& query, char* buf, int response_size)
 	{
-		// set flag and make sure the jump offset is inside the boundary of the packet
-		jumped = true;
-		if (cursor + 1 >= buf + response_size)
+		if (writer)
 		{
-			printf("\n  ++ invalid record: truncated jump offset");
-			return NULL;
+			if (response_size > 0 && !query.from_cache)
+			{
+				stats.latencies.push_back(std::chrono::duration<double, std::milli>
+					(std::chrono::steady_clock::now() - query.submit_time).count());
+			}
+			if (response_size > 0)
+				stats.replies++;
+			if (writer->WriteLookup(query, buf, response_size) != 0)
+				stats.failures++;
+			if (writer->Full())
+				FlushOutput();
+			return;
 		}
 
-		// calculate jump offset and advance the cursor
-		USHORT first_byte_of_offset = ((((UCHAR) *(cursor)) ^ (0xC0)) << 8);
-		UCHAR second_byte_of_offset = (UCHAR) *(cursor + 1);
-		USHORT jump_offset = first_byte_of_offset + second_byte_of_offset;
-		temp_cursor = buf + jump_offset;
-
-		// check range of the updated cursor to make sure it is in a valid position in the 
-		// packet
-		if (temp_cursor < buf + sizeof(DNSHeader))
+		if (quiet)
 		{
-			if (temp_cursor < buf)
+			if (response_size > 0 && !query.from_cache)
 			{
-				printf("\n  ++ invalid record: jump beyond packet boundary");
-				return NULL;
+				stats.latencies.push_back(std::chrono::duration<double, std::milli>
+					(std::chrono::steady_clock::now() - query.submit_time).count());
 			}
+			if (response_size > 0)
+				stats.replies++;
+			if (response_size <= 0 || CheckResponse(buf, response_size) != 0)
+				stats.failures++;
+			return;
+		}
+
+		std::unique_lock<std::mutex> guard;
+		if (output_lock != NULL)
+			guard = std::unique_lock<std::mutex>(*output_lock);
+
+		if (response_size <= 0)
+		{
+			printf("Lookup  : %s, type %d, TXID 0x%.4X\n", query.lookup, query.type, query.txid);
+			if (response_size == 0)
+				printf("  ++ no reply: no response from server after %d attempts\n", query.attempts);
 			else
+				printf("  ++ failed: the query could not be sent\n");
+			stats.failures++;
+			return;
+		}
+
+		if (query.from_cache)
+			printf("Lookup  : %s, type %d, cache hit with %d bytes\n", query.lookup, query.type, response_size);
+		else
+		{
+			stats.latencies.push_back(std::chrono::duration<double, std::milli>
+				(std::chrono::steady_clock::now() - query.submit_time).count());
+			printf("Lookup  : %s, type %d, attempt %d, response in %lld ms with %d bytes\n", query.lookup, query.type,
+				query.attempts - 1, std::chrono::duration_cast<std::chrono::milliseconds>
+				(std::chrono::steady_clock::now() - query.start_time).count(), response_size);
+		}
+		if (PrintResponse(buf, response_size, query) != 0)
+			stats.failures++;
+		stats.replies++;
+	};
+
+	// lookups are started no faster than the rate limit, if any, with bursts of at most 10 ms worth
+	double tokens = 1;
+	auto refilled = std::chrono::steady_clock::now();
+	DNSQuestion question;
+
+	while (!input_done || table->Size() > 0)
+	{
+		// keep the window full
+		bool throttled = false;
+		while (!input_done && !table->Full())
+		{
+			if (rate_limit > 0)
 			{
-				printf("\n  ++ invalid record: jump into fixed header");
-				return NULL;
+				auto now = std::chrono::steady_clock::now();
+				tokens = std::min(tokens + std::chrono::duration<double>(now - refilled).count() * rate_limit,
+					std::max(1.0, rate_limit / 100));
+				refilled = now;
+				throttled = (tokens < 1);
+				if (throttled)
+					break;
 			}
+
+			question.size = 0;
+			int length = next_lookup(line, MAX_NAME_SIZE, question);
+			if (length < 0)
+				input_done = true;
+			if (length <= 0)
+				continue;
+
+			tokens -= 1;
+			stats.lookups++;
+			int result = (question.size > 0) ? SubmitQuestion(line, question, on_complete)
+				: SubmitQuery(LookupType(line), line, on_complete);
+			if (result == MISC_ERROR && writer)
+				writer->WriteInvalid(line);
+			else if (result == MISC_ERROR)
+			{
+				std::unique_lock<std::mutex> guard;
+				if (output_lock != NULL)
+					guard = std::unique_lock<std::mutex>(*output_lock);
+				printf("Lookup  : %s\n  ++ invalid lookup: cannot be encoded as a DNS question\n", line);
+			}
+			if (result != 0)
+				stats.failures++;
 		}
-		else if (temp_cursor >= buf + response_size)
+
+		// dispatch replies and expired timers, completions free up room in the window, and wait
+		// no longer than until the next lookup may be started
+		int wait_ms = throttled ? (int) ceil((1 - tokens) * 1000 / rate_limit) : MAX_WAIT_MS;
+		if ((table->Size() > 0 || throttled) && engine.RunOnce(wait_ms) != 0)
 		{
-			printf("\n  ++ invalid record: jump beyond packet boundary");
-			return NULL;
+			status = -1;
+			break;
 		}
-
-		// check to see if another jump needs to be made at the current position
-		temp_cursor = SafeJump(temp_cursor, buf, response_size, jumped, ++jump_count);
 	}
-	return temp_cursor;
+	if (writer && FlushOutput() != 0)
+		printf("  ++ error: unable to write the output\n");
+
+	stats.hits += cache.Hits() - hits;
+	stats.misses += cache.Misses() - misses;
+	stats.negative_hits += cache.NegativeHits() - negative_hits;
+	stats.evictions += cache.Evictions() - evictions;
+	stats.cache_dropped += cache.Dropped() - cache_dropped;
+	stats.sent += queries_sent - sent;
+	stats.hedges_sent += hedges_sent - hedges;
+	stats.hedges_won += hedges_won - hedges_first;
+	stats.tcp_queries += tcp.Queries() - tcp_queries;
+	stats.tcp_opened += tcp.Opened() - tcp_opened;
+	stats.tcp_reused += tcp.Reused() - tcp_reused;
+	stats.syscalls += engine.Syscalls() - syscalls;
+	stats.datagrams_sent += metrics.Counter(METRIC_DATAGRAMS_SENT) - datagrams_sent;
+	stats.datagrams_received += metrics.Counter(METRIC_DATAGRAMS_RECEIVED) - datagrams_received;
+	stats.send_calls += metrics.Counter(METRIC_SEND_CALLS) - send_calls;
+	stats.receive_calls += metrics.Counter(METRIC_RECEIVE_CALLS) - receive_calls;
+	stats.coalesced += queries_coalesced - coalesced;
+	stats.prefetches += prefetches_sent - prefetches;
+	stats.prefetches_used += cache.PrefetchesUsed() - prefetches_used;
+	stats.snapshot_hits += cache.SnapshotHits() - snapshot_hits;
+	stats.snapshot_expired += cache.SnapshotExpired() - snapshot_expired;
+	return status;
 }
 
-// Gets a string corresponsing to a host name starting from the position 
-// indicated by cursor from the buffer starting at position 'start'. The 
-// total size of the buffer is indicated by response_size. In addition, 
-// advance the cursor by the number of characters read. Return the buffer 
-// of characters read or null if an error is encountered.
-char* DNSResolver::GetName(char* &cursor, char* start, int response_size)
+// Writes the buffered output of batch lookups, holding the output lock (if any).
+// Returns -1 if it could not be written or 0 otherwise.
+int DNSResolver::FlushOutput()
 {
-	bool jumped = false;
-	static char name_buf[MAX_DNS_SIZE];
-	char* temp_cursor = cursor;
-	int chars_read = 0;
+	std::unique_lock<std::mutex> guard;
+	if (output_lock != NULL)
+		guard = std::unique_lock<std::mutex>(*output_lock);
+	return writer->Flush();
+}
 
-	// check packet to make sure next byte can be read
-	if(cursor >= start + response_size)
+// Prints the summary of a batch resolved by one or more identically configured resolvers. The
+// counters of every server are summed over the resolvers and its estimates averaged.
+void DNSResolver::PrintBatchSummary(std::vector<DNSResolver*>& workers, BatchStats& stats, long long elapsed_ms)
+{
+	DNSResolver& first = *workers[0];
+	printf("********************************\n");
+	printf("Batch   : %d lookups, %d replies, %d failed in %lld ms (%.1f lookups/s)\n", stats.lookups, stats.replies,
+		stats.failures, elapsed_ms, (elapsed_ms > 0) ? stats.lookups * 1000.0 / elapsed_ms : (double) stats.lookups);
+	if (workers.size() > 1)
+		printf("Threads : %zu workers, %llu lookups stolen\n", workers.size(), stats.steals);
+	if (!stats.latencies.empty())
 	{
-		printf("\n  ++ invalid record: truncated name");
-		return NULL;
+		// latency of the lookups answered upstream, from submission to the first valid reply
+		std::vector<double>& latencies = stats.latencies;
+		std::sort(latencies.begin(), latencies.end());
+		size_t count = latencies.size();
+		printf("Latency : p50 %.2f ms, p95 %.2f ms, p99 %.2f ms, max %.2f ms over %zu replies\n", latencies[(count - 1) / 2],
+			latencies[(count - 1) * 95 / 100], latencies[(count - 1) * 99 / 100], latencies[count - 1], count);
 	}
-
-	// while the end of the name has not been reached
-	while (*temp_cursor != 0)
+	if (first.hedge_percentile > 0)
 	{
-		// jump if necessary
-		temp_cursor = SafeJump(temp_cursor, start, response_size, jumped, 0);
-		if (temp_cursor == NULL)
-			return NULL;
-
-		// get the number of bytes to read in the next section 
-		int num_chars = *temp_cursor;
-		chars_read++;
-
-		// advance the temporary cursor and the current cursor if necessary
-		if (temp_cursor < start + response_size)
+		printf("Hedging : after p%g of recent latency, %llu hedges sent, %llu answered first\n", first.hedge_percentile,
+			stats.hedges_sent, stats.hedges_won);
+	}
+	printf("Engine  : %s, %llu system calls in the event loop (%.2f per lookup), %.2f datagrams per send call, %.2f per receive call\n",
+		IOEngine::BackendName(first.engine.Backend()), stats.syscalls, (stats.lookups > 0) ? (double) stats.syscalls / stats.lookups : 0.0,
+		(stats.send_calls > 0) ? (double) stats.datagrams_sent / stats.send_calls : 0.0,
+		(stats.receive_calls > 0) ? (double) stats.datagrams_received / stats.receive_calls : 0.0);
+	if (stats.tcp_queries > 0)
+	{
+		printf("TCP     : %llu truncated answers retried, %llu connections opened, %llu queries on reused connections\n",
+			stats.tcp_queries, stats.tcp_opened, stats.tcp_reused);
+	}
+	for (int i = 0; i < first.upstreams.Size(); i++)
+	{
+		double srtt = 0, rttvar = 0, rto = 0, loss = 0;
+		ULONGLONG sent = 0, answered = 0, timeouts = 0;
+		for (size_t w = 0; w < workers.size(); w++)
 		{
-			temp_cursor++;
-			if (!jumped)
-				cursor++;
+			Upstream& server = workers[w]->upstreams.At(i);
+			srtt += server.rtt.SRTT();
+			rttvar += server.rtt.RTTVar();
+			rto += server.rtt.RTO();
+			loss += server.loss;
+			sent += server.sent;
+			answered += server.answered;
+			timeouts += server.timeouts;
 		}
-		else
+		double n = (double) workers.size();
+		printf("Upstream: %s, srtt %.2f ms, rttvar %.2f ms, rto %.2f ms, loss %.1f%%, %llu sent, %llu answered, %llu timeouts\n",
+			inet_ntoa(first.upstreams.At(i).addr.sin_addr), srtt / n, rttvar / n, rto / n, loss * 100 / n, sent, answered, timeouts);
+	}
+	if (first.cache_enabled)
+	{
+		printf("Cache   : %llu hits (%llu negative), %llu misses (%.1f%% hit rate), %llu queries sent upstream\n", stats.hits,
+			stats.negative_hits, stats.misses, (stats.hits + stats.misses > 0) ? stats.hits * 100.0 / (stats.hits + stats.misses) : 0.0,
+			stats.sent);
+
+		// the memory of every worker's cache, counted in the arena blocks holding its entries and
+		// the metadata of those
+		size_t answers = 0, used = 0, reserved = 0, budget = 0;
+		for (size_t w = 0; w < workers.size(); w++)
 		{
-			printf("\n  ++ invalid record: truncated name");
-			return NULL;
+			DNSCache& cache = workers[w]->cache;
+			answers += cache.Size();
+			used += cache.BytesUsed();
+			reserved += cache.BytesReserved();
+			budget += cache.Budget();
 		}
+		printf("Memory  : %zu answers in %.1f MB of cache blocks and metadata, %.1f MB allocated of %.1f MB, %llu evicted, %llu not stored\n",
+			answers, used / 1048576.0, reserved / 1048576.0, budget / 1048576.0, stats.evictions, stats.cache_dropped);
+	}
+	if (first.cache_enabled && first.cache.PrefetchPercent() > 0)
+	{
+		printf("Prefetch: %llu answers refreshed within the last %d%% of their TTL, %llu of them hit before expiring\n",
+			stats.prefetches, first.cache.PrefetchPercent(), stats.prefetches_used);
+	}
+	if (stats.coalesced > 0)
+		printf("Coalesce: %llu lookups joined an outstanding query for the same question\n", stats.coalesced);
+	if (first.cache_enabled && first.snapshot_path != NULL)
+	{
+		printf("Snapshot: %llu hits on the mapped snapshot, %llu expired responses skipped, ", stats.snapshot_hits, stats.snapshot_expired);
+		(stats.snapshot_saved >= 0) ? printf("%d responses saved to %s\n", stats.snapshot_saved, first.snapshot_path)
+			: printf("unable to save to %s\n", first.snapshot_path);
+	}
+}
+
+// Maps the cache snapshot at path, if there is a usable one, so that lookups missing from
+// the cache are answered from it, and saves the cache to path after every batch and
+// periodically in server mode. Returns the number of responses mapped.
+int DNSResolver::SetSnapshot(const char* path)
+{
+	snapshot_path = path;
+	int result = cache.OpenSnapshot(path);
+	snapshot_loaded = (result > 0) ? result : 0;
+	return snapshot_loaded;
+}
+
+// Saves the caches of the given resolvers, which must share a snapshot path, to the snapshot.
+// Returns the number of responses saved or -1 if the snapshot could not be written.
+int DNSResolver::SaveSnapshot(std::vector<DNSResolver*>& resolvers)
+{
+	std::vector<DNSCache*> caches;
+	for (size_t i = 0; i < resolvers.size(); i++)
+		caches.push_back(&resolvers[i]->cache);
+	return DNSCache::SaveSnapshot(resolvers[0]->snapshot_path, caches);
+}
+
+// Saves the traces of the given resolvers, which must all be tracing, to path.
+// Returns the number of lookups saved or -1 if the file could not be written.
+int DNSResolver::SaveTrace(const char* path, std::vector<DNSResolver*>& resolvers)
+{
+	std::vector<QueryTracer*> tracers;
+	for (size_t i = 0; i < resolvers.size(); i++)
+		tracers.push_back(resolvers[i]->tracer.get());
+	return QueryTracer::Save(path, tracers);
+}
+
+// Reads lookups (one hostname or IP per line) from input and resolves all of them against
+// the configured servers, keeping up to 'window' queries in flight on the socket at once. Replies
+// are matched to their query by TXID and question, so they may arrive in any order.
+// Prints the parsed response (or failure) of every lookup followed by a summary line.
+// Returns -1 if a socket error stopped the batch or 0 otherwise.
+int DNSResolver::ResolveBatch(FILE* input, int window)
+{
+	return ResolveLookups([input](char* line, int line_size, DNSQuestion& question)
+	{
+		return ReadBatchLine(input, line, line_size);
+	}, window);
+}
+
+// Resolves the PTR question of every address of a reverse sweep as ResolveBatch does
+int DNSResolver::ResolveBatch(ReverseSweep& sweep, int window)
+{
+	printf("Sweep   : %llu addresses\n", sweep.Size());
+	return ResolveLookups([&sweep](char* line, int line_size, DNSQuestion& question)
+	{
+		return sweep.Next(line, question) ? (int) strlen(line) : -1;
+	}, window);
+}
+
+// Resolves the lookups of a source with the given window, printing them and the summary
+int DNSResolver::ResolveLookups(BatchSource next_lookup, int window)
+{
+	if (upstreams.Size() == 0)
+		return printAndReturn("  ++ program error: no DNS server configured");
+	if (SetWindow(window) != 0)
+		return printAndReturn("  ++ program error: cannot resize the window while queries are outstanding");
+
+	PrintBatchHeader(window);
+	auto batch_start = std::chrono::steady_clock::now();
+	BatchStats stats;
+	int status = RunBatch(next_lookup, stats);
+
+	long long elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>
+		(std::chrono::steady_clock::now() - batch_start).count();
+	std::vector<DNSResolver*> workers(1, this);
+	if (cache_enabled && snapshot_path != NULL)
+		stats.snapshot_saved = SaveSnapshot(workers);
+	PrintBatchSummary(workers, stats, elapsed_ms);
+	return status;
+}
 
-		// while there are still more characters to read in the current section
-		while (num_chars > 0)
+// Removes the OPT record from the end of a response. Returns the new size of the response.
+int DNSResolver::StripEDNS(char* buf, int size)
+{
+	DNSMessage message(buf, size);
+	DNSRecord record;
+	while (message.Next(record))
+	{
+		// servers put the OPT record last, one anywhere else is left alone
+		if (record.section == SECTION_ADDITIONAL && record.type == DNS_OPT && record.rdata + record.rdlength == buf + size)
 		{
-			// collect the character in the output buffer and advance the cursor
-			name_buf[chars_read - 1] = *temp_cursor;
-			chars_read++;
-			if (temp_cursor < start + response_size)
-			{
-				temp_cursor++;
-				if (!jumped)
-					cursor++;
-			}
-			else
-			{
-				printf("\n  ++ invalid record: truncated name");
-				return NULL;
-			}
-			num_chars--;
+			DNSHeader* header = (DNSHeader*) buf;
+			header->additional = htons(ntohs(header->additional) - 1);
+			return record.offset;
 		}
+	}
+	return size;
+}
+
+// Sends a reply with the given RCODE and no records to a client query
+void DNSResolver::ReplyWithError(ClientQuery& client, int rcode)
+{
+	char reply[sizeof(DNSHeader) + sizeof(client.question)];
+	DNSHeader* header = (DNSHeader*) reply;
+	memset(reply, 0, sizeof(DNSHeader));
+	header->ID = htons(client.txid);
+	header->QR = 1;
+	header->RD = client.recursion_desired ? 1 : 0;
+	header->RA = 1;
+	header->result = rcode;
+	header->questions = htons((client.question_size > 0) ? 1 : 0);
+	memcpy(reply + sizeof(DNSHeader), client.question, client.question_size);
+	SendToClient(client, reply, (int) sizeof(DNSHeader) + client.question_size);
+}
+
+// Sends a reply to a client, length-prefixed if it asked over TCP. A connection that does 
+// not take the whole reply at once is closed.
+void DNSResolver::SendToClient(ClientQuery& client, const char* reply, int size)
+{
+	if (client.stream == INVALID_SOCKET)
+	{
+		sendto(listen_sock, reply, size, 0, (struct sockaddr*) &client.addr, sizeof(client.addr));
+		return;
+	}
+
+	// the connection may have been closed, and its socket reused, while the query was forwarded
+	auto stream = client_streams.find(client.stream);
+	if (stream == client_streams.end() || stream->second.serial != client.stream_serial)
+		return;
+	std::string framed;
+	framed += (char) (size >> 8);
+	framed += (char) (size & 0xFF);
+	framed.append(reply, size);
+	if (send(client.stream, framed.data(), (int) framed.size(), 0) != (int) framed.size())
+		CloseClientStream(client.stream);
+}
 
-		// check if unexpectedly reached EOF
-		if (temp_cursor >= start + response_size)
+// Sends a copy of a response as the reply to a client query: the TXID, RD flag and question
+// are the client's, the OPT record is removed if the client did not send one, and a response
+// too large for the client is replaced by an empty truncated one. The response is left as is,
+// as the other clients that joined the same query are answered from it too.
+void DNSResolver::ReplyToClient(const char* response, int size, ClientQuery& client)
+{
+	char* buf = client_reply.data();
+	memcpy(buf, response, size);
+	DNSHeader* header = (DNSHeader*) buf;
+	header->ID = htons(client.txid);
+	header->RD = client.recursion_desired ? 1 : 0;
+
+	// the cache and the servers match questions without regard to case, the client gets its own back
+	memcpy(buf + sizeof(DNSHeader), client.question, client.question_size);
+	if (!client.edns)
+		size = StripEDNS(buf, size);
+
+	// the client can ask again over TCP (RFC 1035 4.2.1), one that sent an OPT record still
+	// gets one back (RFC 6891 7)
+	if (size > client.payload_size)
+	{
+		header->TC = 1;
+		header->answers = header->authority = header->additional = 0;
+		size = (int) sizeof(DNSHeader) + client.question_size;
+		if (client.edns)
 		{
-			printf("\n  ++ invalid record: truncated name");
-			return NULL;
+			ResourceRecord opt;
+			opt.rType = htons(DNS_OPT);
+			opt.rClass = htons(MAX_UDP_SIZE);
+			opt.rTTL = 0;
+			opt.rLength = 0;
+			buf[size++] = 0;
+			memcpy(buf + size, &opt, sizeof(ResourceRecord));
+			size += sizeof(ResourceRecord);
+			header->additional = htons(1);
 		}
+		client_truncated++;
+	}
+	SendToClient(client, buf, size);
+}
 
-		// Add dot or null terminator to end of current output buffer after complete section has been collected
-		if (*temp_cursor != 0)
-			name_buf[chars_read - 1] = '.';
+// Answers a query from a client (its address or connection already filled in) from the
+// cache, or forwards it to the best server and answers once the reply arrives. Queries that
+// are not standard queries for a single question are answered with an error, messages that
+// are not queries at all are dropped.
+void DNSResolver::HandleClientQuery(char* buf, int size, ClientQuery& client)
+{
+	client_queries++;
+	DNSHeader* header = (DNSHeader*) buf;
+	if (size < (int) sizeof(DNSHeader) || header->QR)
+	{
+		client_dropped++;
+		return;
+	}
+
+	client.txid = ntohs(header->ID);
+	client.recursion_desired = header->RD;
+	if (header->opcode != 0)
+	{
+		ReplyWithError(client, DNS_NOTIMPL);
+		client_failures++;
+		return;
+	}
+
+	// the question is expanded in case the client compressed it, which is what servers are sent
+	DNSMessage message(buf, size);
+	DNSRecord record;
+	DNSQuestion question;
+	int name_size = -1;
+	if (ntohs(header->questions) == 1 && message.Next(record))
+		name_size = record.name.Expand(question.wire, MAX_NAME_SIZE);
+	if (name_size < 0 || record.name.Decode(question.text, MAX_NAME_SIZE) != PARSE_OK)
+	{
+		ReplyWithError(client, DNS_FORMAT);
+		client_failures++;
+		return;
+	}
+	QueryHeader* qheader = (QueryHeader*) (question.wire + name_size);
+	qheader->qType = htons(record.type);
+	qheader->qClass = htons(record.rclass);
+	question.type = record.type;
+	question.size = name_size + (int) sizeof(QueryHeader);
+	client.question_size = question.size;
+	memcpy(client.question, question.wire, question.size);
+
+	// over TCP any reply fits (RFC 7766 6.2.1)
+	EDNSInfo edns;
+	client.edns = (DNSMessage::FindEDNS(buf, size, edns) == 1);
+	if (client.stream != INVALID_SOCKET)
+		client.payload_size = MAX_TCP_SIZE;
+	else if (client.edns)
+		client.payload_size = std::min(std::max(edns.payload_size, (USHORT) MAX_DNS_SIZE), (USHORT) MAX_UDP_SIZE);
+
+	char answer[MAX_UDP_SIZE];
+	bool refresh = false;
+	int answer_size = cache_enabled ? cache.Lookup(question.wire, question.size, answer, MAX_UDP_SIZE, &refresh) : 0;
+	if (cache_enabled)
+		metrics.Add((answer_size > 0) ? METRIC_CACHE_HITS : METRIC_CACHE_MISSES);
+	if (answer_size > 0)
+	{
+		if (refresh)
+			RefreshAhead(question);
+		client_hits++;
+		ReplyToClient(answer, answer_size, client);
+		return;
+	}
+
+	QueryCallback on_reply = [this, client](PendingQuery& query, char* buf, int response_size) mutable
+	{
+		if (response_size > 0)
+			ReplyToClient(buf, response_size, client);
 		else
-			name_buf[chars_read - 1] = 0;
+		{
+			ReplyWithError(client, DNS_SERVERFAIL);
+			client_failures++;
+		}
+	};
+
+	// clients asking for a question already forwarded wait for its reply, even with the window full
+	if (JoinQuery(question.text, question, on_reply))
+	{
+		client_coalesced++;
+		return;
+	}
+
+	// the client retries on SERVFAIL, which is all that can be done while the window is full
+	PendingQuery* query = table->Full() ? NULL : PrepareQuery(question.text, question, on_reply);
+	if (query == NULL)
+	{
+		ReplyWithError(client, DNS_SERVERFAIL);
+		client_failures++;
+		return;
 	}
-	if (jumped)
-		cursor++;
 
-	cursor++;
-	return name_buf;
+	client_forwarded++;
+	if (SendDNSQuery(*query) == SOCKET_ERROR)
+		CompleteQuery(*query, NULL, -1);
 }
 
-// Function to format, send, and parse a DNS query and display the resulting information. 
-// If an error is encountered, prints a message and gracefully terminates program execution.
-int DNSResolver::ResolveDNS(DWORD query_type, char* lookup, DWORD server_ip)
+// Readiness handler of the listening socket in server mode, answers every waiting query
+void DNSResolver::OnClientReadable()
 {
-	// Finish setting up remote for UDP communication with local DNS server
-	server_addr.s_addr = server_ip;
-	remote.sin_addr = server_addr;
+	char buf[MAX_UDP_SIZE];
 
-	// Create properly formatted DNS query packet to send to server
-	int packet_size = 0;
-	int result = 0;
-	CreateDNSQueryPacket(query_type, lookup, packet_size);
-	if (packet == NULL)
-		return printAndReturn("  ++ program error: failed to create DNS query packet due to malloc failure");
-	printf("Server  : %s\n", inet_ntoa(server_addr));
-	printf("********************************\n");
-	
-	char buf[MAX_DNS_SIZE];
-
-	// Attempt to send/receive DNS query N times
-	for (int i = 0; i < MAX_ATTEMPTS; i++)
+	// bound the number of queries handled per wakeup so replies from the servers are not starved
+	for (int i = 0; i < RECEIVE_BATCH; i++)
 	{
-		// Start timer, attempt to send/receive DNS packet
-		printf("Attempt %d with %d bytes... ", i, packet_size);
-		start_time = std::chrono::high_resolution_clock::now();
-		result = SendDNSQuery(packet_size);
-		if (result == SOCKET_ERROR)
-			return printAndReturn("send encountered socket error", true);
-		else if (result == MISC_ERROR)
-			return printAndReturn("\n  ++ program error: attempted to send null packet");
-		result = ReceiveDNSQuery(buf);
-		stop_time = std::chrono::high_resolution_clock::now();
-
-		// check response from receive
-		if (result > 0)
+		struct sockaddr_in from;
+		int from_size = sizeof(from);
+		int size = recvfrom(listen_sock, buf, MAX_UDP_SIZE, 0, (struct sockaddr*) &from, &from_size);
+		if (size == SOCKET_ERROR)
 		{
-			printf("response in %lld ms with %d bytes\n",
-				std::chrono::duration_cast<std::chrono::milliseconds>
-				(stop_time - start_time).count(), result);
+			// a client that went away before its reply was sent shows up as a reset
+			int error = WSAGetLastError();
+			if (error == WSAECONNRESET || error == WSAEMSGSIZE)
+				continue;
 			break;
 		}
-		else if (result == 0)
+		ClientQuery client;
+		client.addr = from;
+		HandleClientQuery(buf, size, client);
+	}
+}
+
+// Readiness handler of the TCP listening socket in server mode, accepts connections
+void DNSResolver::OnClientAccept()
+{
+	SOCKET sock;
+	while ((sock = accept(stream_listen_sock, NULL, NULL)) != INVALID_SOCKET)
+	{
+		u_long non_blocking = 1;
+		ioctlsocket(sock, FIONBIO, &non_blocking);
+		client_streams[sock].serial = ++stream_serials;
+		engine.Watch(sock, POLLRDNORM, [this, sock](short revents) { OnClientStream(sock); });
+	}
+}
+
+// Readiness handler of a client connection, answers every complete length-prefixed query
+void DNSResolver::OnClientStream(SOCKET sock)
+{
+	ULONGLONG serial = client_streams[sock].serial;
+	char chunk[MAX_UDP_SIZE];
+	while (true)
+	{
+		int size = recv(sock, chunk, sizeof(chunk), 0);
+		if (size > 0)
+		{
+			client_streams[sock].received.append(chunk, size);
+			continue;
+		}
+		if (size == 0 || WSAGetLastError() != WSAEWOULDBLOCK)
 		{
-			printf("timeout in %lld ms\n",
-				std::chrono::duration_cast<std::chrono::milliseconds>
-				(stop_time - start_time).count());
+			CloseClientStream(sock);
+			return;
 		}
-		else if (result == SOCKET_ERROR)
-			return printAndReturn("receive encountered socket error", true);
-		else if (result == MISC_ERROR)
-			return printAndReturn("  ++ invalid reply: response not received on the same IP/port as requested server");
+		break;
 	}
-	if (result == 0)
-		return printAndReturn("  ++ no reply: no response from server");
 
-	// check to make sure response size is at least as large as the fixed DNS header
-	if (result < sizeof(DNSHeader))
-		return printAndReturn("\n  ++ invalid reply: smaller than fixed header");
+	// a reply from the cache may fail to be sent and close the connection between queries
+	auto stream = client_streams.find(sock);
+	while (stream != client_streams.end() && stream->second.serial == serial && stream->second.received.size() >= 2)
+	{
+		std::string& received = stream->second.received;
+		int length = (UCHAR) received[0] << 8 | (UCHAR) received[1];
+		if ((int) received.size() < 2 + length)
+			break;
 
-	// form DNSHeader from result to print response information
-	DNSHeader response = *(DNSHeader*)buf;
+		std::string query = received.substr(2, length);
+		received.erase(0, 2 + length);
+		ClientQuery client;
+		memset(&client.addr, 0, sizeof(client.addr));
+		client.stream = sock;
+		client.stream_serial = serial;
+		client_tcp++;
+		HandleClientQuery(&query[0], length, client);
+		stream = client_streams.find(sock);
+	}
+}
 
-	printf("  TXID 0x%.4X, flags 0x%.2X%.2X, questions %d, answers %d, authority %d, additional %d\n",
-		ntohs(response.ID), (UCHAR)buf[2], (UCHAR)buf[3], ntohs(response.questions),
-		ntohs(response.answers), ntohs(response.authority), ntohs(response.additional));
+// Stops watching and closes a client connection, replies still owed to it are not sent
+void DNSResolver::CloseClientStream(SOCKET sock)
+{
+	engine.Unwatch(sock);
+	closesocket(sock);
+	client_streams.erase(sock);
+}
 
-	// validate content of response packet and parse/print result records
-	if (ValidateAndParseResponse(buf, result) != 0)
-		return printAndReturn("");
+// Runs a caching forwarder on the given UDP and TCP port of the loopback interface: queries
+// from local clients are answered from the cache, misses are forwarded to the configured 
+// servers and their replies returned under the client's TXID. Clients whose reply was
+// truncated ask again over TCP. Prints statistics every SERVER_REPORT_MS. Runs until the
+// engine is stopped and returns -1 if a socket error stopped it or 0 otherwise.
+int DNSResolver::Serve(USHORT port)
+{
+	if (upstreams.Size() == 0)
+		return printAndReturn("  ++ program error: no DNS server configured");
 
-	return 0;
+	// only local clients are served, an open resolver on the network would be abused
+	listen_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (listen_sock == INVALID_SOCKET)
+		return printAndReturn("  ++ program error: socket() generated error", true);
+
+	struct sockaddr_in local;
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	local.sin_port = htons(port);
+	if (bind(listen_sock, (struct sockaddr*) &local, sizeof(local)) == SOCKET_ERROR)
+		return printAndReturn("  ++ program error: bind() generated error", true);
+
+	u_long non_blocking = 1;
+	if (ioctlsocket(listen_sock, FIONBIO, &non_blocking) == SOCKET_ERROR)
+		return printAndReturn("  ++ program error: ioctlsocket() generated error", true);
+	int buffer_size = SOCKET_BUFFER;
+	setsockopt(listen_sock, SOL_SOCKET, SO_RCVBUF, (char*) &buffer_size, sizeof(buffer_size));
+	engine.Watch(listen_sock, POLLRDNORM, [this](short revents) { OnClientReadable(); });
+
+	// clients whose reply was truncated ask again over TCP on the same port
+	stream_listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (stream_listen_sock == INVALID_SOCKET || bind(stream_listen_sock, (struct sockaddr*) &local, sizeof(local)) == SOCKET_ERROR
+		|| listen(stream_listen_sock, SOMAXCONN) == SOCKET_ERROR || ioctlsocket(stream_listen_sock, FIONBIO, &non_blocking) == SOCKET_ERROR)
+		return printAndReturn("  ++ program error: unable to listen on TCP, error", true);
+	engine.Watch(stream_listen_sock, POLLRDNORM, [this](short revents) { OnClientAccept(); });
+	client_reply.resize(MAX_TCP_SIZE);
+
+	PrintServers();
+	printf("Listen  : 127.0.0.1:%d over UDP and TCP\n", port);
+	if (cache_enabled && snapshot_path != NULL)
+		printf("Snapshot: %d cached responses mapped from %s\n", snapshot_loaded, snapshot_path);
+	printf("********************************\n");
+
+	engine.AddTimer(SERVER_REPORT_MS, [this]() { OnServerReport(); });
+	if (cache_enabled && snapshot_path != NULL)
+		engine.AddTimer(SNAPSHOT_INTERVAL_MS, [this]() { OnSnapshotTimer(); });
+	return engine.Run([]() { return false; });
+}
+
+// Timer callback that prints what became of the client queries so far in server mode
+void DNSResolver::OnServerReport()
+{
+	printf("Clients : %llu queries, %llu answered from cache, %llu forwarded (%llu sent upstream), %llu joined a forwarded query, "
+		"%llu failed, %llu truncated, %llu dropped, %llu over TCP\n", client_queries, client_hits, client_forwarded, queries_sent,
+		client_coalesced, client_failures, client_truncated, client_dropped, client_tcp);
+	if (cache_enabled)
+	{
+		printf("Memory  : %zu answers in %.1f MB of cache blocks and metadata, %.1f MB allocated of %.1f MB, %llu evicted, %llu not stored\n",
+			cache.Size(), cache.BytesUsed() / 1048576.0, cache.BytesReserved() / 1048576.0, cache.Budget() / 1048576.0, cache.Evictions(),
+			cache.Dropped());
+	}
+	if (cache_enabled && cache.PrefetchPercent() > 0)
+		printf("Prefetch: %llu answers refreshed ahead of expiry, %llu of them hit\n", prefetches_sent, cache.PrefetchesUsed());
+	fflush(stdout);
+	engine.AddTimer(SERVER_REPORT_MS, [this]() { OnServerReport(); });
+}
+
+// Timer callback that saves the cache to the snapshot every SNAPSHOT_INTERVAL_MS in server mode
+void DNSResolver::OnSnapshotTimer()
+{
+	std::vector<DNSResolver*> resolvers(1, this);
+	if (SaveSnapshot(resolvers) < 0)
+		printf("Snapshot: unable to save to %s\n", snapshot_path);
+	engine.AddTimer(SNAPSHOT_INTERVAL_MS, [this]() { OnSnapshotTimer(); });
 }
@@ -1,96 +1,413 @@
 #pragma once
 
+// Source of batch lookups. Copies the next lookup into line (of line_size bytes) and returns
+// its length, 0 for a line without a lookup, or -1 once there are no more. A source that 
+// encodes its own questions writes the question of the lookup into 'question', which is 
+// otherwise left empty (size 0) and the question is made from the text of the lookup.
+typedef std::function<int(char* line, int line_size, DNSQuestion& question)> BatchSource;
+
+// Outcome of a batch and the counters of the resolvers that ran it
+struct BatchStats
+{
+	int lookups = 0, replies = 0, failures = 0;
+	std::vector<double> latencies;
+	ULONGLONG hits = 0, negative_hits = 0, misses = 0, sent = 0, evictions = 0, cache_dropped = 0;
+	ULONGLONG hedges_sent = 0, hedges_won = 0;
+	ULONGLONG tcp_queries = 0, tcp_opened = 0, tcp_reused = 0;
+
+	// System calls made by the I/O engines for their UDP and watched sockets, datagrams sent and received
+	// through them, and the system calls among those that sent or received datagrams
+	ULONGLONG syscalls = 0;
+	ULONGLONG datagrams_sent = 0, datagrams_received = 0, send_calls = 0, receive_calls = 0;
+
+	// Lookups that joined an outstanding query for the same question
+	ULONGLONG coalesced = 0;
+
+	// Cached answers re-resolved ahead of their expiry, and refreshed answers hit afterwards
+	ULONGLONG prefetches = 0, prefetches_used = 0;
+
+	// Lookups answered from the snapshot of an earlier process, responses in it found expired,
+	// and responses saved to the snapshot after the batch (-1 if it could not be saved)
+	ULONGLONG snapshot_hits = 0, snapshot_expired = 0;
+	int snapshot_saved = 0;
+
+	// Lookups a worker thread took from the queue of another
+	ULONGLONG steals = 0;
+};
+
+// A query received from a client in server mode, kept until it has been answered
+struct ClientQuery
+{
+	struct sockaddr_in addr;
+	USHORT txid = 0;
+	bool recursion_desired = false;
+
+	// Connection the query came on and the serial it was accepted under, INVALID_SOCKET if it
+	// came over UDP
+	SOCKET stream = INVALID_SOCKET;
+	ULONGLONG stream_serial = 0;
+
+	// Whether the client sent an OPT record, and the largest reply it accepts (at most 
+	// MAX_UDP_SIZE over UDP)
+	bool edns = false;
+	USHORT payload_size = MAX_DNS_SIZE;
+
+	// The question exactly as the client sent it, echoed back in the reply
+	int question_size = 0;
+	char question[MAX_NAME_SIZE + sizeof(QueryHeader)];
+};
+
 /*
  * The DNSResolver class is designed to be able to issue recursive queries to a 
  * specified DNS server, as well as parse and print the response.
  */
 class DNSResolver
 {
-	SOCKET sock;
-	struct sockaddr_in remote;
-	struct in_addr server_addr;
-	USHORT curr_id;
-	char* packet = NULL;
+	IOEngine engine;
+
+	// Persistent connections to the servers for answers that do not fit in a datagram
+	TCPPool tcp;
+	std::unique_ptr<InFlightTable> table;
+	DNSCache cache;
+
+	// Servers queries are sent to, along with their latency and loss statistics
+	UpstreamSet upstreams;
+	bool race = false;
+	bool cache_enabled = true;
+
+	// UDP payload size advertised in an EDNS(0) OPT record, 0 to send plain queries
+	USHORT edns_size = DEFAULT_EDNS_SIZE;
+	ULONGLONG queries_sent = 0;
+
+	// Lookups that waited for an outstanding query for the same question instead of sending their own
+	ULONGLONG queries_coalesced = 0;
+
+	// Popular cached answers re-resolved in the background before they expire
+	ULONGLONG prefetches_sent = 0;
+
+	// Counters and latency histograms read by the metrics exporter
+	ResolverMetrics metrics;
+
+	// Ring the phases of every lookup are recorded in, NULL unless tracing
+	std::unique_ptr<QueryTracer> tracer;
+
+	// File the cache is mapped from at startup and saved to, NULL for none, and the number of 
+	// responses that were mapped
+	const char* snapshot_path = NULL;
+	int snapshot_loaded = 0;
+
+	// Held while the outcome of a lookup is printed when several resolvers share the output
+	std::mutex* output_lock = NULL;
 
-	// Beginning and end time points for timer implementation
-	std::chrono::time_point<std::chrono::high_resolution_clock> start_time, stop_time;
+	// Whether batch lookups are only checked instead of printed, for benchmarks
+	bool quiet = false;
+
+	// Writes batch lookups in a machine-readable format instead of printing them, NULL unless set
+	std::unique_ptr<OutputWriter> writer;
+
+	// Sockets clients send their queries to in server mode over UDP and TCP, and what became
+	// of those queries
+	SOCKET listen_sock = INVALID_SOCKET, stream_listen_sock = INVALID_SOCKET;
+	ULONGLONG client_queries = 0, client_hits = 0, client_forwarded = 0, client_failures = 0;
+	ULONGLONG client_truncated = 0, client_dropped = 0, client_coalesced = 0, client_tcp = 0;
+
+	// Bytes received so far on every accepted client connection, with the serial it was 
+	// accepted under so that a reply owed to a closed one never goes to a later one
+	struct ClientStream
+	{
+		ULONGLONG serial = 0;
+		std::string received;
+	};
+	std::unordered_map<SOCKET, ClientStream> client_streams;
+	ULONGLONG stream_serials = 0;
+
+	// Reply to a client being written
+	std::vector<char> client_reply;
+
+	// Lookups started per second in batch mode, 0 for no limit
+	double rate_limit = 0;
+
+	// Percentile of a server's recent latency after which an attempt is hedged (0 for never)
+	double hedge_percentile = 0;
+	ULONGLONG hedges_sent = 0, hedges_won = 0;
 
 	// Simple function that prints an error message given as an argument and returns the constant value -1.
 	// If a true boolean is included as the last argument, print the result of WSAGetLastError() as well.
 	int printAndReturn(const char* msg, bool wsa);
 	
-	// Create valid Type A query string based on supplied hostname string (e.x. www.google.com -> 3www6google3com0)
-	// Returns the dynamically allocated formatted query string of NULL in the event of an error
-	char* FormatTypeAQuery(char* lookup_string);
+	// Write the label-encoded form of a hostname into buf (e.x. www.google.com -> 3www6google3com0) in a 
+	// single pass. A single trailing '.' is accepted. Returns the number of bytes written, or -1 if a label
+	// is empty or longer than MAX_LABEL_SIZE, or the encoded name does not fit in bufsize bytes.
+	int FormatTypeAQuery(const char* lookup_string, char* buf, int bufsize);
 	
-	// Create valid Type PTR query string based on supplied IP string (e.x. 192.168.2.1 -> 1.2.168.192.in-addr.arpa)
-	// Returns the dynamically allocated formatted query string of NULL in the event of an error
-	char* FormatTypePTRQuery(char* lookup_string);
+	// Write a basic recursive DNS query header with the given TXID to the start of buf
+	void CreateDNSHeader(USHORT txid, char* buf);
 	
-	// Create and return basic recursive DNS query header
-	DNSHeader CreateDNSHeader();
-	
-	// Initialize a valid DNS Query packet given the type of query (A or PTR) and the lookup string.
-	// Also take in the packet_size (initially 0) and modify it to reflect the final size of the 
-	// formatted DNS packet.
-	void CreateDNSQueryPacket(DWORD query_type, char* lookup, int& packet_size);
-
-	// Send DNS query to connected server through UDP socket.
-	// Returns -1 to indicate a problem sending the packet, or -2 to indicate that 
-	// the packet has not been correctly allocated.
-	int SendDNSQuery(DWORD packet_size);
-
-	// Attempts to receive a UDP packet response into character buffer buf. 
-	// If a response is successfully read, return number of bytes read and 
-	// return the buffer that was passed in by reference.
-	// The timeout is set to 10 seconds by default.
-	// Returns -1 if there was a network error recieving the packet, or 
-	// -2 to indicate that the received packet did not originate from the 
-	// originally contacted server.
-	int ReceiveDNSQuery(char buf[]);
+	// Create the question section (label-encoded name followed by the query header) for a lookup
+	// of the given type (A, or PTR for an IPv4 or IPv6 address) directly in the question buffers, along 
+	// with the dotted form of the question. The encoded question doubles as the cache key of the lookup.
+	// Returns the size of the question or -1 if the lookup could not be encoded.
+	int CreateDNSQuestion(DWORD query_type, char* lookup, DNSQuestion& question);
+
+	// Initialize a valid DNS Query packet in the packet buffer of the query slot from a basic recursive
+	// header and an encoded question, followed by an OPT record advertising the EDNS(0) payload size
+	// if EDNS is on. Returns the final size of the formatted DNS packet.
+	int CreateDNSQueryPacket(PendingQuery& query, DNSQuestion& question);
+
+	// Looks up the question of a lookup in the answer cache. On a hit, the aged response is copied
+	// into buf (MAX_UDP_SIZE bytes) and 'hit' is filled in as if the response had been received for
+	// it. A popular answer near its expiry is re-resolved in the background only if refresh_ahead
+	// is set, i.e. if an event loop will run to receive it. Returns the size of the cached response,
+	// or 0 on a miss.
+	int LookupCache(char* lookup, DNSQuestion& question, PendingQuery& hit, char* buf, bool refresh_ahead);
+
+	// Re-resolves a cached question in the background so that its answer is replaced before it
+	// expires. Nothing is sent if the question is already outstanding, and the refresh is left
+	// to a later hit if the window is full.
+	void RefreshAhead(DNSQuestion& question);
+
+	// Reserves an in-flight slot for an encoded question and creates its packet. The callback 
+	// is called exactly once when the query is answered, times out or fails.
+	// Returns NULL if the window is full.
+	PendingQuery* PrepareQuery(char* lookup, DNSQuestion& question, QueryCallback callback);
+
+	// Submits (another) transmission of a DNS query to the I/O engine and arms its 
+	// retransmission timer from the RTT estimate of the server. The attempt goes to the server
+	// with the lowest expected answer time that this query has not been sent to yet, and when 
+	// racing is on also to the runner-up. Queries whose answer was truncated go over TCP to a
+	// single server instead. Returns -1 to indicate a problem sending the packet, or -2 to 
+	// indicate that the packet has not been correctly created.
+	int SendDNSQuery(PendingQuery& query);
+
+	// Sends an attempt of a query to the server already chosen for it over one of the pooled
+	// TCP connections to that server and arms its retransmission timer, which allows at least
+	// TCP_MIN_TIMEOUT_MS for the connection to be set up. Returns -1 if no connection could be opened.
+	int SendTCPQuery(PendingQuery& query);
+
+	// Datagram handler of the I/O engine, and message handler of the TCP connections. Replies
+	// that did not originate from a server the query was sent to, or do not match an outstanding
+	// query by TXID and question, are dropped. The first valid reply completes its query, unless
+	// it was truncated, in which case the query is sent again over TCP, or it shows that the server
+	// does not understand EDNS(0), in which case the query is sent again without it.
+	void ReceiveDNSQuery(char* buf, int response_size, struct sockaddr_in& from);
+
+	// Timer callback for a transmission of the query in the given slot that went unanswered.
+	// Retransmits the query, or completes it as timed out after MAX_ATTEMPTS attempts (or the
+	// attempt over TCP that may follow a truncated answer to the last one).
+	void OnQueryTimeout(int slot, UINT serial);
+
+	// Timer callback for an attempt of the query in the given slot that has not been answered
+	// within the hedging percentile of its server's recent latency. Sends a duplicate to the 
+	// best server (preferring one the query has not been sent to), whichever reply comes first wins.
+	void OnQueryHedge(int slot, UINT serial, int attempt);
+
+	// Adds a lookup to the outstanding query for the same question (keyed by the question section 
+	// of its packet), if there is one that can take another waiter, so that both are completed 
+	// from one response. Returns true if the lookup joined a query.
+	bool JoinQuery(char* lookup, DNSQuestion& question, QueryCallback callback);
+
+	// Hands the response (or NULL and 0 on timeout, -1 on error) to the callback of a
+	// query, then to those of the lookups waiting on it, and releases its slot
+	void CompleteQuery(PendingQuery& query, char* buf, int response_size);
+
+	// Submits a lookup whose question was encoded from encode_time on, as SubmitQuery does
+	int SubmitEncoded(char* lookup, DNSQuestion& question, QueryCallback callback, std::chrono::steady_clock::time_point encode_time);
 
 	// Takes a DNS response from the server as a character buffer in addition to the 
-	// size of the response and validates the response against the original packet. 
+	// size of the response and validates the response against the packet of the original query. 
 	// If response is successfully validated, parse the DNS answers and print the results.
 	// Prints a message and returns -1 in case of failure or 0 for success.
-	int ValidateAndParseResponse(char* buf, int response_size);
-
-	// Print N resource records from a given buffer with starting location given by cursor. 
-	// Additionally, advance cursor by the amount advanced. 
-	// Returns -1 in case an error was encountered or 0 if successful.
-	int PrintResourceRecords(USHORT num_records, char* buf, char*& cursor, int response_size);
-
-	// Gets an IPv4 address starting from the position indicated by cursor 
-	// from the buffer starting at position 'start'. The total size of the 
-	// buffer is indicated by response_size. In addition, advance the cursor
-	// by the number of characters read. Return the buffer of characters read
-	// or null if an error is encountered.
-	char* GetIPv4Address(char*& cursor, char* start, int response_size);
-
-	// Checks the byte indicated by cursor in a buffer to see if the cursor needs 
-	// to jump to another offset in the buffer. Continues jumping and checking the 
-	// current position until an end position is found or 10 jumps are made 
-	// (indicating a jump loop). Returns an updated cursor to the corresponding 
-	// buffer offset and a status flag indicating if a jump was made. returns null
-	// in case of failure.
-	char* SafeJump(char* cursor, char* buf, int response_size, bool& jumped, int jump_count);
-
-	// Gets a string corresponsing to a host name starting from the position 
-	// indicated by cursor from the buffer starting at position 'start'. The 
-	// total size of the buffer is indicated by response_size. In addition, 
-	// advance the cursor by the number of characters read. Return the buffer 
-	// of characters read or null if an error is encountered.
-	char* GetName(char*& cursor, char* start, int response_size);
+	int ValidateAndParseResponse(char* buf, int response_size, PendingQuery& query);
+
+	// Prints the fixed header of a response followed by the validated and parsed records.
+	// Returns -1 if the response was invalid or 0 for success.
+	int PrintResponse(char* buf, int response_size, PendingQuery& query);
+
+	// Print the next N questions or resource records read from a message. Records of types 
+	// other than A, PTR, CNAME, NS and OPT are skipped. Returns -1 in case an error was encountered 
+	// or 0 if successful.
+	int PrintResourceRecords(DNSMessage& message, USHORT num_records);
+
+	// Writes the buffered output of batch lookups, holding the output lock (if any).
+	// Returns -1 if it could not be written or 0 otherwise.
+	int FlushOutput();
+
+	// Prints the list of configured servers
+	void PrintServers();
+
+	// Readiness handler of the listening socket in server mode, answers every waiting query
+	void OnClientReadable();
+
+	// Readiness handler of the TCP listening socket in server mode, accepts connections
+	void OnClientAccept();
+
+	// Readiness handler of a client connection, answers every complete length-prefixed query
+	void OnClientStream(SOCKET sock);
+
+	// Stops watching and closes a client connection, replies still owed to it are not sent
+	void CloseClientStream(SOCKET sock);
+
+	// Answers a query from a client (its address or connection already filled in) from the
+	// cache, or forwards it to the best server and answers once the reply arrives. Queries that
+	// are not standard queries for a single question are answered with an error, messages that
+	// are not queries at all are dropped.
+	void HandleClientQuery(char* buf, int size, ClientQuery& client);
+
+	// Sends a reply to a client, length-prefixed if it asked over TCP. A connection that does 
+	// not take the whole reply at once is closed.
+	void SendToClient(ClientQuery& client, const char* reply, int size);
+
+	// Sends a copy of a response as the reply to a client query: the TXID, RD flag and question
+	// are the client's, the OPT record is removed if the client did not send one, and a response
+	// too large for the client is replaced by an empty truncated one. The response is left as is,
+	// as the other clients that joined the same query are answered from it too.
+	void ReplyToClient(const char* response, int size, ClientQuery& client);
+
+	// Sends a reply with the given RCODE and no records to a client query
+	void ReplyWithError(ClientQuery& client, int rcode);
+
+	// Removes the OPT record from the end of a response. Returns the new size of the response.
+	static int StripEDNS(char* buf, int size);
+
+	// Timer callback that prints what became of the client queries so far in server mode
+	void OnServerReport();
+
+	// Timer callback that saves the cache to the snapshot every SNAPSHOT_INTERVAL_MS in server mode
+	void OnSnapshotTimer();
+
 	
 public:
 
-	// Basic constructor for the DNS resolver class Initializes WinSock and opens and binds a UDP socket
-	DNSResolver();
+	// Basic constructor for the DNS resolver class. Initializes WinSock and opens the UDP socket
+	// of the I/O engine using the given backend.
+	DNSResolver(IOBackend backend = IO_POLL);
 	
-	// Destructor cleans up winsock and closes socket
+	// Destructor closes the socket of the I/O engine and cleans up winsock
 	~DNSResolver();
 	
 	// Function to format, send, and parse a DNS query and display the resulting information. 
 	// If an error is encountered, prints a message and gracefully terminates program execution.
-	int ResolveDNS(DWORD type, char* lookup, DWORD server_ip);
+	int ResolveDNS(DWORD type, char* lookup);
+
+	// Reserves a slot for a query, creates its packet and submits it to the I/O engine. The 
+	// callback is called from the event loop once the query completes, or right away if the
+	// answer is cached, or with an error (NULL and -1) if the packet could not be sent.
+	// Returns 0 if the query was submitted, or -2 if the lookup cannot be encoded or the window
+	// is full.
+	int SubmitQuery(DWORD type, char* lookup, QueryCallback callback);
+
+	// Submits a lookup whose question has already been encoded, as SubmitQuery does
+	int SubmitQuestion(char* lookup, DNSQuestion& question, QueryCallback callback);
+
+	// Returns the type of query for a lookup: PTR for an IPv4 or IPv6 address, A otherwise
+	static DWORD LookupType(const char* lookup);
+
+	// Returns true if no further query can be submitted until an outstanding one completes
+	bool WindowFull() { return table->Full(); }
+
+	// Adds the servers of a comma separated list of IPv4 addresses to the servers queried.
+	// Returns the number of servers added or -1 if the list is invalid.
+	int AddServers(const char* list) { return upstreams.AddList(list); }
+
+	// Turns sending every attempt to the best two servers at once on or off
+	void SetRace(bool enabled) { race = enabled; }
+
+	// Sets the percentile (0 to 100) of a server's recent latency after which an unanswered 
+	// attempt is duplicated to the best server, 0 turns hedging off
+	void SetHedge(double percentile) { hedge_percentile = percentile; }
+
+	// Sets the UDP payload size advertised with EDNS(0), between MAX_DNS_SIZE and MAX_UDP_SIZE,
+	// or 0 to send queries without an OPT record. Returns -1 if the size is out of range.
+	int SetEDNS(int payload_size);
+
+	// Turns answering lookups from (and storing responses in) the answer cache on or off
+	void SetCacheEnabled(bool enabled) { cache_enabled = enabled; }
+
+	// Re-resolves cached answers hit at least PREFETCH_MIN_HITS times once they are within the
+	// last 'percent' percent of their TTL, 0 turns refresh-ahead off
+	void SetPrefetch(int percent) { cache.SetPrefetch(percent); }
+
+	// Sets the number of bytes the answer cache and its metadata may take, entries are evicted beyond that
+	void SetCacheBudget(size_t bytes) { cache.SetBudget(bytes); }
+
+	// Maps the cache snapshot at path, if there is a usable one, so that lookups missing from
+	// the cache are answered from it, and saves the cache to path after every batch and
+	// periodically in server mode. Returns the number of responses mapped.
+	int SetSnapshot(const char* path);
+	const char* SnapshotPath() { return snapshot_path; }
+
+	// Saves the caches of the given resolvers, which must share a snapshot path, to the snapshot.
+	// Returns the number of responses saved or -1 if the snapshot could not be written.
+	static int SaveSnapshot(std::vector<DNSResolver*>& resolvers);
+
+	// Limits the lookups started per second in batch mode, 0 for no limit
+	void SetRate(double per_second) { rate_limit = per_second; }
+
+	// Changes the number of queries that may be in flight at once. Only possible while no
+	// query is outstanding, returns -1 otherwise or 0 for success.
+	int SetWindow(int window);
+
+	// Holds the given lock while printing the outcome of every batch lookup, or NULL for none
+	void SetOutputLock(std::mutex* lock) { output_lock = lock; }
+
+	// Turns printing the outcome of every batch lookup off (only failures are counted) or on
+	void SetQuiet(bool enabled) { quiet = enabled; }
+
+	// Writes the outcome of every batch lookup to output in the given format instead of printing
+	// it, OUTPUT_HUMAN prints it again. Output is buffered and written under the output lock.
+	void SetOutput(OutputFormat format, FILE* output) { writer.reset((format != OUTPUT_HUMAN) ? new OutputWriter(format, output) : NULL); }
+
+	// Returns the counters and latency histograms of this resolver, readable from any thread
+	const ResolverMetrics& Metrics() { return metrics; }
+
+	// Records the phases of the last 'records' lookups of the resolver of the given worker
+	// thread, 0 turns tracing off
+	void SetTrace(int records, int worker = 0) { tracer.reset((records > 0) ? new QueryTracer(records, worker) : NULL); }
+
+	// Saves the traces of the given resolvers, which must all be tracing, to path.
+	// Returns the number of lookups saved or -1 if the file could not be written.
+	static int SaveTrace(const char* path, std::vector<DNSResolver*>& resolvers);
+
+	// Reads every record of a response and decodes its names the way PrintResponse does, without
+	// printing anything. Returns -1 if the response failed or is malformed or 0 for success.
+	static int CheckResponse(const char* buf, int response_size);
+
+	// Reads the next lookup (hostname or IP) from a batch input stream into line, stripping 
+	// surrounding whitespace. Blank lines and lines starting with '#' produce an empty lookup.
+	// Returns the length of the lookup, or -1 once the end of the input has been reached.
+	static int ReadBatchLine(FILE* input, char* line, int line_size);
+
+	// Prints the servers and window of a batch, ahead of the lookups
+	void PrintBatchHeader(int window);
+
+	// Resolves lookups taken from next_lookup until it runs out, keeping the window of this resolver
+	// full. Prints the parsed response (or failure) of every lookup, holding the output lock (if 
+	// any) for each, or buffers it in the format set with SetOutput, and adds the outcome and the
+	// counters of this resolver to stats.
+	// Returns -1 if a socket error stopped the batch or 0 otherwise.
+	int RunBatch(BatchSource next_lookup, BatchStats& stats);
+
+	// Prints the summary of a batch resolved by one or more identically configured resolvers. The
+	// counters of every server are summed over the resolvers and its estimates averaged.
+	static void PrintBatchSummary(std::vector<DNSResolver*>& workers, BatchStats& stats, long long elapsed_ms);
+
+	// Reads lookups (one hostname or IP per line) from input and resolves all of them against
+	// the configured servers, keeping up to 'window' queries in flight on the socket at once. Replies
+	// are matched to their query by TXID and question, so they may arrive in any order.
+	// Prints the parsed response (or failure) of every lookup followed by a summary line.
+	// Returns -1 if a socket error stopped the batch or 0 otherwise.
+	int ResolveBatch(FILE* input, int window);
+
+	// Resolves the PTR question of every address of a reverse sweep as ResolveBatch does
+	int ResolveBatch(ReverseSweep& sweep, int window);
+
+	// Resolves the lookups of a source with the given window, printing them and the summary
+	int ResolveLookups(BatchSource next_lookup, int window);
+
+	// Runs a caching forwarder on the given UDP and TCP port of the loopback interface: queries
+	// from local clients are answered from the cache, misses are forwarded to the configured 
+	// servers and their replies returned under the client's TXID. Clients whose reply was
+	// truncated ask again over TCP. Prints statistics every SERVER_REPORT_MS. Runs until the
+	// engine is stopped and returns -1 if a socket error stopped it or 0 otherwise.
+	int Serve(USHORT port);
 };
\ No newline at end of file
@@ -8,42 +8,415 @@
 #define _CRTDBG_MAP_ALLOC  
 #include <stdlib.h>  
 #include <crtdbg.h> // libraries to check for memory leaks
+#include <io.h>
+#include <fcntl.h>
 
 #pragma comment(lib, "ws2_32.lib")
 
 using namespace std;
 
+// Resolves every hostname or IP listed in a file (or stdin when the name is "-") 
+// against the configured servers using the batch mode of the resolver
+int RunBatch(DNSResolver& resolver, char* path, int window)
+{
+	FILE* input = stdin;
+	if (strcmp(path, "-") != 0 && fopen_s(&input, path, "r") != 0)
+	{
+		printf("error: unable to open batch input file '%s'\n", path);
+		return(EXIT_FAILURE);
+	}
+
+	int result = resolver.ResolveBatch(input, window);
+	if (input != stdin)
+		fclose(input);
+	return result;
+}
+
+// Resolves every hostname or IP listed in a file (or stdin when the name is "-") on several
+// worker threads, each with a resolver and socket of its own
+int RunShardedBatch(ShardedResolver& sharded, char* path, int window)
+{
+	FILE* input = stdin;
+	if (strcmp(path, "-") != 0 && fopen_s(&input, path, "r") != 0)
+	{
+		printf("error: unable to open batch input file '%s'\n", path);
+		return(EXIT_FAILURE);
+	}
+
+	int result = sharded.ResolveBatch(input, window);
+	if (input != stdin)
+		fclose(input);
+	return result;
+}
+
+// Resolves the PTR record of every address in a comma separated list of CIDR blocks, on
+// several worker threads when a sharded resolver is given
+int RunSweep(DNSResolver* resolver, ShardedResolver* sharded, char* blocks, int window)
+{
+	ReverseSweep sweep;
+	if (sweep.AddList(blocks) <= 0)
+	{
+		printf("error: '%s' is not a list of CIDR blocks (at most %d addresses each)\n", blocks, MAX_SWEEP_SIZE);
+		return(EXIT_FAILURE);
+	}
+	return (sharded != NULL) ? sharded->ResolveBatch(sweep, window) : resolver->ResolveBatch(sweep, window);
+}
+
+// Runs a mode with the metrics of the given resolvers written to metrics_path (unless it is NULL)
+// every interval_ms milliseconds while it runs and once more when it is done, and the phases of
+// their lookups traced to trace_path (unless it is NULL) when done. Returns the result of run.
+int RunInstrumented(std::vector<DNSResolver*> resolvers, const char* metrics_path, int interval_ms,
+	const char* trace_path, std::function<int()> run)
+{
+	std::unique_ptr<MetricsExporter> exporter;
+	if (metrics_path != NULL)
+	{
+		exporter.reset(new MetricsExporter(metrics_path, interval_ms));
+		for (size_t i = 0; i < resolvers.size(); i++)
+			exporter->Add(resolvers[i]->Metrics());
+		exporter->Start();
+	}
+	for (size_t i = 0; i < resolvers.size() && trace_path != NULL; i++)
+		resolvers[i]->SetTrace(TRACE_RECORDS, (int) i);
+
+	int result = run();
+	if (exporter)
+		exporter->Stop();
+	if (trace_path != NULL)
+	{
+		int saved = DNSResolver::SaveTrace(trace_path, resolvers);
+		(saved >= 0) ? printf("Trace   : %d lookups saved to %s\n", saved, trace_path) : printf("Trace   : unable to save to %s\n", trace_path);
+	}
+	return result;
+}
+
+// Opens the file batch lookups are written to in a machine-readable format and writes the start
+// of the stream. A path of "-" writes them to stdout, which then only carries the lookups: the
+// report printed alongside them goes to stderr instead. Returns NULL if it cannot be written.
+FILE* OpenOutput(const char* path, OutputFormat format)
+{
+	FILE* output = NULL;
+	if (strcmp(path, "-") == 0)
+	{
+		// the lookups keep the original stdout, in binary mode so no newline is translated
+		fflush(stdout);
+		int fd = _dup(_fileno(stdout));
+		if (fd < 0 || (output = _fdopen(fd, "wb")) == NULL)
+			return NULL;
+		_setmode(fd, _O_BINARY);
+		_dup2(_fileno(stderr), _fileno(stdout));
+	}
+	else if (fopen_s(&output, path, "wb") != 0)
+		return NULL;
+
+	if (OutputWriter::WriteStreamHeader(output, format) != 0)
+	{
+		fclose(output);
+		return NULL;
+	}
+	return output;
+}
+
+// Prints the command line usage of the program
+void PrintUsage()
+{
+	printf("\nusage: Driver.exe [options] <Hostname or IP> <DNS Server IP[,IP...]>\n");
+	printf("       Driver.exe [options] -batch <Input file or -> <DNS Server IP[,IP...]>\n");
+	printf("       Driver.exe [options] -sweep <CIDR[,CIDR...]> <DNS Server IP[,IP...]>\n");
+	printf("       Driver.exe [options] -serve <Port> <DNS Server IP[,IP...]>\n");
+	printf("       Driver.exe [options] -bench <Lookups>\n");
+	printf("       Driver.exe [-corpus <Directory>] -parsebench <Iterations>\n");
+	printf("       Driver.exe -writecorpus <Directory>\n");
+	printf("       Driver.exe -readtrace <Trace file>\n");
+	printf("DNS server IPs may be followed by :port (default %d)\n", DNS_PORT);
+	printf("options:\n");
+	printf("  -window <n>        queries kept in flight in batch and server mode (default %d, at most %d)\n", DEFAULT_WINDOW, MAX_WINDOW);
+	printf("  -threads <n>       worker threads in batch mode, each with its own socket (default 1, at most %d)\n", MAX_THREADS);
+	printf("  -io <poll|iocp|rio> event loop backend, rio submits datagrams in batches (default poll)\n");
+	printf("  -cache <on|off>    answer repeated lookups from the in-memory cache (default on)\n");
+	printf("  -cachemem <MB>     memory the cache may take with its index and queues, split between worker threads (default %d)\n", DEFAULT_CACHE_MB);
+	printf("  -race <on|off>     send every attempt to the two fastest servers at once (default off)\n");
+	printf("  -edns <size|off>   UDP payload size advertised with EDNS(0), %d to %d (default %d)\n", MAX_DNS_SIZE, MAX_UDP_SIZE, DEFAULT_EDNS_SIZE);
+	printf("  -hedge <pct|off>   duplicate attempts unanswered after this percentile of recent latency (default off)\n");
+	printf("  -prefetch <pct|off> refresh popular cached answers within this percentage of the end of their TTL (default off)\n");
+	printf("  -snapshot <file>   map the cache saved in file at startup and save the cache to it (default none)\n");
+	printf("  -format <human|jsonl|tsv|binary> how batch and sweep lookups are written: the readable report, JSON Lines,\n");
+	printf("                     one tab separated line per record or length-prefixed binary records (default human)\n");
+	printf("  -out <file|->      file lookups are written to in the jsonl, tsv and binary formats, the report then goes to\n");
+	printf("                     stderr when it is stdout (default -)\n");
+	printf("  -rate <qps>        lookups started per second in batch and sweep mode, split between threads (default no limit)\n");
+	printf("  -metrics <file|->  write counters and latency histograms in the Prometheus text format to file, or to\n");
+	printf("                     stdout, when done (not with -bench) (default none)\n");
+	printf("  -metricsinterval <ms|off> also rewrite the metrics file this often while running (default %d)\n", METRICS_INTERVAL_MS);
+	printf("  -trace <file>      save the phases of the last %d lookups of every thread to file when done (not with\n", TRACE_RECORDS);
+	printf("                     -bench), read it back with -readtrace (default none)\n");
+	printf("  -fake <key=value,...> responses of the local server benchmarks run against: answers=<n> (at most %d),\n", FAKE_MAX_ANSWERS);
+	printf("                     size=<bytes>, compress=<off|on|chain>, loss=<pct>, truncate=<pct>, delay=<ms>, jitter=<ms>\n");
+}
+
+// libFuzzer brings its own main to fuzzing builds, see ParserFuzz.cpp
+#ifndef DNS_FUZZER
 int main(int argc, char** argv)
 {
 	// debug flag to check for memory leaks
 	_CrtSetDbgFlag(_CRTDBG_ALLOC_MEM_DF | _CRTDBG_LEAK_CHECK_DF); 
 	
-	DWORD host_ip = NULL, server_ip = NULL;
-	DNSResolver resolver;
+	char* batch_path = NULL;
+	char* sweep_blocks = NULL;
+	int bench_lookups = 0;
+	int parse_iterations = 0;
+	char* corpus = NULL;
+	char* write_corpus = NULL;
+	char* fake_settings = NULL;
+	int serve_port = 0;
+	int window = DEFAULT_WINDOW;
+	int threads = 1;
+	IOBackend backend = IO_POLL;
+	bool cache = true, race = false;
+	double hedge = 0;
+	int prefetch = 0;
+	int cache_mb = DEFAULT_CACHE_MB;
+	char* snapshot = NULL;
+	double rate = 0;
+	int edns = DEFAULT_EDNS_SIZE;
+	char* metrics = NULL;
+	int metrics_interval = METRICS_INTERVAL_MS;
+	char* trace = NULL;
+	char* read_trace = NULL;
+	char* format_name = NULL;
+	char* out_path = NULL;
+
+	// options come before the positional arguments and all take one value
+	int arg = 1;
+	while (arg < argc && argv[arg][0] == '-' && argv[arg][1] != 0)
+	{
+		if (arg + 1 >= argc)
+		{
+			printf("option %s requires a value", argv[arg]);
+			PrintUsage();
+			return(EXIT_FAILURE);
+		}
+
+		if (strcmp(argv[arg], "-batch") == 0)
+			batch_path = argv[arg + 1];
+		else if (strcmp(argv[arg], "-sweep") == 0)
+			sweep_blocks = argv[arg + 1];
+		else if (strcmp(argv[arg], "-bench") == 0 && atoi(argv[arg + 1]) > 0)
+			bench_lookups = atoi(argv[arg + 1]);
+		else if (strcmp(argv[arg], "-parsebench") == 0 && atoi(argv[arg + 1]) > 0)
+			parse_iterations = atoi(argv[arg + 1]);
+		else if (strcmp(argv[arg], "-corpus") == 0)
+			corpus = argv[arg + 1];
+		else if (strcmp(argv[arg], "-writecorpus") == 0)
+			write_corpus = argv[arg + 1];
+		else if (strcmp(argv[arg], "-fake") == 0)
+			fake_settings = argv[arg + 1];
+		else if (strcmp(argv[arg], "-serve") == 0 && atoi(argv[arg + 1]) > 0 && atoi(argv[arg + 1]) < 65536)
+			serve_port = atoi(argv[arg + 1]);
+		else if (strcmp(argv[arg], "-window") == 0)
+			window = atoi(argv[arg + 1]);
+		else if (strcmp(argv[arg], "-threads") == 0)
+			threads = atoi(argv[arg + 1]);
+		else if (strcmp(argv[arg], "-io") == 0 && strcmp(argv[arg + 1], "poll") == 0)
+			backend = IO_POLL;
+		else if (strcmp(argv[arg], "-io") == 0 && strcmp(argv[arg + 1], "iocp") == 0)
+			backend = IO_IOCP;
+		else if (strcmp(argv[arg], "-io") == 0 && strcmp(argv[arg + 1], "rio") == 0)
+			backend = IO_RIO;
+		else if (strcmp(argv[arg], "-cache") == 0 && (strcmp(argv[arg + 1], "on") == 0 || strcmp(argv[arg + 1], "off") == 0))
+			cache = (strcmp(argv[arg + 1], "on") == 0);
+		else if (strcmp(argv[arg], "-cachemem") == 0 && atoi(argv[arg + 1]) > 0)
+			cache_mb = atoi(argv[arg + 1]);
+		else if (strcmp(argv[arg], "-race") == 0 && (strcmp(argv[arg + 1], "on") == 0 || strcmp(argv[arg + 1], "off") == 0))
+			race = (strcmp(argv[arg + 1], "on") == 0);
+		else if (strcmp(argv[arg], "-edns") == 0 && strcmp(argv[arg + 1], "off") == 0)
+			edns = 0;
+		else if (strcmp(argv[arg], "-edns") == 0 && atoi(argv[arg + 1]) >= MAX_DNS_SIZE && atoi(argv[arg + 1]) <= MAX_UDP_SIZE)
+			edns = atoi(argv[arg + 1]);
+		else if (strcmp(argv[arg], "-hedge") == 0 && strcmp(argv[arg + 1], "off") == 0)
+			hedge = 0;
+		else if (strcmp(argv[arg], "-hedge") == 0 && atof(argv[arg + 1]) > 0 && atof(argv[arg + 1]) < 100)
+			hedge = atof(argv[arg + 1]);
+		else if (strcmp(argv[arg], "-prefetch") == 0 && strcmp(argv[arg + 1], "off") == 0)
+			prefetch = 0;
+		else if (strcmp(argv[arg], "-prefetch") == 0 && atoi(argv[arg + 1]) > 0 && atoi(argv[arg + 1]) < 100)
+			prefetch = atoi(argv[arg + 1]);
+		else if (strcmp(argv[arg], "-snapshot") == 0)
+			snapshot = argv[arg + 1];
+		else if (strcmp(argv[arg], "-rate") == 0 && atof(argv[arg + 1]) > 0)
+			rate = atof(argv[arg + 1]);
+		else if (strcmp(argv[arg], "-metrics") == 0)
+			metrics = argv[arg + 1];
+		else if (strcmp(argv[arg], "-format") == 0)
+			format_name = argv[arg + 1];
+		else if (strcmp(argv[arg], "-out") == 0)
+			out_path = argv[arg + 1];
+		else if (strcmp(argv[arg], "-trace") == 0)
+			trace = argv[arg + 1];
+		else if (strcmp(argv[arg], "-readtrace") == 0)
+			read_trace = argv[arg + 1];
+		else if (strcmp(argv[arg], "-metricsinterval") == 0 && strcmp(argv[arg + 1], "off") == 0)
+			metrics_interval = 0;
+		else if (strcmp(argv[arg], "-metricsinterval") == 0 && atoi(argv[arg + 1]) > 0)
+			metrics_interval = atoi(argv[arg + 1]);
+		else
+		{
+			printf("unknown option %s %s", argv[arg], argv[arg + 1]);
+			PrintUsage();
+			return(EXIT_FAILURE);
+		}
+		arg += 2;
+	}
 
 	// make sure command line arguments are valid
-	if (argc != 3)
+	bool batch = (batch_path != NULL || sweep_blocks != NULL);
+	int positional = (bench_lookups > 0 || parse_iterations > 0 || write_corpus != NULL || read_trace != NULL) ? 0
+		: (batch || serve_port != 0) ? 1 : 2;
+	if (argc - arg != positional)
 	{
-		(argc < 3) ? printf("too few arguments") : printf("too many arguments");
-		printf("\nusage: Driver.exe <Hostname or IP> <DNS Server IP>\n");
+		(argc - arg < positional) ? printf("too few arguments") : printf("too many arguments");
+		PrintUsage();
 		return(EXIT_FAILURE);
 	}
+	// the parser benchmark, the fuzzer corpus and reading a trace need no network
+	if (read_trace != NULL)
+		return (QueryTracer::Report(read_trace) == 0) ? 0 : EXIT_FAILURE;
+	if (write_corpus != NULL)
+	{
+		int written = ParserBench::WriteCorpus(write_corpus);
+		if (written < 0)
+		{
+			printf("error: unable to write the corpus to %s\n", write_corpus);
+			return(EXIT_FAILURE);
+		}
+		printf("Corpus  : %d messages written to %s\n", written, write_corpus);
+		return 0;
+	}
+	if (parse_iterations > 0)
+		return ParserBench::Run(corpus, parse_iterations);
 
-	server_ip = inet_addr(argv[2]);
-	if (server_ip == INADDR_NONE)
+	FakeConfig fake;
+	if (fake_settings != NULL && fake.Parse(fake_settings) != 0)
+	{
+		printf("error: '%s' is not a valid list of fake server settings\n", fake_settings);
+		return(EXIT_FAILURE);
+	}
+	OutputFormat format = OUTPUT_HUMAN;
+	if (format_name != NULL && !OutputWriter::ParseFormat(format_name, format))
+	{
+		printf("error: '%s' is not an output format (human, jsonl, tsv or binary)\n", format_name);
+		return(EXIT_FAILURE);
+	}
+	if ((format != OUTPUT_HUMAN || out_path != NULL) && !batch)
 	{
-		printf("error: address of local DNS server is not a valid IP address\n");
+		printf("error: output formats only apply to batch and sweep mode\n");
+		return(EXIT_FAILURE);
+	}
+	if (out_path != NULL && format == OUTPUT_HUMAN)
+	{
+		printf("error: -out needs a machine-readable -format\n");
+		return(EXIT_FAILURE);
+	}
+	if (window < 1 || window > MAX_WINDOW)
+	{
+		printf("error: in-flight window must be between 1 and %d\n", MAX_WINDOW);
 		return(EXIT_FAILURE);
 	}
 
-	host_ip = inet_addr(argv[1]);
-	int result = 0;
-	// host is not a valid IP, do a forward DNS lookup
-	if (host_ip == INADDR_NONE)
-		result = resolver.ResolveDNS(DNS_A, argv[1], server_ip);
-	// host is a valid IP, do reverse lookup
-	else
-		result = resolver.ResolveDNS(DNS_PTR, argv[1], server_ip);
-	
-	return result;
+	if (threads < 1 || threads > MAX_THREADS)
+	{
+		printf("error: number of threads must be between 1 and %d\n", MAX_THREADS);
+		return(EXIT_FAILURE);
+	}
+
+	// lookups in a machine-readable format go to their own stream, opened before any resolver
+	// prints its settings in case that moves the report to stderr
+	FILE* output = NULL;
+	if (format != OUTPUT_HUMAN && (output = OpenOutput((out_path != NULL) ? out_path : "-", format)) == NULL)
+	{
+		printf("error: unable to open output file '%s'\n", (out_path != NULL) ? out_path : "-");
+		return(EXIT_FAILURE);
+	}
+	std::unique_ptr<FILE, int(*)(FILE*)> output_closer(output, [](FILE* file) { return (file != NULL) ? fclose(file) : 0; });
+
+	// benchmarks query a fake server on this machine instead of the servers given
+	FakeServer fake_server;
+	std::string servers = (positional > 0) ? argv[argc - 1] : "";
+	if (bench_lookups > 0)
+	{
+		if (fake_server.Start(fake) != 0)
+			return(EXIT_FAILURE);
+		servers = fake_server.Address();
+	}
+
+	// every resolver (one per worker thread in sharded batch mode) is configured alike
+	auto configure = [&](DNSResolver& resolver)
+	{
+		if (resolver.AddServers(servers.c_str()) <= 0)
+			return false;
+		resolver.SetCacheEnabled(cache);
+		resolver.SetCacheBudget(((size_t) cache_mb << 20) / (batch ? threads : 1));
+		resolver.SetRate(rate / (batch ? threads : 1));
+		resolver.SetRace(race);
+		resolver.SetHedge(hedge);
+		resolver.SetPrefetch(prefetch);
+		if (snapshot != NULL && cache)
+			resolver.SetSnapshot(snapshot);
+		resolver.SetEDNS(edns);
+		if (batch)
+			resolver.SetOutput(format, output);
+		return true;
+	};
+
+	if (bench_lookups > 0)
+	{
+		Benchmark benchmark(fake_server, backend, configure);
+		return benchmark.Run(bench_lookups, window, (threads > 1) ? threads : BENCH_THREADS);
+	}
+
+	if (batch && threads > 1)
+	{
+		ShardedResolver sharded(threads, backend);
+		for (int i = 0; i < sharded.Size(); i++)
+		{
+			if (!configure(sharded.At(i)))
+			{
+				printf("error: address of local DNS server is not a valid IP address (at most %d servers)\n", MAX_UPSTREAMS);
+				return(EXIT_FAILURE);
+			}
+		}
+		std::vector<DNSResolver*> workers;
+		for (int i = 0; i < sharded.Size(); i++)
+			workers.push_back(&sharded.At(i));
+		return RunInstrumented(workers, metrics, metrics_interval, trace, [&]()
+		{
+			if (sweep_blocks != NULL)
+				return RunSweep(NULL, &sharded, sweep_blocks, window);
+			return RunShardedBatch(sharded, batch_path, window);
+		});
+	}
+
+	DNSResolver resolver(backend);
+	if (!configure(resolver))
+	{
+		printf("error: address of local DNS server is not a valid IP address (at most %d servers)\n", MAX_UPSTREAMS);
+		return(EXIT_FAILURE);
+	}
+	return RunInstrumented(std::vector<DNSResolver*>(1, &resolver), metrics, metrics_interval, trace, [&]()
+	{
+		if (serve_port != 0)
+		{
+			if (resolver.SetWindow(window) != 0)
+				return(EXIT_FAILURE);
+			return resolver.Serve((USHORT) serve_port);
+		}
+		if (sweep_blocks != NULL)
+			return RunSweep(&resolver, NULL, sweep_blocks, window);
+		if (batch_path != NULL)
+			return RunBatch(resolver, batch_path, window);
+
+		// forward lookup for a hostname, reverse lookup for an IPv4 or IPv6 address
+		return resolver.ResolveDNS(DNSResolver::LookupType(argv[arg]), argv[arg]);
+	});
 }
+#endif
@@ -0,0 +1,394 @@
+// FakeServer.cpp
+// CSCE 463-500
+
+#include "pch.h"
+
+// Parses a comma separated list of settings, e.g. "answers=4,compress=chain,loss=1,delay=2".
+// Returns -1 if a setting is unknown or out of range or 0 for success.
+int FakeConfig::Parse(const char* list)
+{
+	std::string remaining(list);
+	size_t start = 0;
+	while (start < remaining.size())
+	{
+		size_t end = remaining.find(',', start);
+		if (end == std::string::npos)
+			end = remaining.size();
+		std::string setting = remaining.substr(start, end - start);
+		start = end + 1;
+
+		size_t equals = setting.find('=');
+		if (equals == std::string::npos)
+			return -1;
+		std::string key = setting.substr(0, equals);
+		const char* value = setting.c_str() + equals + 1;
+
+		if (key == "answers" && atoi(value) >= 0 && atoi(value) <= FAKE_MAX_ANSWERS)
+			answers = atoi(value);
+		else if (key == "size" && atoi(value) >= 0 && atoi(value) <= MAX_UDP_SIZE)
+			size = atoi(value);
+		else if (key == "compress" && strcmp(value, "off") == 0)
+			compression = FAKE_COMPRESS_OFF;
+		else if (key == "compress" && strcmp(value, "on") == 0)
+			compression = FAKE_COMPRESS_ON;
+		else if (key == "compress" && strcmp(value, "chain") == 0)
+			compression = FAKE_COMPRESS_CHAIN;
+		else if (key == "loss" && atof(value) >= 0 && atof(value) <= 100)
+			loss = atof(value);
+		else if (key == "truncate" && atof(value) >= 0 && atof(value) <= 100)
+			truncate = atof(value);
+		else if (key == "delay" && atoi(value) >= 0)
+			delay_ms = atoi(value);
+		else if (key == "jitter" && atoi(value) >= 0)
+			jitter_ms = atoi(value);
+		else
+			return -1;
+	}
+	return 0;
+}
+
+// Initializes WinSock for the server thread
+FakeServer::FakeServer() : stopping(false), random(FAKE_SEED)
+{
+	WSADATA wsa_data;
+	WSAStartup(MAKEWORD(2, 2), &wsa_data);
+	buffer.resize(2 + MAX_TCP_SIZE);
+}
+
+// Stops the server if it is running and cleans up WinSock
+FakeServer::~FakeServer()
+{
+	Stop();
+	engine.Close();
+	WSACleanup();
+}
+
+// Binds the UDP and TCP sockets on an ephemeral port and starts answering on the server
+// thread. Prints a message and returns -1 in case of failure or 0 for success.
+int FakeServer::Start(FakeConfig& settings)
+{
+	config = settings;
+	if (engine.Open(IO_POLL) != 0)
+		return -1;
+
+	struct sockaddr_in local;
+	int local_size = sizeof(local);
+	if (getsockname(engine.Socket(), (struct sockaddr*) &local, &local_size) == SOCKET_ERROR)
+	{
+		printf("  ++ program error: getsockname() generated error %d\n", WSAGetLastError());
+		return -1;
+	}
+	port = ntohs(local.sin_port);
+
+	// truncated answers are retried over TCP to the same address and port
+	listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	u_long non_blocking = 1;
+	if (listen_sock == INVALID_SOCKET || bind(listen_sock, (struct sockaddr*) &local, sizeof(local)) == SOCKET_ERROR
+		|| listen(listen_sock, SOMAXCONN) == SOCKET_ERROR || ioctlsocket(listen_sock, FIONBIO, &non_blocking) == SOCKET_ERROR)
+	{
+		printf("  ++ program error: unable to listen on TCP port %d, error %d\n", port, WSAGetLastError());
+		return -1;
+	}
+
+	engine.SetDatagramHandler([this](char* buf, int size, struct sockaddr_in& from) { OnDatagram(buf, size, from); });
+	engine.Watch(listen_sock, POLLRDNORM, [this](short revents) { OnAccept(); });
+	stopping = false;
+	thread = std::thread([this]() { engine.Run([this]() { return stopping.load(); }); });
+	return 0;
+}
+
+// Stops the server thread and closes every socket
+void FakeServer::Stop()
+{
+	if (thread.joinable())
+	{
+		stopping = true;
+		thread.join();
+	}
+
+	while (!connections.empty())
+		CloseConnection(connections.begin()->first);
+	if (listen_sock != INVALID_SOCKET)
+	{
+		engine.Unwatch(listen_sock);
+		closesocket(listen_sock);
+		listen_sock = INVALID_SOCKET;
+	}
+}
+
+// Returns the address of the server as given in a server list ("127.0.0.1:port")
+std::string FakeServer::Address()
+{
+	return "127.0.0.1:" + std::to_string(port);
+}
+
+// Returns the CPU time in microseconds the server thread has taken so far
+double FakeServer::CPUTime()
+{
+	FILETIME created, exited, kernel, user;
+	if (!thread.joinable() || !GetThreadTimes((HANDLE) thread.native_handle(), &created, &exited, &kernel, &user))
+		return 0;
+
+	// FILETIME counts 100 ns intervals
+	ULONGLONG ticks = ((ULONGLONG) kernel.dwHighDateTime << 32 | kernel.dwLowDateTime)
+		+ ((ULONGLONG) user.dwHighDateTime << 32 | user.dwLowDateTime);
+	return ticks / 10.0;
+}
+
+// Prints the settings of the server and what became of the queries it received
+void FakeServer::PrintStats()
+{
+	static const char* compression_names[] = { "off", "on", "chain" };
+	printf("Fake    : %s, %d answers, padded to %d bytes, compression %s, loss %g%%, truncate %g%%, delay %d ms + %d ms jitter\n",
+		Address().c_str(), config.answers, config.size, compression_names[config.compression], config.loss, config.truncate,
+		config.delay_ms, config.jitter_ms);
+	printf("Fake    : %llu queries, %llu dropped, %llu truncated, %llu over TCP\n", queries, dropped, truncated, tcp_queries);
+}
+
+// Returns true with the given percentage of probability
+bool FakeServer::Chance(double percent)
+{
+	return percent > 0 && std::uniform_real_distribution<double>(0, 100)(random) < percent;
+}
+
+// Writes the response to a query into reply (MAX_TCP_SIZE bytes), truncated to the payload
+// size the query allows over UDP unless it came over TCP. Returns the size of the response
+// or -1 if the query is not a standard query for a single question.
+int FakeServer::Respond(const char* query, int size, bool tcp, char* reply)
+{
+	DNSMessage message(query, size);
+	DNSRecord question;
+	if (size < (int) sizeof(DNSHeader) || message.Header()->QR != 0 || message.Header()->opcode != 0
+		|| message.Count(SECTION_QUESTION) != 1 || !message.Next(question))
+		return -1;
+
+	EDNSInfo edns;
+	bool has_edns = (DNSMessage::FindEDNS(query, size, edns) == 1);
+	int limit = tcp ? MAX_TCP_SIZE : has_edns ? std::max((int) edns.payload_size, MAX_DNS_SIZE) : MAX_DNS_SIZE;
+	int question_end = question.fixed_offset + (int) sizeof(QueryHeader);
+	int name_size = question.fixed_offset - (int) sizeof(DNSHeader);
+
+	// the header and question are echoed, the answers are written after them
+	memcpy(reply, query, question_end);
+	DNSHeader* header = (DNSHeader*) reply;
+	header->QR = 1;
+	header->AA = 1;
+	header->RA = 1;
+	header->TC = 0;
+	header->result = DNS_OK;
+	header->answers = header->authority = header->additional = 0;
+	int position = question_end;
+
+	// A and AAAA questions get addresses, questions for names get names, any other type no records
+	USHORT type = question.type;
+	bool address = (type == DNS_A || type == DNS_AAAA);
+	bool named = (type == DNS_PTR || type == DNS_CNAME || type == DNS_NS);
+	int answers = (address || named) ? config.answers : 0;
+
+	// owners and targets are written as the compression mode asks, 'previous' is where the
+	// name the next owner refers to starts and 'suffix' where a full "bench.test" was written
+	int previous = sizeof(DNSHeader), suffix = -1;
+	auto write_name = [&](int target)
+	{
+		if (config.compression == FAKE_COMPRESS_OFF && target == (int) sizeof(DNSHeader))
+		{
+			memcpy(reply + position, query + sizeof(DNSHeader), name_size);
+			position += name_size;
+		}
+		else
+		{
+			reply[position++] = (char) (0xC0 | (target >> 8));
+			reply[position++] = (char) (target & 0xFF);
+		}
+	};
+	auto write_record = [&](USHORT record_type, USHORT length)
+	{
+		ResourceRecord* record = (ResourceRecord*) (reply + position);
+		record->rType = htons(record_type);
+		record->rClass = htons(DNS_INET);
+		record->rTTL = htonl(FAKE_TTL);
+		record->rLength = htons(length);
+		position += sizeof(ResourceRecord);
+	};
+
+	for (int i = 0; i < answers; i++)
+	{
+		int owner = (config.compression == FAKE_COMPRESS_CHAIN) ? previous : (int) sizeof(DNSHeader);
+		if (config.compression == FAKE_COMPRESS_CHAIN && i < answers - 1)
+		{
+			// c.<previous name>: every link adds a level of pointers to follow
+			write_name(owner);
+			write_record(DNS_CNAME, 4);
+			previous = position;
+			reply[position++] = 1;
+			reply[position++] = 'c';
+			write_name(owner);
+			continue;
+		}
+
+		write_name(owner);
+		if (address)
+		{
+			int length = (type == DNS_A) ? 4 : 16;
+			write_record(type, (USHORT) length);
+			memset(reply + position, 0, length);
+			reply[position] = 10;
+			reply[position + length - 2] = (char) (i >> 8);
+			reply[position + length - 1] = (char) (i & 0xFF);
+			position += length;
+			continue;
+		}
+
+		// h<i>.bench.test, the suffix is written once and pointed to unless compression is off
+		char label[8];
+		int label_size = sprintf_s(label, sizeof(label), "h%d", i);
+		bool full = (suffix < 0 || config.compression == FAKE_COMPRESS_OFF);
+		write_record(type, (USHORT) (1 + label_size + (full ? 12 : 2)));
+		reply[position++] = (char) label_size;
+		memcpy(reply + position, label, label_size);
+		position += label_size;
+		if (full)
+		{
+			suffix = position;
+			memcpy(reply + position, "\5bench\4test", 12);
+			position += 12;
+		}
+		else
+			write_name(suffix);
+	}
+	header->answers = htons((USHORT) answers);
+
+	// padding to the configured size in one TXT record of character strings of at most 255 bytes,
+	// owned by the question name, which is only written out in full with compression off
+	int opt_size = has_edns ? 11 : 0;
+	int owner_size = (config.compression == FAKE_COMPRESS_OFF) ? name_size : 2;
+	int padding = config.size - position - opt_size - (int) sizeof(ResourceRecord) - owner_size;
+	if (padding > 0)
+	{
+		write_name(sizeof(DNSHeader));
+		write_record(DNS_TXT, (USHORT) padding);
+		while (padding > 0)
+		{
+			int chunk = std::min(padding - 1, 255);
+			reply[position++] = (char) chunk;
+			memset(reply + position, 'x', chunk);
+			position += chunk;
+			padding -= chunk + 1;
+		}
+		header->additional = htons(1);
+	}
+
+	// an answer larger than the client accepts is replaced by an empty truncated one
+	if (position + opt_size > limit || (!tcp && Chance(config.truncate)))
+	{
+		position = question_end;
+		header->TC = 1;
+		header->answers = header->additional = 0;
+		truncated++;
+	}
+
+	if (has_edns)
+	{
+		memset(reply + position, 0, opt_size);
+		reply[position + 2] = (char) (DNS_OPT & 0xFF);
+		reply[position + 3] = (char) (MAX_UDP_SIZE >> 8);
+		reply[position + 4] = (char) (MAX_UDP_SIZE & 0xFF);
+		position += opt_size;
+		header->additional = htons(ntohs(header->additional) + 1);
+	}
+	return position;
+}
+
+// Datagram handler of the engine, answers (or drops) a query
+void FakeServer::OnDatagram(char* buf, int size, struct sockaddr_in& from)
+{
+	queries++;
+	if (Chance(config.loss))
+	{
+		dropped++;
+		return;
+	}
+
+	int reply_size = Respond(buf, size, false, buffer.data());
+	if (reply_size < 0)
+		return;
+
+	int delay = config.delay_ms;
+	if (config.jitter_ms > 0)
+		delay += std::uniform_int_distribution<int>(0, config.jitter_ms)(random);
+	if (delay == 0)
+	{
+		engine.SendTo(buffer.data(), reply_size, from);
+		return;
+	}
+
+	std::string reply(buffer.data(), reply_size);
+	struct sockaddr_in to = from;
+	engine.AddTimer(delay, [this, reply, to]() mutable { engine.SendTo(reply.data(), (int) reply.size(), to); });
+}
+
+// Readiness handler of the listening socket, accepts a connection
+void FakeServer::OnAccept()
+{
+	SOCKET sock;
+	while ((sock = accept(listen_sock, NULL, NULL)) != INVALID_SOCKET)
+	{
+		u_long non_blocking = 1;
+		ioctlsocket(sock, FIONBIO, &non_blocking);
+		connections[sock] = std::string();
+		engine.Watch(sock, POLLRDNORM, [this, sock](short revents) { OnConnection(sock, revents); });
+	}
+}
+
+// Readiness handler of a connection, answers every complete length-prefixed query on it
+void FakeServer::OnConnection(SOCKET sock, short revents)
+{
+	std::string& received = connections[sock];
+	char chunk[MAX_UDP_SIZE];
+	while (true)
+	{
+		int size = recv(sock, chunk, sizeof(chunk), 0);
+		if (size > 0)
+		{
+			received.append(chunk, size);
+			continue;
+		}
+		if (size == 0 || WSAGetLastError() != WSAEWOULDBLOCK)
+		{
+			CloseConnection(sock);
+			return;
+		}
+		break;
+	}
+
+	while (received.size() >= 2)
+	{
+		int length = (UCHAR) received[0] << 8 | (UCHAR) received[1];
+		if ((int) received.size() < 2 + length)
+			break;
+
+		tcp_queries++;
+		int reply_size = Respond(received.data() + 2, length, true, buffer.data() + 2);
+		received.erase(0, 2 + length);
+		if (reply_size < 0)
+			continue;
+
+		// replies are small next to the socket buffer, a client that lets it fill up is dropped
+		buffer[0] = (char) (reply_size >> 8);
+		buffer[1] = (char) (reply_size & 0xFF);
+		if (send(sock, buffer.data(), 2 + reply_size, 0) != 2 + reply_size)
+		{
+			CloseConnection(sock);
+			return;
+		}
+	}
+}
+
+// Stops watching and closes a connection
+void FakeServer::CloseConnection(SOCKET sock)
+{
+	engine.Unwatch(sock);
+	closesocket(sock);
+	connections.erase(sock);
+}
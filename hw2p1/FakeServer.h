@@ -0,0 +1,106 @@
+#pragma once
+
+// How the names of the canned answers are written
+enum FakeCompression
+{
+	FAKE_COMPRESS_OFF,		// every name written out in full
+	FAKE_COMPRESS_ON,		// owner names point back to the question
+	FAKE_COMPRESS_CHAIN		// a CNAME chain, each target a label followed by a pointer to the previous name
+};
+
+// Shape of the responses of a fake server and the faults it injects
+struct FakeConfig
+{
+	// Records in the answer section, and the size the response is padded to with a TXT record
+	// in the additional section (0 for no padding)
+	int answers = 1;
+	int size = 0;
+	FakeCompression compression = FAKE_COMPRESS_ON;
+
+	// Percentage of queries dropped unanswered, and of UDP queries answered with an empty
+	// truncated response so that the client retries over TCP
+	double loss = 0;
+	double truncate = 0;
+
+	// Time UDP replies are held back, the jitter is added uniformly at random on top of the delay
+	int delay_ms = 0;
+	int jitter_ms = 0;
+
+	// Parses a comma separated list of settings, e.g. "answers=4,compress=chain,loss=1,delay=2".
+	// Returns -1 if a setting is unknown or out of range or 0 for success.
+	int Parse(const char* list);
+};
+
+/*
+ * The FakeServer class is a stand-in authoritative server for benchmarks: it answers every
+ * query on the loopback interface with a canned response of the configured shape, on a thread
+ * of its own driven by an I/O engine, so runs are reproducible and need no network. Queries
+ * are answered over UDP on an ephemeral port, and over TCP on the same port for truncated
+ * answers. Loss, delay and truncation are injected at random with a fixed seed.
+ */
+class FakeServer
+{
+	FakeConfig config;
+	IOEngine engine;
+	SOCKET listen_sock = INVALID_SOCKET;
+	USHORT port = 0;
+	std::thread thread;
+	std::atomic<bool> stopping;
+	std::mt19937 random;
+
+	// Response being written, preceded by room for the length prefix of TCP
+	std::vector<char> buffer;
+
+	// Bytes received so far on every accepted TCP connection
+	std::unordered_map<SOCKET, std::string> connections;
+
+	ULONGLONG queries = 0, dropped = 0, truncated = 0, tcp_queries = 0;
+
+	// Datagram handler of the engine, answers (or drops) a query
+	void OnDatagram(char* buf, int size, struct sockaddr_in& from);
+
+	// Readiness handler of the listening socket, accepts a connection
+	void OnAccept();
+
+	// Readiness handler of a connection, answers every complete length-prefixed query on it
+	void OnConnection(SOCKET sock, short revents);
+
+	// Stops watching and closes a connection
+	void CloseConnection(SOCKET sock);
+
+	// Returns true with the given percentage of probability
+	bool Chance(double percent);
+
+public:
+
+	// Initializes WinSock for the server thread
+	FakeServer();
+
+	// Stops the server if it is running and cleans up WinSock
+	~FakeServer();
+
+	// Binds the UDP and TCP sockets on an ephemeral port and starts answering on the server
+	// thread. Prints a message and returns -1 in case of failure or 0 for success.
+	int Start(FakeConfig& settings);
+
+	// Stops the server thread and closes every socket
+	void Stop();
+
+	// Returns the address of the server as given in a server list ("127.0.0.1:port")
+	std::string Address();
+
+	// Returns the CPU time in microseconds the server thread has taken so far
+	double CPUTime();
+
+	// Prints the settings of the server and what became of the queries it received
+	void PrintStats();
+
+	// Writes the response to a query into reply (MAX_TCP_SIZE bytes), truncated to the payload
+	// size the query allows over UDP unless it came over TCP. Returns the size of the response
+	// or -1 if the query is not a standard query for a single question. Also used without 
+	// starting the server to make responses of a given shape, e.g. for the parser benchmark.
+	int Respond(const char* query, int size, bool tcp, char* reply);
+
+	// Changes the shape of the responses, only while the server is not running
+	void Configure(FakeConfig& settings) { config = settings; }
+};
@@ -0,0 +1,794 @@
+// IOEngine.cpp
+// CSCE 463-500
+
+#include "pch.h"
+
+TimerWheel::TimerWheel()
+{
+	heads.assign(WHEEL_SLOTS, -1);
+	occupied.assign(WHEEL_SLOTS / 64, 0);
+	origin = std::chrono::steady_clock::now();
+}
+
+// Returns the number of milliseconds since the wheel was created
+long long TimerWheel::Now()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - origin).count();
+}
+
+// Links a node into the list of a slot
+void TimerWheel::Link(int index, int slot)
+{
+	TimerNode& node = nodes[index];
+	node.slot = slot;
+	node.prev = -1;
+	node.next = heads[slot];
+	if (node.next != -1)
+		nodes[node.next].prev = index;
+	heads[slot] = index;
+	occupied[slot / 64] |= 1ULL << (slot % 64);
+}
+
+// Unlinks a node from the list of its slot
+void TimerWheel::Unlink(int index)
+{
+	TimerNode& node = nodes[index];
+	if (node.prev != -1)
+		nodes[node.prev].next = node.next;
+	else
+		heads[node.slot] = node.next;
+	if (node.next != -1)
+		nodes[node.next].prev = node.prev;
+
+	if (heads[node.slot] == -1)
+		occupied[node.slot / 64] &= ~(1ULL << (node.slot % 64));
+	node.slot = -1;
+	node.prev = node.next = -1;
+}
+
+// Arms a timer that calls 'callback' once after 'delay_ms' milliseconds and returns its ID
+TimerId TimerWheel::Add(long long delay_ms, TimerCallback callback)
+{
+	int index;
+	if (free_nodes.empty())
+	{
+		index = (int) nodes.size();
+		nodes.emplace_back();
+	}
+	else
+	{
+		index = free_nodes.back();
+		free_nodes.pop_back();
+	}
+
+	// ticks up to current_tick have already been processed, so the earliest a timer can fire is the next one
+	long long target = Now() + ((delay_ms > 0) ? delay_ms : 0);
+	if (target <= current_tick)
+		target = current_tick + 1;
+
+	TimerNode& node = nodes[index];
+	node.armed = true;
+	node.rounds = (int) ((target - current_tick - 1) / WHEEL_SLOTS);
+	node.callback = callback;
+	Link(index, (int) (target % WHEEL_SLOTS));
+	armed_count++;
+
+	return ((TimerId) node.generation << 32) | (TimerId) (index + 1);
+}
+
+// Disarms a timer, IDs of timers that have already expired or been cancelled are ignored
+void TimerWheel::Cancel(TimerId id)
+{
+	long long index = (long long) (id & 0xFFFFFFFF) - 1;
+	if (index < 0 || index >= (long long) nodes.size())
+		return;
+
+	TimerNode& node = nodes[index];
+	if (!node.armed || node.generation != (UINT) (id >> 32))
+		return;
+
+	// timers that are due but not fired yet have already been unlinked
+	if (node.slot != -1)
+		Unlink((int) index);
+	node.armed = false;
+	node.generation++;
+	node.callback = nullptr;
+	free_nodes.push_back((int) index);
+	armed_count--;
+}
+
+// Calls the callbacks of all timers that are due. Returns the number of timers fired.
+int TimerWheel::Advance()
+{
+	long long now = Now();
+	int fired = 0;
+
+	while (current_tick < now)
+	{
+		// nothing can fire until a timer is armed again
+		if (armed_count == 0)
+		{
+			current_tick = now;
+			break;
+		}
+
+		current_tick++;
+		int slot = (int) (current_tick % WHEEL_SLOTS);
+		if (heads[slot] == -1)
+			continue;
+
+		// unlink everything due in this slot before firing, since callbacks may arm or cancel timers
+		due.clear();
+		for (int index = heads[slot]; index != -1; )
+		{
+			int next = nodes[index].next;
+			if (nodes[index].rounds > 0)
+				nodes[index].rounds--;
+			else
+			{
+				Unlink(index);
+				due.push_back(std::make_pair(index, nodes[index].generation));
+			}
+			index = next;
+		}
+
+		for (size_t i = 0; i < due.size(); i++)
+		{
+			// skip timers cancelled (and possibly re-armed) by an earlier callback
+			TimerNode& node = nodes[due[i].first];
+			if (!node.armed || node.generation != due[i].second)
+				continue;
+
+			TimerCallback callback = std::move(node.callback);
+			node.armed = false;
+			node.generation++;
+			node.callback = nullptr;
+			free_nodes.push_back(due[i].first);
+			armed_count--;
+
+			callback();
+			fired++;
+		}
+	}
+	return fired;
+}
+
+// Returns the number of milliseconds until the next timer is due (0 if one is already due),
+// or -1 if no timer is armed
+long long TimerWheel::NextExpiry()
+{
+	if (armed_count == 0)
+		return -1;
+
+	// find the first occupied slot after the current tick, skipping empty words of the bitmap
+	long long start = current_tick + 1;
+	long long tick = start;
+	while (tick < start + WHEEL_SLOTS)
+	{
+		int slot = (int) (tick % WHEEL_SLOTS);
+		unsigned long long word = occupied[slot / 64] >> (slot % 64);
+		if (word == 0)
+		{
+			tick += 64 - (slot % 64);
+			continue;
+		}
+		while ((word & 1) == 0)
+		{
+			word >>= 1;
+			tick++;
+		}
+		break;
+	}
+
+	// slots holding timers more than one turn away are only a lower bound, which is fine for waiting
+	if (tick > start + WHEEL_SLOTS)
+		tick = start + WHEEL_SLOTS;
+	long long wait = tick - Now();
+	return (wait > 0) ? wait : 0;
+}
+
+IOEngine::IOEngine()
+{
+}
+
+// Closes the socket and the completion port or Registered I/O queues
+IOEngine::~IOEngine()
+{
+	Close();
+}
+
+// Closes the socket and the completion port or Registered I/O queues. Must be called before 
+// WinSock is cleaned up.
+void IOEngine::Close()
+{
+	// the request queue goes away with the socket, the rest only once the socket is closed
+	if (sock != INVALID_SOCKET)
+		closesocket(sock);
+	if (port != NULL)
+		CloseHandle(port);
+	if (rio_receive_cq != RIO_INVALID_CQ)
+		rio.RIOCloseCompletionQueue(rio_receive_cq);
+	if (rio_send_cq != RIO_INVALID_CQ)
+		rio.RIOCloseCompletionQueue(rio_send_cq);
+	if (rio_buffer != RIO_INVALID_BUFFERID)
+		rio.RIODeregisterBuffer(rio_buffer);
+	if (rio_region != NULL)
+		VirtualFree(rio_region, 0, MEM_RELEASE);
+	if (rio_event != NULL)
+		CloseHandle(rio_event);
+	sock = INVALID_SOCKET;
+	port = NULL;
+	rio_receive_cq = rio_send_cq = RIO_INVALID_CQ;
+	rio_rq = RIO_INVALID_RQ;
+	rio_buffer = RIO_INVALID_BUFFERID;
+	rio_region = NULL;
+	rio_event = NULL;
+}
+
+// Opens and binds a UDP socket on an ephemeral port and prepares the given backend.
+// Prints a message and returns -1 in case of failure or 0 for success.
+int IOEngine::Open(IOBackend io_backend)
+{
+	backend = io_backend;
+	struct sockaddr_in local;
+	memset(&local, 0, sizeof(local));
+
+	// Open a UDP socket, receives on a completion port require an overlapped socket
+	if (backend == IO_IOCP)
+		sock = WSASocket(AF_INET, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, WSA_FLAG_OVERLAPPED);
+	else if (backend == IO_RIO)
+		sock = WSASocket(AF_INET, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, WSA_FLAG_REGISTERED_IO);
+	else
+		sock = socket(AF_INET, SOCK_DGRAM, NULL);
+	if (sock == INVALID_SOCKET)
+	{
+		printf("  ++ program error: socket() generated error %d\n", WSAGetLastError());
+		return -1;
+	}
+
+	// Bind socket to local machine
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = INADDR_ANY;
+	local.sin_port = htons(0);
+
+	if (bind(sock, (struct sockaddr*) &local, sizeof(local)) == SOCKET_ERROR)
+	{
+		printf("  ++ program error: bind() generated error %d\n", WSAGetLastError());
+		return -1;
+	}
+
+	// Neither sends nor receives may block the loop, and bursts of replies need room in the socket buffer
+	u_long non_blocking = 1;
+	if (ioctlsocket(sock, FIONBIO, &non_blocking) == SOCKET_ERROR)
+	{
+		printf("  ++ program error: ioctlsocket() generated error %d\n", WSAGetLastError());
+		return -1;
+	}
+	int buffer_size = SOCKET_BUFFER;
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char*) &buffer_size, sizeof(buffer_size));
+
+	if (backend == IO_POLL)
+		return 0;
+	if (backend == IO_RIO)
+		return OpenRIO();
+
+	port = CreateIoCompletionPort((HANDLE) sock, NULL, 0, 1);
+	if (port == NULL)
+	{
+		printf("  ++ program error: CreateIoCompletionPort() generated error %d\n", (int) GetLastError());
+		return -1;
+	}
+
+	// the contexts must not move once their receives have been posted
+	receives.resize(RECEIVE_DEPTH);
+	for (size_t i = 0; i < receives.size(); i++)
+	{
+		if (PostReceive(receives[i]) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+// Posts an overlapped receive to the completion port. Returns -1 on failure or 0 for success.
+int IOEngine::PostReceive(ReceiveContext& context)
+{
+	while (true)
+	{
+		memset(&context.overlapped, 0, sizeof(context.overlapped));
+		context.wsa_buf.buf = context.buf;
+		context.wsa_buf.len = MAX_UDP_SIZE;
+		context.flags = 0;
+		context.from_size = sizeof(context.from);
+
+		syscalls++;
+		Count(METRIC_RECEIVE_CALLS);
+		if (WSARecvFrom(sock, &context.wsa_buf, 1, NULL, &context.flags, (struct sockaddr*) &context.from,
+			&context.from_size, &context.overlapped, NULL) == 0)
+			return 0;
+
+		// an ICMP port unreachable from an earlier send is reported as a reset, post again
+		int error = WSAGetLastError();
+		if (error == WSA_IO_PENDING)
+			return 0;
+		if (error != WSAECONNRESET)
+		{
+			printf("receive encountered socket error %d\n", error);
+			return -1;
+		}
+	}
+}
+
+// Sends a datagram to the given address. A full socket buffer is not reported as an error,
+// the datagram is dropped and left to the retransmission timer of the caller.
+// Returns the number of bytes sent, 0 if the datagram was dropped or -1 on a socket error.
+int IOEngine::SendTo(const char* buf, int size, struct sockaddr_in& to)
+{
+	if (backend == IO_RIO)
+	{
+		// sends finish asynchronously, so wait briefly for a slot before giving up on the datagram
+		for (int spins = 0; free_sends.empty() && spins < RIO_SEND_SPINS; spins++)
+		{
+			if (deferred_sends > 0 && CommitRIO() != 0)
+				return SOCKET_ERROR;
+			ReapRIOSends();
+			if (free_sends.empty())
+				std::this_thread::yield();
+		}
+		if (free_sends.empty() || size > MAX_UDP_SIZE)
+			return 0;
+
+		int slot = free_sends.back();
+		free_sends.pop_back();
+		char* data = rio_region + (size_t) slot * RIO_SLOT_SIZE;
+		SOCKADDR_INET* address = (SOCKADDR_INET*) (data + MAX_UDP_SIZE);
+		memcpy(data, buf, size);
+		memset(address, 0, sizeof(SOCKADDR_INET));
+		memcpy(&address->Ipv4, &to, sizeof(to));
+
+		// queued only, the loop submits every send of an iteration with a single commit
+		RIO_BUF data_buf = RIOSlot(slot, 0, size);
+		RIO_BUF address_buf = RIOSlot(slot, MAX_UDP_SIZE, sizeof(SOCKADDR_INET));
+		if (!rio.RIOSendEx(rio_rq, &data_buf, 1, NULL, &address_buf, NULL, NULL, RIO_MSG_DEFER, (PVOID) (ULONG_PTR) slot))
+		{
+			free_sends.push_back(slot);
+			return SOCKET_ERROR;
+		}
+		deferred_sends++;
+		Count(METRIC_DATAGRAMS_SENT);
+		return size;
+	}
+
+	syscalls++;
+	Count(METRIC_SEND_CALLS);
+	int result = sendto(sock, buf, size, NULL, (struct sockaddr*) &to, sizeof(to));
+	if (result == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK)
+		return 0;
+	if (result != SOCKET_ERROR)
+		Count(METRIC_DATAGRAMS_SENT);
+	return result;
+}
+
+// Watches another socket for the given events (POLLRDNORM and/or POLLWRNORM), errors and 
+// hangups are always reported. Watching a socket again replaces its events and handler.
+void IOEngine::Watch(SOCKET s, short events, SocketHandler handler)
+{
+	for (size_t i = 0; i < watched.size(); i++)
+	{
+		if (watched[i].sock == s)
+		{
+			watched[i].events = events;
+			watched[i].handler = handler;
+			return;
+		}
+	}
+
+	WatchedSocket entry;
+	entry.sock = s;
+	entry.events = events;
+	entry.handler = handler;
+	watched.push_back(entry);
+}
+
+// Changes the events a watched socket is watched for
+void IOEngine::SetEvents(SOCKET s, short events)
+{
+	for (size_t i = 0; i < watched.size(); i++)
+	{
+		if (watched[i].sock == s)
+			watched[i].events = events;
+	}
+}
+
+// Stops watching a socket, its handler is not called again
+void IOEngine::Unwatch(SOCKET s)
+{
+	for (size_t i = 0; i < watched.size(); i++)
+	{
+		if (watched[i].sock == s)
+		{
+			watched[i] = watched.back();
+			watched.pop_back();
+			return;
+		}
+	}
+}
+
+// Hands the events reported in poll_fds (starting at 'first') to the watched sockets
+void IOEngine::DispatchWatched(size_t first)
+{
+	for (size_t i = first; i < poll_fds.size(); i++)
+	{
+		if (poll_fds[i].revents == 0)
+			continue;
+
+		// handlers may watch or unwatch sockets, so look the socket up again every time
+		for (size_t j = 0; j < watched.size(); j++)
+		{
+			if (watched[j].sock == poll_fds[i].fd)
+			{
+				SocketHandler handler = watched[j].handler;
+				handler(poll_fds[i].revents);
+				break;
+			}
+		}
+	}
+}
+
+// Waits up to wait_ms for readiness, drains every queued datagram and dispatches the 
+// events of watched sockets
+int IOEngine::PollOnce(int wait_ms)
+{
+	poll_fds.resize(1 + watched.size());
+	poll_fds[0].fd = sock;
+	poll_fds[0].events = POLLRDNORM;
+	poll_fds[0].revents = 0;
+	for (size_t i = 0; i < watched.size(); i++)
+	{
+		poll_fds[i + 1].fd = watched[i].sock;
+		poll_fds[i + 1].events = watched[i].events;
+		poll_fds[i + 1].revents = 0;
+	}
+
+	syscalls++;
+	Count(METRIC_RECEIVE_CALLS);
+	int ret = WSAPoll(poll_fds.data(), (ULONG) poll_fds.size(), wait_ms);
+	if (ret == SOCKET_ERROR)
+	{
+		printf("receive encountered socket error %d\n", WSAGetLastError());
+		return -1;
+	}
+	if (ret == 0)
+		return 0;
+	DispatchWatched(1);
+	if (poll_fds[0].revents == 0)
+		return 0;
+
+	// bound the number of datagrams handled per wakeup so expired timers are not starved
+	for (int i = 0; i < RECEIVE_BATCH; i++)
+	{
+		struct sockaddr_in from;
+		int from_size = sizeof(from);
+		syscalls++;
+		Count(METRIC_RECEIVE_CALLS);
+		int size = recvfrom(sock, recv_buf, MAX_UDP_SIZE, 0, (struct sockaddr*) &from, &from_size);
+		if (size == SOCKET_ERROR)
+		{
+			// an ICMP port unreachable from an earlier send is reported as a reset, skip it
+			int error = WSAGetLastError();
+			if (error == WSAECONNRESET || error == WSAEMSGSIZE)
+				continue;
+			if (error == WSAEWOULDBLOCK)
+				break;
+			printf("receive encountered socket error %d\n", error);
+			return -1;
+		}
+		Count(METRIC_DATAGRAMS_RECEIVED);
+		if (on_datagram)
+			on_datagram(recv_buf, size, from);
+	}
+	return 0;
+}
+
+// Polls the watched sockets without waiting and dispatches their events, for the completion
+// based backends. Polls at most once every WATCH_POLL_MS while none are ready, and caps wait_ms
+// at the time until the next poll, or clears it if any were ready.
+// Returns -1 on a socket error or 0 otherwise.
+int IOEngine::PollWatched(int& wait_ms)
+{
+	if (watched.empty())
+		return 0;
+
+	// a loop kept busy by datagrams does not poll idle connections on every iteration
+	auto now = std::chrono::steady_clock::now();
+	if (now < next_watch_poll)
+	{
+		int until_poll = (int) std::chrono::duration_cast<std::chrono::milliseconds>(next_watch_poll - now).count() + 1;
+		wait_ms = std::min(wait_ms, until_poll);
+		return 0;
+	}
+
+	poll_fds.resize(watched.size());
+	for (size_t i = 0; i < watched.size(); i++)
+	{
+		poll_fds[i].fd = watched[i].sock;
+		poll_fds[i].events = watched[i].events;
+		poll_fds[i].revents = 0;
+	}
+
+	// counted like the wait of the poll backend, which polls the same sockets along with its own
+	syscalls++;
+	Count(METRIC_WATCH_POLLS);
+	int ret = WSAPoll(poll_fds.data(), (ULONG) poll_fds.size(), 0);
+	if (ret == SOCKET_ERROR)
+	{
+		printf("receive encountered socket error %d\n", WSAGetLastError());
+		return -1;
+	}
+	if (ret > 0)
+	{
+		DispatchWatched(0);
+		wait_ms = 0;
+		return 0;
+	}
+	next_watch_poll = now + std::chrono::milliseconds(WATCH_POLL_MS);
+	if (wait_ms > WATCH_POLL_MS)
+		wait_ms = WATCH_POLL_MS;
+	return 0;
+}
+
+// Waits up to wait_ms for completed receives, delivers them and posts them again. Watched 
+// sockets are polled without waiting first, and the wait is kept short while there are any.
+int IOEngine::CompletionOnce(int wait_ms)
+{
+	if (PollWatched(wait_ms) != 0)
+		return -1;
+
+	OVERLAPPED_ENTRY entries[RECEIVE_DEPTH];
+	ULONG removed = 0;
+
+	syscalls++;
+	Count(METRIC_RECEIVE_CALLS);
+	if (!GetQueuedCompletionStatusEx(port, entries, RECEIVE_DEPTH, &removed, wait_ms, FALSE))
+	{
+		if (GetLastError() == WAIT_TIMEOUT)
+			return 0;
+		printf("receive encountered completion port error %d\n", (int) GetLastError());
+		return -1;
+	}
+
+	for (ULONG i = 0; i < removed; i++)
+	{
+		ReceiveContext* context = CONTAINING_RECORD(entries[i].lpOverlapped, ReceiveContext, overlapped);
+		DWORD size = 0, flags = 0;
+
+		// failed receives (e.g. resets caused by ICMP port unreachable) are simply posted again
+		if (WSAGetOverlappedResult(sock, &context->overlapped, &size, FALSE, &flags))
+		{
+			Count(METRIC_DATAGRAMS_RECEIVED);
+			if (on_datagram)
+				on_datagram(context->buf, (int) size, context->from);
+		}
+		if (PostReceive(*context) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+// Sets up the Registered I/O queues and buffers and posts every receive slot.
+// Prints a message and returns -1 in case of failure or 0 for success.
+int IOEngine::OpenRIO()
+{
+	GUID function_table_id = WSAID_MULTIPLE_RIO;
+	DWORD bytes = 0;
+	if (WSAIoctl(sock, SIO_GET_MULTIPLE_EXTENSION_FUNCTION_POINTER, &function_table_id, sizeof(function_table_id),
+		&rio, sizeof(rio), &bytes, NULL, NULL) == SOCKET_ERROR)
+	{
+		printf("  ++ program error: Registered I/O is not available, WSAIoctl() generated error %d\n", WSAGetLastError());
+		return -1;
+	}
+
+	// a single page aligned region is registered once, every datagram is sent and received in place
+	DWORD region_size = (DWORD) ((RIO_RECEIVE_DEPTH + RIO_SEND_DEPTH) * RIO_SLOT_SIZE);
+	rio_region = (char*) VirtualAlloc(NULL, region_size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (rio_region == NULL)
+	{
+		printf("  ++ program error: VirtualAlloc() generated error %d\n", (int) GetLastError());
+		return -1;
+	}
+	rio_buffer = rio.RIORegisterBuffer(rio_region, region_size);
+	if (rio_buffer == RIO_INVALID_BUFFERID)
+	{
+		printf("  ++ program error: RIORegisterBuffer() generated error %d\n", WSAGetLastError());
+		return -1;
+	}
+
+	// receives signal an event the loop can wait on, finished sends are only ever polled for
+	rio_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	RIO_NOTIFICATION_COMPLETION notification;
+	notification.Type = RIO_EVENT_COMPLETION;
+	notification.Event.EventHandle = rio_event;
+	notification.Event.NotifyReset = TRUE;
+	rio_receive_cq = rio.RIOCreateCompletionQueue(RIO_RECEIVE_DEPTH, &notification);
+	rio_send_cq = rio.RIOCreateCompletionQueue(RIO_SEND_DEPTH, NULL);
+	if (rio_event == NULL || rio_receive_cq == RIO_INVALID_CQ || rio_send_cq == RIO_INVALID_CQ)
+	{
+		printf("  ++ program error: RIOCreateCompletionQueue() generated error %d\n", WSAGetLastError());
+		return -1;
+	}
+	rio_rq = rio.RIOCreateRequestQueue(sock, RIO_RECEIVE_DEPTH, 1, RIO_SEND_DEPTH, 1, rio_receive_cq, rio_send_cq, NULL);
+	if (rio_rq == RIO_INVALID_RQ)
+	{
+		printf("  ++ program error: RIOCreateRequestQueue() generated error %d\n", WSAGetLastError());
+		return -1;
+	}
+
+	for (int i = 0; i < RIO_RECEIVE_DEPTH; i++)
+	{
+		if (PostRIOReceive(i) != 0)
+			return -1;
+	}
+	free_sends.clear();
+	for (int i = RIO_RECEIVE_DEPTH + RIO_SEND_DEPTH - 1; i >= RIO_RECEIVE_DEPTH; i--)
+		free_sends.push_back(i);
+	return CommitRIO();
+}
+
+// Returns a descriptor of 'length' bytes at 'offset' into the given slot of the registered region
+RIO_BUF IOEngine::RIOSlot(int slot, ULONG offset, ULONG length)
+{
+	RIO_BUF buf;
+	buf.BufferId = rio_buffer;
+	buf.Offset = (ULONG) (slot * RIO_SLOT_SIZE + offset);
+	buf.Length = length;
+	return buf;
+}
+
+// Queues a receive into the given slot, submitted with the next commit. Returns -1 on failure or 0 for success.
+int IOEngine::PostRIOReceive(int slot)
+{
+	RIO_BUF data = RIOSlot(slot, 0, MAX_UDP_SIZE);
+	RIO_BUF address = RIOSlot(slot, MAX_UDP_SIZE, sizeof(SOCKADDR_INET));
+	if (!rio.RIOReceiveEx(rio_rq, &data, 1, NULL, &address, NULL, NULL, RIO_MSG_DEFER, (PVOID) (ULONG_PTR) slot))
+	{
+		printf("receive encountered socket error %d\n", WSAGetLastError());
+		return -1;
+	}
+	deferred_receives++;
+	return 0;
+}
+
+// Submits every queued send and receive with one call each. Returns -1 on failure or 0 for success.
+int IOEngine::CommitRIO()
+{
+	if (deferred_sends > 0)
+	{
+		syscalls++;
+		Count(METRIC_SEND_CALLS);
+		deferred_sends = 0;
+		if (!rio.RIOSendEx(rio_rq, NULL, 0, NULL, NULL, NULL, NULL, RIO_MSG_COMMIT_ONLY, NULL))
+		{
+			printf("send encountered socket error %d\n", WSAGetLastError());
+			return -1;
+		}
+	}
+	if (deferred_receives > 0)
+	{
+		syscalls++;
+		Count(METRIC_RECEIVE_CALLS);
+		deferred_receives = 0;
+		if (!rio.RIOReceiveEx(rio_rq, NULL, 0, NULL, NULL, NULL, NULL, RIO_MSG_COMMIT_ONLY, NULL))
+		{
+			printf("receive encountered socket error %d\n", WSAGetLastError());
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Returns the slots of finished sends to the free list
+void IOEngine::ReapRIOSends()
+{
+	RIORESULT results[RIO_SEND_DEPTH];
+	ULONG count = rio.RIODequeueCompletion(rio_send_cq, results, RIO_SEND_DEPTH);
+	if (count == RIO_CORRUPT_CQ)
+		return;
+
+	// failed sends are left to the retransmission timers of their queries, like dropped datagrams
+	for (ULONG i = 0; i < count; i++)
+		free_sends.push_back((int) results[i].RequestContext);
+}
+
+// Submits queued requests, waits up to wait_ms for received datagrams, delivers them and
+// queues their slots for receiving again
+int IOEngine::RIOOnce(int wait_ms)
+{
+	if (PollWatched(wait_ms) != 0 || CommitRIO() != 0)
+		return -1;
+	ReapRIOSends();
+
+	// completions are dequeued in user mode, the kernel is only entered to wait for more
+	RIORESULT results[RIO_RECEIVE_DEPTH];
+	ULONG count = rio.RIODequeueCompletion(rio_receive_cq, results, RIO_RECEIVE_DEPTH);
+	if (count == 0 && wait_ms > 0)
+	{
+		syscalls += 2;
+		Count(METRIC_RECEIVE_CALLS, 2);
+		int error = rio.RIONotify(rio_receive_cq);
+		if (error != 0 && error != WSAEALREADY)
+		{
+			printf("receive encountered socket error %d\n", error);
+			return -1;
+		}
+		WaitForSingleObject(rio_event, wait_ms);
+		count = rio.RIODequeueCompletion(rio_receive_cq, results, RIO_RECEIVE_DEPTH);
+	}
+	if (count == RIO_CORRUPT_CQ)
+	{
+		printf("receive encountered a corrupt completion queue\n");
+		return -1;
+	}
+
+	for (ULONG i = 0; i < count; i++)
+	{
+		int slot = (int) results[i].RequestContext;
+		char* data = rio_region + (size_t) slot * RIO_SLOT_SIZE;
+		SOCKADDR_INET* address = (SOCKADDR_INET*) (data + MAX_UDP_SIZE);
+
+		// failed receives (e.g. resets caused by ICMP port unreachable) are simply posted again
+		if (results[i].Status == 0)
+		{
+			Count(METRIC_DATAGRAMS_RECEIVED);
+			if (on_datagram)
+				on_datagram(data, (int) results[i].BytesTransferred, address->Ipv4);
+		}
+		if (PostRIOReceive(slot) != 0)
+			return -1;
+	}
+
+	// receives posted again and sends made by the handlers go out together
+	return CommitRIO();
+}
+
+// Waits for socket events or the next timer (but no longer than max_wait_ms) and dispatches
+// them. Returns -1 on a socket error or 0 otherwise.
+int IOEngine::RunOnce(int max_wait_ms)
+{
+	long long wait_ms = timers.NextExpiry();
+	if (wait_ms < 0 || wait_ms > max_wait_ms)
+		wait_ms = max_wait_ms;
+
+	int result;
+	if (backend == IO_IOCP)
+		result = CompletionOnce((int) wait_ms);
+	else if (backend == IO_RIO)
+		result = RIOOnce((int) wait_ms);
+	else
+		result = PollOnce((int) wait_ms);
+	timers.Advance();
+	return result;
+}
+
+// Runs the loop until 'done' returns true, Stop() is called or a socket error occurs.
+// Returns -1 on a socket error or 0 otherwise.
+int IOEngine::Run(std::function<bool()> done)
+{
+	int result = 0;
+	while (result == 0 && !stopped && !done())
+		result = RunOnce(MAX_WAIT_MS);
+	stopped = false;
+	return result;
+}
+
+// Returns the name of a backend as given on the command line
+const char* IOEngine::BackendName(IOBackend backend)
+{
+	switch (backend)
+	{
+	case IO_IOCP:
+		return "iocp";
+	case IO_RIO:
+		return "rio";
+	default:
+		return "poll";
+	}
+}
@@ -0,0 +1,254 @@
+#pragma once
+
+// Identifies an armed timer, 0 is never a valid ID
+typedef unsigned long long TimerId;
+
+// Called with every datagram received on the engine socket
+typedef std::function<void(char* buf, int size, struct sockaddr_in& from)> DatagramHandler;
+
+// Called once when a timer expires
+typedef std::function<void()> TimerCallback;
+
+// Called with the events (POLLRDNORM, POLLWRNORM, POLLERR, POLLHUP) reported for a watched socket
+typedef std::function<void(short revents)> SocketHandler;
+
+// Ways the engine can wait for socket events
+enum IOBackend
+{
+	IO_POLL,	// readiness notification through WSAPoll() and non-blocking receives
+	IO_IOCP,	// completion notification through an I/O completion port with posted receives
+	IO_RIO		// Registered I/O, sends and receives are queued in user mode and submitted in batches
+};
+
+/*
+ * The TimerWheel class keeps timers in a hashed wheel of WHEEL_SLOTS one millisecond slots.
+ * Arming, cancelling and expiring a timer are O(1); timers further away than one turn of 
+ * the wheel count down the remaining turns. A bitmap of occupied slots makes finding the 
+ * next expiry cheap enough to compute on every loop iteration.
+ */
+class TimerWheel
+{
+	struct TimerNode
+	{
+		UINT generation = 0;
+		bool armed = false;
+		int slot = -1;
+		int rounds = 0;
+		int prev = -1, next = -1;
+		TimerCallback callback;
+	};
+
+	std::vector<TimerNode> nodes;
+	std::vector<int> free_nodes;
+	std::vector<int> heads;
+	std::vector<unsigned long long> occupied;
+	std::vector<std::pair<int, UINT>> due;
+	std::chrono::steady_clock::time_point origin;
+	long long current_tick = 0;
+	int armed_count = 0;
+
+	// Links and unlinks nodes from the list of their slot
+	void Link(int index, int slot);
+	void Unlink(int index);
+
+	// Returns the number of milliseconds since the wheel was created
+	long long Now();
+
+public:
+
+	TimerWheel();
+
+	// Arms a timer that calls 'callback' once after 'delay_ms' milliseconds and returns its ID
+	TimerId Add(long long delay_ms, TimerCallback callback);
+
+	// Disarms a timer, IDs of timers that have already expired or been cancelled are ignored
+	void Cancel(TimerId id);
+
+	// Calls the callbacks of all timers that are due. Returns the number of timers fired.
+	int Advance();
+
+	// Returns the number of milliseconds until the next timer is due (0 if one is already due),
+	// or -1 if no timer is armed
+	long long NextExpiry();
+
+	int Size() { return armed_count; }
+};
+
+/*
+ * The IOEngine class owns the non-blocking UDP socket used to talk to DNS servers and runs 
+ * an event loop around it. Datagrams are delivered to a handler as they arrive and per-query 
+ * deadlines are kept in a timer wheel, so a single thread can keep any number of queries 
+ * outstanding without one slow server stalling the others. The loop can be driven by 
+ * WSAPoll() readiness, by an I/O completion port with several receives posted at once, or by
+ * Registered I/O, which queues sends and receives in user mode, submits each kind with one
+ * call per loop iteration and dequeues completions without entering the kernel.
+ *
+ * Other sockets (e.g. TCP connections) can be watched for readiness alongside the UDP socket.
+ * With the completion based backends they are polled between waits, which are then kept short.
+ */
+class IOEngine
+{
+	// State of one overlapped receive posted to the completion port
+	struct ReceiveContext
+	{
+		WSAOVERLAPPED overlapped;
+		WSABUF wsa_buf;
+		DWORD flags;
+		struct sockaddr_in from;
+		int from_size;
+		char buf[MAX_UDP_SIZE];
+	};
+
+	IOBackend backend = IO_POLL;
+	SOCKET sock = INVALID_SOCKET;
+	HANDLE port = NULL;
+	std::vector<ReceiveContext> receives;
+	DatagramHandler on_datagram;
+	TimerWheel timers;
+
+	// Sockets watched for readiness besides the UDP socket
+	struct WatchedSocket
+	{
+		SOCKET sock;
+		short events;
+		SocketHandler handler;
+	};
+	std::vector<WatchedSocket> watched;
+	std::vector<WSAPOLLFD> poll_fds;
+
+	// Registered I/O: one registered region holds RIO_RECEIVE_DEPTH receive slots followed by 
+	// RIO_SEND_DEPTH send slots, each a datagram buffer followed by the address of its peer
+	RIO_EXTENSION_FUNCTION_TABLE rio;
+	RIO_CQ rio_receive_cq = RIO_INVALID_CQ;
+	RIO_CQ rio_send_cq = RIO_INVALID_CQ;
+	RIO_RQ rio_rq = RIO_INVALID_RQ;
+	RIO_BUFFERID rio_buffer = RIO_INVALID_BUFFERID;
+	HANDLE rio_event = NULL;
+	char* rio_region = NULL;
+	std::vector<int> free_sends;
+	int deferred_sends = 0;
+	int deferred_receives = 0;
+
+	// System calls made for the UDP socket and the polls of the watched sockets, to compare backends
+	ULONGLONG syscalls = 0;
+
+	// Metrics the datagrams and the system calls that send and receive them are counted in,
+	// NULL for none
+	ResolverMetrics* metrics = NULL;
+
+	// Watched sockets are not polled again before this time unless the last poll found events
+	std::chrono::steady_clock::time_point next_watch_poll;
+
+	bool stopped = false;
+	char recv_buf[MAX_UDP_SIZE];
+
+	// Posts an overlapped receive to the completion port. Returns -1 on failure or 0 for success.
+	int PostReceive(ReceiveContext& context);
+
+	// Waits up to wait_ms for readiness, drains every queued datagram and dispatches the 
+	// events of watched sockets
+	int PollOnce(int wait_ms);
+
+	// Hands the events reported in poll_fds (starting at 'first') to the watched sockets
+	void DispatchWatched(size_t first);
+
+	// Adds to a counter of the metrics, if there are any
+	void Count(MetricCounter counter, ULONGLONG amount = 1)
+	{
+		if (metrics != NULL)
+			metrics->Add(counter, amount);
+	}
+
+	// Polls the watched sockets without waiting and dispatches their events, for the completion
+	// based backends. Polls at most once every WATCH_POLL_MS while none are ready, and caps wait_ms
+	// at the time until the next poll, or clears it if any were ready.
+	// Returns -1 on a socket error or 0 otherwise.
+	int PollWatched(int& wait_ms);
+
+	// Waits up to wait_ms for completed receives, delivers them and posts them again. Watched 
+	// sockets are polled without waiting first, and the wait is kept short while there are any.
+	int CompletionOnce(int wait_ms);
+
+	// Sets up the Registered I/O queues and buffers and posts every receive slot.
+	// Prints a message and returns -1 in case of failure or 0 for success.
+	int OpenRIO();
+
+	// Returns a descriptor of 'length' bytes at 'offset' into the given slot of the registered region
+	RIO_BUF RIOSlot(int slot, ULONG offset, ULONG length);
+
+	// Queues a receive into the given slot, submitted with the next commit. Returns -1 on failure or 0 for success.
+	int PostRIOReceive(int slot);
+
+	// Submits every queued send and receive with one call each. Returns -1 on failure or 0 for success.
+	int CommitRIO();
+
+	// Returns the slots of finished sends to the free list
+	void ReapRIOSends();
+
+	// Submits queued requests, waits up to wait_ms for received datagrams, delivers them and
+	// queues their slots for receiving again
+	int RIOOnce(int wait_ms);
+
+public:
+
+	IOEngine();
+
+	// Closes the socket and the completion port or Registered I/O queues
+	~IOEngine();
+
+	// Closes the socket and the completion port or Registered I/O queues. Must be called before 
+	// WinSock is cleaned up.
+	void Close();
+
+	// Opens and binds a UDP socket on an ephemeral port and prepares the given backend.
+	// Prints a message and returns -1 in case of failure or 0 for success.
+	int Open(IOBackend backend);
+
+	// Counts datagrams and the system calls that send and receive them in metrics, which must
+	// belong to the thread that runs the engine
+	void SetMetrics(ResolverMetrics* target) { metrics = target; }
+
+	// Sets the handler called for every received datagram
+	void SetDatagramHandler(DatagramHandler handler) { on_datagram = handler; }
+
+	// Sends a datagram to the given address. A full socket buffer is not reported as an error,
+	// the datagram is dropped and left to the retransmission timer of the caller.
+	// Returns the number of bytes sent, 0 if the datagram was dropped or -1 on a socket error.
+	int SendTo(const char* buf, int size, struct sockaddr_in& to);
+
+	// Watches another socket for the given events (POLLRDNORM and/or POLLWRNORM), errors and 
+	// hangups are always reported. Watching a socket again replaces its events and handler.
+	void Watch(SOCKET s, short events, SocketHandler handler);
+
+	// Changes the events a watched socket is watched for
+	void SetEvents(SOCKET s, short events);
+
+	// Stops watching a socket, its handler is not called again
+	void Unwatch(SOCKET s);
+
+	// Arms a timer that fires once after 'delay_ms' milliseconds
+	TimerId AddTimer(long long delay_ms, TimerCallback callback) { return timers.Add(delay_ms, callback); }
+
+	// Disarms a timer that has not fired yet
+	void CancelTimer(TimerId id) { timers.Cancel(id); }
+
+	// Waits for socket events or the next timer (but no longer than max_wait_ms) and dispatches
+	// them. Returns -1 on a socket error or 0 otherwise.
+	int RunOnce(int max_wait_ms);
+
+	// Runs the loop until 'done' returns true, Stop() is called or a socket error occurs.
+	// Returns -1 on a socket error or 0 otherwise.
+	int Run(std::function<bool()> done);
+
+	// Makes Run() return after the current iteration
+	void Stop() { stopped = true; }
+
+	// Returns the number of system calls made for the UDP socket and the watched sockets so far
+	ULONGLONG Syscalls() { return syscalls; }
+
+	SOCKET Socket() { return sock; }
+	IOBackend Backend() { return backend; }
+
+	// Returns the name of a backend as given on the command line
+	static const char* BackendName(IOBackend backend);
+};
@@ -0,0 +1,144 @@
+// InFlightTable.cpp
+// CSCE 463-500
+
+#include "pch.h"
+
+// Creates a table with room for 'capacity' simultaneous queries (at most MAX_WINDOW)
+InFlightTable::InFlightTable(int capacity)
+{
+	if (capacity < 1)
+		capacity = 1;
+	else if (capacity > MAX_WINDOW)
+		capacity = MAX_WINDOW;
+
+	slots.resize(capacity);
+	txid_index.assign(65536, 0);
+	completed.resize(65536);
+	created = std::chrono::steady_clock::now();
+
+	// hand out low slot numbers first
+	free_slots.reserve(capacity);
+	for (int i = capacity - 1; i >= 0; i--)
+		free_slots.push_back(i);
+}
+
+// Returns a random non-zero TXID
+USHORT InFlightTable::RandomID()
+{
+	// every thread draws from its own generator, so tables owned by different threads share no state
+	static thread_local std::mt19937 generator(std::random_device{}());
+	USHORT id = (USHORT) (generator() & 0xFFFF);
+	return (id == 0) ? 1 : id;
+}
+
+// Reserves a slot and assigns it a TXID not used by any other outstanding query. 
+// Returns NULL if every slot is in use.
+PendingQuery* InFlightTable::Allocate()
+{
+	if (free_slots.empty())
+		return NULL;
+
+	int index = free_slots.back();
+	free_slots.pop_back();
+
+	// the table holds far fewer queries than there are TXIDs, so this terminates quickly
+	USHORT id = RandomID();
+	while (txid_index[id] != 0)
+		id = RandomID();
+
+	PendingQuery* query = &slots[index];
+	query->in_use = true;
+	query->txid = id;
+	query->attempts = 0;
+	query->packet_size = 0;
+	query->serial++;
+	txid_index[id] = (USHORT) (index + 1);
+	return query;
+}
+
+// Returns the outstanding query that a response in buf belongs to, or NULL if no 
+// outstanding query has the same TXID and question as the response.
+PendingQuery* InFlightTable::Match(char* buf, int response_size)
+{
+	if (response_size < sizeof(DNSHeader))
+		return NULL;
+
+	DNSHeader* response = (DNSHeader*)buf;
+	USHORT index = txid_index[ntohs(response->ID)];
+	if (index == 0)
+		return NULL;
+
+	PendingQuery* query = &slots[index - 1];
+
+	// the question section is echoed back in the reply, compare it without regard to case
+	int question_size = query->question_size;
+	if (ntohs(response->questions) != 1 || response_size < (int) sizeof(DNSHeader) + question_size)
+		return NULL;
+	char* sent = query->packet + sizeof(DNSHeader);
+	char* received = buf + sizeof(DNSHeader);
+	for (int i = 0; i < question_size; i++)
+	{
+		if (tolower((UCHAR) sent[i]) != tolower((UCHAR) received[i]))
+			return NULL;
+	}
+
+	return query;
+}
+
+// Returns whether a response that matches no outstanding query has the TXID of a query 
+// that completed within the last LATE_REPLY_MS and was sent to the server with the given
+// index, i.e. is a late reply to a retransmission, race or hedge of it
+bool InFlightTable::MatchCompleted(char* buf, int response_size, int upstream)
+{
+	if (response_size < sizeof(DNSHeader))
+		return false;
+
+	CompletedQuery& query = completed[ntohs(((DNSHeader*) buf)->ID)];
+	return (query.sent_mask & (1u << upstream)) != 0 && Now() - query.completed_ms < LATE_REPLY_MS;
+}
+
+// Returns the outstanding query whose packet asks the given question (as encoded after the
+// header), without regard to case, or NULL if there is none
+PendingQuery* InFlightTable::FindQuestion(const char* question, int question_size)
+{
+	if (question_index.empty())
+		return NULL;
+
+	question_key.assign(question, question_size);
+	auto found = question_index.find(question_key);
+	return (found == question_index.end()) ? NULL : &slots[found->second];
+}
+
+// Makes a query, whose packet must have been created, the one found for its question
+void InFlightTable::IndexQuestion(PendingQuery* query)
+{
+	question_index[std::string(query->packet + sizeof(DNSHeader), query->question_size)] = IndexOf(query);
+}
+
+// Stops a query from being found for its question, e.g. once it is being completed
+void InFlightTable::UnindexQuestion(PendingQuery* query)
+{
+	// a newer query for the same question may have taken over the entry
+	question_key.assign(query->packet + sizeof(DNSHeader), query->question_size);
+	auto found = question_index.find(question_key);
+	if (found != question_index.end() && found->second == IndexOf(query))
+		question_index.erase(found);
+}
+
+// Returns a slot and its TXID to the free pool, remembering the servers the query was sent to
+void InFlightTable::Release(PendingQuery* query)
+{
+	if (!query->in_use)
+		return;
+
+	completed[query->txid].sent_mask = query->sent_mask;
+	completed[query->txid].completed_ms = Now();
+
+	UnindexQuestion(query);
+	query->waiters.clear();
+
+	query->in_use = false;
+	query->serial++;
+	txid_index[query->txid] = 0;
+	free_slots.push_back(IndexOf(query));
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+struct PendingQuery;
+
+// Called once per query with the response (size > 0), a timeout (NULL and 0) or an error (NULL and -1)
+typedef std::function<void(PendingQuery& query, char* buf, int response_size)> QueryCallback;
+
+// A lookup encoded as the question section of a query (label-encoded name followed by 
+// the query header) together with its dotted text, the question is also the cache key
+struct DNSQuestion
+{
+	DWORD type = 0;
+	int size = 0;
+	char wire[MAX_NAME_SIZE + sizeof(QueryHeader)];
+	char text[MAX_NAME_SIZE];
+};
+
+// A lookup of the same question that joined an outstanding query instead of sending its own
+struct QueryWaiter
+{
+	std::string lookup;
+	std::chrono::steady_clock::time_point submit_time;
+	QueryCallback callback;
+};
+
+/*
+ * State kept for a single outstanding DNS query: the packet that was sent (so it 
+ * can be retransmitted and its question compared against replies), the original 
+ * lookup text, the attempt/timer bookkeeping and the completion callback.
+ */
+struct PendingQuery
+{
+	bool in_use = false;
+	USHORT txid = 0;
+	DWORD type = 0;
+	UINT serial = 0;
+	int attempts = 0;
+	int packet_size = 0;
+
+	// Size of the question section that follows the header of the packet, and whether an 
+	// EDNS(0) OPT record follows the question
+	int question_size = 0;
+	bool edns = false;
+	char lookup[MAX_NAME_SIZE];
+	char question[MAX_NAME_SIZE];
+	char packet[MAX_DNS_SIZE];
+
+	// Print every attempt as it is made, as the single lookup mode does
+	bool verbose = false;
+
+	// Set when the query was answered from the cache rather than sent
+	bool from_cache = false;
+
+	// Set once a truncated answer was received, the remaining attempts go over TCP
+	bool tcp = false;
+
+	// Set for a background refresh of a cached answer that no lookup is waiting for
+	bool prefetch = false;
+
+	// Upstream servers the query has been sent to (one bit per server index), those of the 
+	// current attempt, those a hedge of the current attempt went to, and the server of the 
+	// current attempt or the one that answered
+	UINT sent_mask = 0;
+	UINT attempt_mask = 0;
+	UINT hedge_mask = 0;
+	int upstream = -1;
+
+	// Time the query was submitted, time of the most recent transmission, the retransmission 
+	// timer armed for it and the timer that sends a hedge if it is not answered within the 
+	// usual latency of the server
+	std::chrono::steady_clock::time_point submit_time;
+	std::chrono::steady_clock::time_point start_time;
+
+	// Phases only timed while tracing: encoding of the question started, first transmission,
+	// the reply that completed the query was received and then matched, checked and cached
+	std::chrono::steady_clock::time_point encode_time, send_time, receive_time, parse_time;
+	TimerId timer = 0;
+	TimerId hedge_timer = 0;
+
+	QueryCallback callback;
+
+	// Lookups completed with the response of this query after its own callback
+	std::vector<QueryWaiter> waiters;
+};
+
+/*
+ * The InFlightTable class holds a fixed number of PendingQuery slots and an index from 
+ * TXID to slot so that replies arriving in any order can be matched back to the query 
+ * that produced them. TXIDs handed out are unique among all outstanding queries. A second
+ * index from question to slot lets lookups of a question that is already outstanding
+ * wait for its response instead of sending their own.
+ */
+class InFlightTable
+{
+	std::vector<PendingQuery> slots;
+	std::vector<int> free_slots;
+
+	// Slot number + 1 for every TXID currently outstanding, 0 if the TXID is free
+	std::vector<USHORT> txid_index;
+
+	// For every TXID, the servers the last query completed under it was sent to and when it
+	// completed (in milliseconds since the table was created), to tell late replies to it
+	// from stray ones
+	struct CompletedQuery
+	{
+		UINT sent_mask = 0;
+		UINT completed_ms = 0;
+	};
+	std::vector<CompletedQuery> completed;
+	std::chrono::steady_clock::time_point created;
+
+	// Returns the milliseconds since the table was created
+	UINT Now() { return (UINT) std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - created).count(); }
+
+	// Slot of the query for every outstanding question, keyed by the question section of its 
+	// packet. Reuses one key so that looking up a question does not allocate.
+	std::unordered_map<std::string, int, QuestionHash, QuestionEqual> question_index;
+	std::string question_key;
+
+	// Returns a random non-zero TXID
+	USHORT RandomID();
+
+public:
+
+	// Creates a table with room for 'capacity' simultaneous queries (at most MAX_WINDOW)
+	InFlightTable(int capacity);
+
+	// Reserves a slot and assigns it a TXID not used by any other outstanding query. 
+	// Returns NULL if every slot is in use.
+	PendingQuery* Allocate();
+
+	// Returns the outstanding query that a response in buf belongs to, or NULL if no 
+	// outstanding query has the same TXID and question as the response.
+	PendingQuery* Match(char* buf, int response_size);
+
+	// Returns whether a response that matches no outstanding query has the TXID of a query 
+	// that completed within the last LATE_REPLY_MS and was sent to the server with the given
+	// index, i.e. is a late reply to a retransmission, race or hedge of it
+	bool MatchCompleted(char* buf, int response_size, int upstream);
+
+	// Returns the outstanding query whose packet asks the given question (as encoded after the
+	// header), without regard to case, or NULL if there is none
+	PendingQuery* FindQuestion(const char* question, int question_size);
+
+	// Makes a query, whose packet must have been created, the one found for its question
+	void IndexQuestion(PendingQuery* query);
+
+	// Stops a query from being found for its question, e.g. once it is being completed
+	void UnindexQuestion(PendingQuery* query);
+
+	// Returns a slot and its TXID to the free pool, remembering the servers the query was sent to
+	void Release(PendingQuery* query);
+
+	// Returns the slot with the given index, used to resolve the slot of an expired timer
+	PendingQuery* At(int index) { return &slots[index]; }
+
+	// Returns the index of a slot in the table
+	int IndexOf(PendingQuery* query) { return (int) (query - slots.data()); }
+
+	int Size() { return (int) (slots.size() - free_slots.size()); }
+	bool Full() { return free_slots.empty(); }
+};
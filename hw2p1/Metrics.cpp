@@ -0,0 +1,216 @@
+// Metrics.cpp
+// CSCE 463-500
+
+#include "pch.h"
+
+// Exported name and help text of every counter, in the order of MetricCounter
+static const char* counter_names[METRIC_COUNTERS][2] = {
+	{ "dns_resolver_queries_sent_total", "Queries sent to the servers, retransmissions and hedges included" },
+	{ "dns_resolver_retransmits_total", "Queries sent again after an attempt timed out" },
+	{ "dns_resolver_timeouts_total", "Attempts that went unanswered until their retransmission timeout" },
+	{ "dns_resolver_lookups_timed_out_total", "Lookups that failed after every attempt timed out" },
+	{ "dns_resolver_txid_mismatches_total", "Replies from a server matching no outstanding or recently completed query" },
+	{ "dns_resolver_late_replies_total", "Replies to a query that had already completed, e.g. to a retransmission, race or hedge" },
+	{ "dns_resolver_wrong_source_total", "Replies from an address the query was not sent to" },
+	{ "dns_resolver_cache_hits_total", "Lookups answered from the cache" },
+	{ "dns_resolver_cache_misses_total", "Lookups missing from the cache" },
+	{ "dns_resolver_sent_bytes_total", "Bytes of the queries sent to the servers" },
+	{ "dns_resolver_received_bytes_total", "Bytes of the replies received from the servers" },
+	{ "dns_resolver_datagrams_sent_total", "Datagrams handed to the UDP socket" },
+	{ "dns_resolver_datagrams_received_total", "Datagrams read from the UDP socket" },
+	{ "dns_resolver_send_syscalls_total", "System calls that sent datagrams: one per sendto, or one per Registered I/O commit" },
+	{ "dns_resolver_receive_syscalls_total", "System calls made to wait for, read or post receives of datagrams" },
+	{ "dns_resolver_watch_polls_total", "Polls of the TCP and client sockets watched besides the UDP socket" }
+};
+
+// Names of the RCODEs of RFC 1035 and RFC 2136, which are always exported
+static const char* rcode_names[] = { "NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED",
+	"YXDOMAIN", "YXRRSET", "NXRRSET", "NOTAUTH", "NOTZONE" };
+
+LatencyHistogram::LatencyHistogram()
+{
+	for (int i = 0; i <= HISTOGRAM_BUCKETS; i++)
+		buckets[i] = 0;
+	total_us = 0;
+}
+
+// Returns the bucket of a latency in microseconds, HISTOGRAM_BUCKETS for the overflow bucket
+int LatencyHistogram::Bucket(ULONGLONG us)
+{
+	// the first 2 * HISTOGRAM_SUB_BUCKETS buckets are one microsecond wide, every power of two
+	// after that is split into HISTOGRAM_SUB_BUCKETS buckets
+	int shift = 0;
+	while ((us >> shift) >= 2 * HISTOGRAM_SUB_BUCKETS)
+		shift++;
+	ULONGLONG bucket = shift * HISTOGRAM_SUB_BUCKETS + (us >> shift);
+	return (bucket < HISTOGRAM_BUCKETS) ? (int) bucket : HISTOGRAM_BUCKETS;
+}
+
+// Returns the latency in microseconds every latency of a bucket is below
+ULONGLONG LatencyHistogram::UpperBound(int bucket)
+{
+	if (bucket < 2 * HISTOGRAM_SUB_BUCKETS)
+		return bucket + 1;
+	int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+	ULONGLONG first = bucket % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+	return (first + 1) << shift;
+}
+
+// Counts a latency in milliseconds. Only the thread that owns the histogram may record.
+void LatencyHistogram::Record(double ms)
+{
+	ULONGLONG us = (ms > 0) ? (ULONGLONG) (ms * 1000) : 0;
+	std::atomic<ULONGLONG>& bucket = buckets[Bucket(us)];
+	bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	total_us.store(total_us.load(std::memory_order_relaxed) + us, std::memory_order_relaxed);
+}
+
+// Adds the count of every bucket (HISTOGRAM_BUCKETS + 1 of them) to counts and the
+// sum of the latencies in microseconds to sum_us. Safe from any thread.
+void LatencyHistogram::AddTo(std::vector<ULONGLONG>& counts, ULONGLONG& sum_us) const
+{
+	counts.resize(HISTOGRAM_BUCKETS + 1, 0);
+	for (int i = 0; i <= HISTOGRAM_BUCKETS; i++)
+		counts[i] += buckets[i].load(std::memory_order_relaxed);
+	sum_us += total_us.load(std::memory_order_relaxed);
+}
+
+ResolverMetrics::ResolverMetrics()
+{
+	for (int i = 0; i < METRIC_COUNTERS; i++)
+		counters[i] = 0;
+	for (int i = 0; i < 16; i++)
+		rcodes[i] = 0;
+}
+
+// Writes a histogram summed over the sources in the Prometheus text format, with cumulative
+// buckets labelled by their upper bound in seconds
+static void WriteHistogram(FILE* output, const char* name, const char* help,
+	const std::vector<const ResolverMetrics*>& sources, LatencyHistogram ResolverMetrics::* histogram)
+{
+	std::vector<ULONGLONG> counts;
+	ULONGLONG sum_us = 0;
+	for (size_t i = 0; i < sources.size(); i++)
+		(sources[i]->*histogram).AddTo(counts, sum_us);
+	counts.resize(HISTOGRAM_BUCKETS + 1, 0);
+
+	fprintf(output, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+	ULONGLONG total = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		total += counts[i];
+		fprintf(output, "%s_bucket{le=\"%.9g\"} %llu\n", name, LatencyHistogram::UpperBound(i) / 1e6, total);
+	}
+	total += counts[HISTOGRAM_BUCKETS];
+	fprintf(output, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.6f\n%s_count %llu\n", name, total, name, sum_us / 1e6, name, total);
+}
+
+// Writes the sum of the metrics of every source to output in the Prometheus text format
+void ResolverMetrics::WritePrometheus(FILE* output, const std::vector<const ResolverMetrics*>& sources)
+{
+	for (int counter = 0; counter < METRIC_COUNTERS; counter++)
+	{
+		ULONGLONG total = 0;
+		for (size_t i = 0; i < sources.size(); i++)
+			total += sources[i]->Counter((MetricCounter) counter);
+		fprintf(output, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counter_names[counter][0], counter_names[counter][1],
+			counter_names[counter][0], counter_names[counter][0], total);
+	}
+
+	// RCODEs without a name are only written once seen
+	fprintf(output, "# HELP dns_resolver_responses_total Replies accepted from the servers by RCODE\n"
+		"# TYPE dns_resolver_responses_total counter\n");
+	int named = (int) (sizeof(rcode_names) / sizeof(rcode_names[0]));
+	for (int rcode = 0; rcode < 16; rcode++)
+	{
+		ULONGLONG total = 0;
+		for (size_t i = 0; i < sources.size(); i++)
+			total += sources[i]->Rcode(rcode);
+		if (rcode < named)
+			fprintf(output, "dns_resolver_responses_total{rcode=\"%s\"} %llu\n", rcode_names[rcode], total);
+		else if (total > 0)
+			fprintf(output, "dns_resolver_responses_total{rcode=\"%d\"} %llu\n", rcode, total);
+	}
+
+	WriteHistogram(output, "dns_resolver_upstream_rtt_seconds", "Time from sending an attempt to its reply",
+		sources, &ResolverMetrics::upstream_rtt);
+	WriteHistogram(output, "dns_resolver_lookup_duration_seconds", "Time from submitting a lookup to its response, cache hits aside",
+		sources, &ResolverMetrics::lookup_latency);
+}
+
+// Creates an exporter writing to path every interval_ms milliseconds, 0 for only when stopped
+MetricsExporter::MetricsExporter(const char* path, int interval_ms) : path(path), interval_ms(interval_ms)
+{
+}
+
+// Stops the exporter if it is running
+MetricsExporter::~MetricsExporter()
+{
+	if (thread.joinable())
+		Stop();
+}
+
+// Writes the dump to the file (or stdout). Returns -1 if the file could not be written.
+int MetricsExporter::Write()
+{
+	if (path == "-")
+	{
+		printf("********************************\n");
+		ResolverMetrics::WritePrometheus(stdout, sources);
+		fflush(stdout);
+		return 0;
+	}
+
+	// a reader of the file always sees a complete dump, the last one or the one before it, and
+	// the format allows no carriage returns
+	std::string temp_path = path + ".tmp";
+	FILE* output = NULL;
+	if (fopen_s(&output, temp_path.c_str(), "wb") != 0)
+		return -1;
+	ResolverMetrics::WritePrometheus(output, sources);
+	bool failed = ferror(output) != 0;
+	if (fclose(output) != 0 || failed)
+		return -1;
+	if (!MoveFileExA(temp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+		return -1;
+	return 0;
+}
+
+// Starts writing the dump every interval, if there is one
+void MetricsExporter::Start()
+{
+	if (interval_ms <= 0 || path == "-")
+		return;
+
+	stopping = false;
+	thread = std::thread([this]()
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		while (!wakeup.wait_for(guard, std::chrono::milliseconds(interval_ms), [this]() { return stopping; }))
+		{
+			if (Write() != 0)
+				printf("Metrics : unable to write to %s\n", path.c_str());
+		}
+	});
+}
+
+// Stops the periodic dumps and writes the final one. Returns -1 if it could not be written.
+int MetricsExporter::Stop()
+{
+	if (thread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wakeup.notify_one();
+		thread.join();
+	}
+
+	if (Write() != 0)
+	{
+		printf("Metrics : unable to write to %s\n", path.c_str());
+		return -1;
+	}
+	return 0;
+}
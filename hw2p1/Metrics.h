@@ -0,0 +1,131 @@
+#pragma once
+
+// Counters kept by every resolver, exported under the names given in Metrics.cpp
+enum MetricCounter
+{
+	METRIC_QUERIES_SENT,
+	METRIC_RETRANSMITS,
+	METRIC_TIMEOUTS,
+	METRIC_LOOKUPS_TIMED_OUT,
+	METRIC_TXID_MISMATCHES,
+	METRIC_LATE_REPLIES,
+	METRIC_WRONG_SOURCE,
+	METRIC_CACHE_HITS,
+	METRIC_CACHE_MISSES,
+	METRIC_BYTES_SENT,
+	METRIC_BYTES_RECEIVED,
+	METRIC_DATAGRAMS_SENT,
+	METRIC_DATAGRAMS_RECEIVED,
+	METRIC_SEND_CALLS,
+	METRIC_RECEIVE_CALLS,
+	METRIC_WATCH_POLLS,
+	METRIC_COUNTERS
+};
+
+/*
+ * The LatencyHistogram class counts latencies in log-linear buckets: HISTOGRAM_SUB_BUCKETS
+ * buckets of equal width per power of two of microseconds, so every bucket is within 25% of
+ * its bound from 1 us up to HISTOGRAM_MAX_US, past which latencies are only counted in total.
+ * Recording is a handful of shifts and no locks, as for the counters of ResolverMetrics.
+ */
+class LatencyHistogram
+{
+	std::atomic<ULONGLONG> buckets[HISTOGRAM_BUCKETS + 1];
+	std::atomic<ULONGLONG> total_us;
+
+public:
+
+	LatencyHistogram();
+
+	// Returns the bucket of a latency in microseconds, HISTOGRAM_BUCKETS for the overflow bucket
+	static int Bucket(ULONGLONG us);
+
+	// Returns the latency in microseconds every latency of a bucket is below
+	static ULONGLONG UpperBound(int bucket);
+
+	// Counts a latency in milliseconds. Only the thread that owns the histogram may record.
+	void Record(double ms);
+
+	// Adds the count of every bucket (HISTOGRAM_BUCKETS + 1 of them) to counts and the
+	// sum of the latencies in microseconds to sum_us. Safe from any thread.
+	void AddTo(std::vector<ULONGLONG>& counts, ULONGLONG& sum_us) const;
+};
+
+/*
+ * The ResolverMetrics class holds the counters and latency histograms of one resolver. Each
+ * resolver runs on a single thread, which is the only one to update its metrics, so an update
+ * is a relaxed load and store rather than a locked read-modify-write, while an exporter on
+ * another thread may read them at any time. Exports sum the metrics of every resolver.
+ */
+class ResolverMetrics
+{
+	std::atomic<ULONGLONG> counters[METRIC_COUNTERS];
+
+	// Replies accepted from the servers by RCODE
+	std::atomic<ULONGLONG> rcodes[16];
+
+public:
+
+	// Time from an attempt being sent to its reply, and from a lookup being submitted to its
+	// response (cache hits aside)
+	LatencyHistogram upstream_rtt, lookup_latency;
+
+	ResolverMetrics();
+
+	// Adds to a counter. Only the thread that owns the metrics may add.
+	void Add(MetricCounter counter, ULONGLONG amount = 1)
+	{
+		counters[counter].store(counters[counter].load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+
+	// Counts a reply with the given RCODE
+	void AddRcode(int rcode)
+	{
+		rcodes[rcode & 15].store(rcodes[rcode & 15].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	ULONGLONG Counter(MetricCounter counter) const { return counters[counter].load(std::memory_order_relaxed); }
+	ULONGLONG Rcode(int rcode) const { return rcodes[rcode & 15].load(std::memory_order_relaxed); }
+
+	// Writes the sum of the metrics of every source to output in the Prometheus text format
+	static void WritePrometheus(FILE* output, const std::vector<const ResolverMetrics*>& sources);
+};
+
+/*
+ * The MetricsExporter class writes the metrics of a set of resolvers to a file in the Prometheus
+ * text format: every interval from a thread of its own while the resolvers run, for a textfile
+ * collector or anything else that reads the file, and once more when stopped. The file is
+ * written next to its path and renamed over it, so a reader never sees a partial dump. A path
+ * of "-" prints the dump to stdout when stopped instead.
+ */
+class MetricsExporter
+{
+	std::string path;
+	int interval_ms;
+	std::vector<const ResolverMetrics*> sources;
+
+	std::thread thread;
+	std::mutex lock;
+	std::condition_variable wakeup;
+	bool stopping = false;
+
+	// Writes the dump to the file (or stdout). Returns -1 if the file could not be written.
+	int Write();
+
+public:
+
+	// Creates an exporter writing to path every interval_ms milliseconds, 0 for only when stopped
+	MetricsExporter(const char* path, int interval_ms);
+
+	// Stops the exporter if it is running
+	~MetricsExporter();
+
+	// Adds the metrics of a resolver to the dump. Only before the exporter is started.
+	void Add(const ResolverMetrics& metrics) { sources.push_back(&metrics); }
+
+	// Starts writing the dump every interval, if there is one
+	void Start();
+
+	// Stops the periodic dumps and writes the final one. Returns -1 if it could not be written.
+	int Stop();
+};
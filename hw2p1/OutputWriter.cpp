@@ -0,0 +1,307 @@
+// OutputWriter.cpp
+// CSCE 463-500
+
+#include "pch.h"
+
+static const char* outcome_names[] = { "answered", "timeout", "failed", "invalid", "malformed" };
+static const char* section_names[SECTION_COUNT] = { "question", "answer", "authority", "additional" };
+
+// Creates a writer of the given format writing to output
+OutputWriter::OutputWriter(OutputFormat format, FILE* output) : format(format), output(output)
+{
+	buffer.reserve(OUTPUT_FLUSH_SIZE + MAX_TCP_SIZE);
+}
+
+// Parses the name of a format. Returns false if it is not one.
+bool OutputWriter::ParseFormat(const char* name, OutputFormat& format)
+{
+	static const char* names[] = { "human", "jsonl", "tsv", "binary" };
+	for (int i = 0; i < 4; i++)
+	{
+		if (strcmp(name, names[i]) == 0)
+		{
+			format = (OutputFormat) i;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Writes what a stream of the format starts with: the column names of TSV or the header
+// of the binary format. Returns -1 if it could not be written.
+int OutputWriter::WriteStreamHeader(FILE* output, OutputFormat format)
+{
+	if (format == OUTPUT_TSV)
+	{
+		const char* columns = "lookup\tquestion\tqtype\ttxid\toutcome\trcode\tattempts\tcache\tlatency_ms\tsection\tname\ttype\tttl\tdata\n";
+		return (fputs(columns, output) < 0) ? -1 : 0;
+	}
+	if (format == OUTPUT_BINARY)
+	{
+		OutputHeader header;
+		header.magic = OUTPUT_MAGIC;
+		header.version = OUTPUT_VERSION;
+		header.header_size = sizeof(OutputHeader);
+		return (fwrite(&header, sizeof(header), 1, output) != 1) ? -1 : 0;
+	}
+	return 0;
+}
+
+// Appends text escaped as the format requires (JSON string contents or a TSV field), or as
+// is for the binary format
+void OutputWriter::AppendText(std::string& out, const char* text)
+{
+	static const char* hex = "0123456789abcdef";
+	for (const char* c = text; *c != 0; c++)
+	{
+		UCHAR byte = (UCHAR) *c;
+		if (format == OUTPUT_JSONL && (byte == '"' || byte == '\\'))
+		{
+			out += '\\';
+			out += (char) byte;
+		}
+		else if (format == OUTPUT_JSONL && (byte < 0x20 || byte >= 0x7F))
+		{
+			// labels may hold any byte, which would not always be valid UTF-8
+			char escape[6] = { '\\', 'u', '0', '0', hex[byte >> 4], hex[byte & 15] };
+			out.append(escape, sizeof(escape));
+		}
+		else if (format == OUTPUT_TSV && (byte == '\\' || byte == '\t' || byte == '\n' || byte == '\r'))
+		{
+			out += '\\';
+			out += (byte == '\t') ? 't' : (byte == '\n') ? 'n' : (byte == '\r') ? 'r' : '\\';
+		}
+		else
+			out += (char) byte;
+	}
+}
+
+// Appends an unsigned number in decimal
+void OutputWriter::AppendNumber(std::string& out, ULONGLONG value)
+{
+	char digits[20];
+	int count = 0;
+	do
+	{
+		digits[count++] = (char) ('0' + value % 10);
+		value /= 10;
+	} while (value > 0);
+	while (count > 0)
+		out += digits[--count];
+}
+
+// Appends the lookup part of an entry: everything up to its records. Returns the offset in
+// the buffer the record count of the binary format is at.
+size_t OutputWriter::BeginLookup(const char* lookup, PendingQuery* query, LookupOutcome outcome, int rcode, ULONGLONG latency_us)
+{
+	const char* question = (query != NULL) ? query->question : "";
+	USHORT qtype = (query != NULL) ? (USHORT) query->type : 0;
+	USHORT txid = (query != NULL) ? query->txid : 0;
+	int attempts = (query != NULL) ? query->attempts : 0;
+	bool from_cache = (query != NULL) && query->from_cache;
+
+	if (format == OUTPUT_BINARY)
+	{
+		AppendStruct(buffer, (UINT) 0);
+		OutputLookup entry;
+		entry.qtype = qtype;
+		entry.txid = txid;
+		entry.outcome = (UCHAR) outcome;
+		entry.rcode = (rcode >= 0) ? (UCHAR) rcode : 0xFF;
+		entry.attempts = (UCHAR) attempts;
+		entry.from_cache = from_cache ? 1 : 0;
+		entry.latency_us = (latency_us < 0xFFFFFFFF) ? (UINT) latency_us : 0xFFFFFFFF;
+		entry.records = 0;
+		entry.lookup_size = (USHORT) strlen(lookup);
+		entry.question_size = (USHORT) strlen(question);
+		size_t count_offset = buffer.size() + offsetof(OutputLookup, records);
+		AppendStruct(buffer, entry);
+		buffer.append(lookup, entry.lookup_size);
+		buffer.append(question, entry.question_size);
+		return count_offset;
+	}
+
+	// TSV repeats the columns of the lookup on each line, JSON writes them once
+	std::string& out = (format == OUTPUT_TSV) ? prefix : buffer;
+	const char* separator = (format == OUTPUT_TSV) ? "\t" : ",";
+	if (format == OUTPUT_TSV)
+		prefix.clear();
+	else
+		out += "{\"lookup\":\"";
+	AppendText(out, lookup);
+	out += (format == OUTPUT_TSV) ? "\t" : "\",\"question\":\"";
+	AppendText(out, question);
+	out += (format == OUTPUT_TSV) ? "\t" : "\",\"qtype\":";
+	AppendNumber(out, qtype);
+	out += (format == OUTPUT_TSV) ? "\t" : ",\"txid\":";
+	AppendNumber(out, txid);
+	out += (format == OUTPUT_TSV) ? "\t" : ",\"outcome\":\"";
+	out += outcome_names[outcome];
+	out += (format == OUTPUT_TSV) ? "\t" : "\",\"rcode\":";
+	if (rcode >= 0)
+		AppendNumber(out, rcode);
+	else if (format == OUTPUT_JSONL)
+		out += "null";
+	out += (format == OUTPUT_TSV) ? "\t" : ",\"attempts\":";
+	AppendNumber(out, attempts);
+	out += (format == OUTPUT_TSV) ? (from_cache ? "\t1" : "\t0") : (from_cache ? ",\"cache\":true" : ",\"cache\":false");
+	out += separator;
+	if (format == OUTPUT_JSONL)
+		out += "\"latency_ms\":";
+
+	// milliseconds with three decimals
+	AppendNumber(out, latency_us / 1000);
+	out += '.';
+	out += (char) ('0' + latency_us / 100 % 10);
+	out += (char) ('0' + latency_us / 10 % 10);
+	out += (char) ('0' + latency_us % 10);
+	if (format == OUTPUT_JSONL)
+		out += ",\"records\":[";
+	return 0;
+}
+
+// Appends a record of the lookup begun last, 'count' records have been appended before it
+void OutputWriter::AppendRecord(int count, DNSSection section, USHORT type, UINT ttl, const char* name, const char* data)
+{
+	const char* type_name = (type == DNS_A) ? "A" : (type == DNS_AAAA) ? "AAAA" : (type == DNS_NS) ? "NS" :
+		(type == DNS_CNAME) ? "CNAME" : "PTR";
+
+	if (format == OUTPUT_BINARY)
+	{
+		OutputRecord record;
+		record.type = type;
+		record.section = (UCHAR) section;
+		record.reserved = 0;
+		record.ttl = ttl;
+		record.name_size = (USHORT) strlen(name);
+		record.data_size = (USHORT) strlen(data);
+		AppendStruct(buffer, record);
+		buffer.append(name, record.name_size);
+		buffer.append(data, record.data_size);
+	}
+	else if (format == OUTPUT_TSV)
+	{
+		buffer += prefix;
+		buffer += '\t';
+		buffer += section_names[section];
+		buffer += '\t';
+		AppendText(buffer, name);
+		buffer += '\t';
+		buffer += type_name;
+		buffer += '\t';
+		AppendNumber(buffer, ttl);
+		buffer += '\t';
+		AppendText(buffer, data);
+		buffer += '\n';
+	}
+	else
+	{
+		buffer += (count > 0) ? ",{\"section\":\"" : "{\"section\":\"";
+		buffer += section_names[section];
+		buffer += "\",\"name\":\"";
+		AppendText(buffer, name);
+		buffer += "\",\"type\":\"";
+		buffer += type_name;
+		buffer += "\",\"ttl\":";
+		AppendNumber(buffer, ttl);
+		buffer += ",\"data\":\"";
+		AppendText(buffer, data);
+		buffer += "\"}";
+	}
+}
+
+// Completes the lookup begun at offset 'start' with 'count' records
+void OutputWriter::EndLookup(size_t start, size_t count_offset, int count)
+{
+	if (format == OUTPUT_BINARY)
+	{
+		UINT size = (UINT) (buffer.size() - start - sizeof(UINT));
+		USHORT records = (USHORT) count;
+		memcpy(&buffer[start], &size, sizeof(size));
+		memcpy(&buffer[count_offset], &records, sizeof(records));
+	}
+	else if (format == OUTPUT_TSV && count == 0)
+	{
+		buffer += prefix;
+		buffer += "\t\t\t\t\t\n";
+	}
+	else if (format == OUTPUT_JSONL)
+		buffer += "]}\n";
+}
+
+// Adds the outcome of a lookup (a response, or NULL and 0 on timeout, -1 on error) to the
+// buffer. Returns -1 if the lookup failed, was answered with an error or the response is
+// malformed, or 0 otherwise.
+int OutputWriter::WriteLookup(PendingQuery& query, char* buf, int response_size)
+{
+	ULONGLONG latency_us = query.from_cache ? 0 : std::chrono::duration_cast<std::chrono::microseconds>
+		(std::chrono::steady_clock::now() - query.submit_time).count();
+	size_t start = buffer.size();
+	if (response_size <= 0 || response_size < (int) sizeof(DNSHeader))
+	{
+		LookupOutcome outcome = (response_size == 0) ? OUTCOME_TIMEOUT : (response_size < 0) ? OUTCOME_FAILED : OUTCOME_MALFORMED;
+		size_t count_offset = BeginLookup(query.lookup, &query, outcome, -1, latency_us);
+		EndLookup(start, count_offset, 0);
+		return -1;
+	}
+
+	int rcode = ((DNSHeader*) buf)->result;
+	size_t count_offset = BeginLookup(query.lookup, &query, OUTCOME_ANSWERED, rcode, latency_us);
+
+	char name[MAX_DNS_SIZE], data[MAX_DNS_SIZE];
+	DNSMessage message(buf, response_size);
+	DNSRecord record;
+	int count = 0;
+	int error = PARSE_OK;
+	while (error == PARSE_OK && message.Next(record))
+	{
+		if (record.section == SECTION_QUESTION || (record.type != DNS_A && record.type != DNS_AAAA && record.type != DNS_NS
+			&& record.type != DNS_CNAME && record.type != DNS_PTR))
+			continue;
+
+		error = record.name.Decode(name, MAX_DNS_SIZE);
+		if (error != PARSE_OK)
+			break;
+		if (record.type == DNS_A || record.type == DNS_AAAA)
+		{
+			int family = (record.type == DNS_A) ? AF_INET : AF_INET6;
+			if (record.rdlength != ((record.type == DNS_A) ? 4 : 16) || inet_ntop(family, (void*) record.rdata, data, MAX_DNS_SIZE) == NULL)
+				error = PARSE_BAD_RDATA;
+		}
+		else
+			error = record.RdataName().Decode(data, MAX_DNS_SIZE);
+
+		if (error == PARSE_OK)
+			AppendRecord(count++, record.section, record.type, record.ttl, name, data);
+	}
+
+	// a malformed response replaces what was written of it
+	if (error != PARSE_OK || message.Error() != PARSE_OK)
+	{
+		buffer.resize(start);
+		count_offset = BeginLookup(query.lookup, &query, OUTCOME_MALFORMED, rcode, latency_us);
+		EndLookup(start, count_offset, 0);
+		return -1;
+	}
+	EndLookup(start, count_offset, count);
+	return (rcode == DNS_OK) ? 0 : -1;
+}
+
+// Adds a lookup that could not be encoded as a DNS question to the buffer
+void OutputWriter::WriteInvalid(const char* lookup)
+{
+	size_t start = buffer.size();
+	size_t count_offset = BeginLookup(lookup, NULL, OUTCOME_INVALID, -1, 0);
+	EndLookup(start, count_offset, 0);
+}
+
+// Writes the buffer to the output. Returns -1 if it could not be written.
+int OutputWriter::Flush()
+{
+	if (buffer.empty())
+		return 0;
+	size_t written = fwrite(buffer.data(), 1, buffer.size(), output);
+	bool complete = (written == buffer.size());
+	buffer.clear();
+	return (complete && fflush(output) == 0) ? 0 : -1;
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#define OUTPUT_MAGIC    0x4F534E44 /* "DNSO" in host byte order */
+#define OUTPUT_VERSION  1
+
+// Formats the outcome of batch lookups can be written in
+enum OutputFormat
+{
+	OUTPUT_HUMAN,
+	OUTPUT_JSONL,
+	OUTPUT_TSV,
+	OUTPUT_BINARY
+};
+
+// What became of a lookup in the machine-readable formats
+enum LookupOutcome
+{
+	OUTCOME_ANSWERED,
+	OUTCOME_TIMEOUT,
+	OUTCOME_FAILED,
+	OUTCOME_INVALID,
+	OUTCOME_MALFORMED
+};
+
+#pragma pack(push, 1)
+// Start of a binary output stream, followed by one length-prefixed lookup after another
+struct OutputHeader
+{
+	UINT magic;
+	USHORT version;
+	USHORT header_size;
+};
+
+// A lookup of the binary format. Preceded by the size (UINT) of the lookup and its records and
+// followed by its text, its question as dotted text, and its records. Host byte order throughout.
+struct OutputLookup
+{
+	USHORT qtype;
+	USHORT txid;
+	UCHAR outcome;
+	UCHAR rcode;
+	UCHAR attempts;
+	UCHAR from_cache;
+	UINT latency_us;
+	USHORT records;
+	USHORT lookup_size;
+	USHORT question_size;
+};
+
+// A record of a lookup of the binary format, followed by its owner name and its data as text
+struct OutputRecord
+{
+	USHORT type;
+	UCHAR section;
+	UCHAR reserved;
+	UINT ttl;
+	USHORT name_size;
+	USHORT data_size;
+};
+#pragma pack(pop)
+
+/*
+ * The OutputWriter class writes the outcome of every batch lookup in a machine-readable format:
+ * JSON Lines (one object per lookup with an array of its records), TSV (one line per record,
+ * or one for a lookup without any) or a compact binary stream of length-prefixed lookups. The
+ * A, AAAA, NS, CNAME and PTR records of the answer, authority and additional sections are
+ * written, with names and addresses as text. Lookups are formatted into a reusable buffer that
+ * is only written out once it holds OUTPUT_FLUSH_SIZE bytes, so a batch costs a few large writes
+ * instead of several small ones per lookup. A lookup is never split between two writes, which
+ * lets the writers of several threads share one stream.
+ */
+class OutputWriter
+{
+	OutputFormat format;
+	FILE* output;
+	std::string buffer;
+
+	// Columns of the lookup that TSV repeats on each of its lines
+	std::string prefix;
+
+	// Appends text escaped as the format requires (JSON string contents or a TSV field), or as
+	// is for the binary format
+	void AppendText(std::string& out, const char* text);
+
+	// Appends an unsigned number in decimal
+	static void AppendNumber(std::string& out, ULONGLONG value);
+
+	// Appends a binary structure
+	template <typename T> static void AppendStruct(std::string& out, const T& value)
+	{
+		out.append((const char*) &value, sizeof(T));
+	}
+
+	// Appends the lookup part of an entry: everything up to its records. Returns the offset in
+	// the buffer the record count of the binary format is at.
+	size_t BeginLookup(const char* lookup, PendingQuery* query, LookupOutcome outcome, int rcode, ULONGLONG latency_us);
+
+	// Appends a record of the lookup begun last, 'count' records have been appended before it
+	void AppendRecord(int count, DNSSection section, USHORT type, UINT ttl, const char* name, const char* data);
+
+	// Completes the lookup begun at offset 'start' with 'count' records
+	void EndLookup(size_t start, size_t count_offset, int count);
+
+public:
+
+	// Creates a writer of the given format writing to output
+	OutputWriter(OutputFormat format, FILE* output);
+
+	// Parses the name of a format. Returns false if it is not one.
+	static bool ParseFormat(const char* name, OutputFormat& format);
+
+	// Writes what a stream of the format starts with: the column names of TSV or the header
+	// of the binary format. Returns -1 if it could not be written.
+	static int WriteStreamHeader(FILE* output, OutputFormat format);
+
+	// Adds the outcome of a lookup (a response, or NULL and 0 on timeout, -1 on error) to the
+	// buffer. Returns -1 if the lookup failed, was answered with an error or the response is
+	// malformed, or 0 otherwise.
+	int WriteLookup(PendingQuery& query, char* buf, int response_size);
+
+	// Adds a lookup that could not be encoded as a DNS question to the buffer
+	void WriteInvalid(const char* lookup);
+
+	// Returns true once the buffer should be written out
+	bool Full() { return buffer.size() >= OUTPUT_FLUSH_SIZE; }
+
+	// Writes the buffer to the output. Returns -1 if it could not be written.
+	int Flush();
+};
@@ -0,0 +1,284 @@
+// ParserBench.cpp
+// CSCE 463-500
+
+#include "pch.h"
+
+// Returns a query for name of the given type, with an OPT record if edns is set
+std::string ParserBench::MakeQuery(const char* name, USHORT type, bool edns)
+{
+	DNSHeader header;
+	memset(&header, 0, sizeof(header));
+	header.ID = htons(0x1234);
+	header.RD = 1;
+	header.questions = htons(1);
+	header.additional = htons(edns ? 1 : 0);
+	std::string query((char*) &header, sizeof(header));
+
+	// dotted name to labels, without checks: the names are fixed below
+	const char* label = name;
+	while (*label != 0)
+	{
+		const char* dot = strchr(label, '.');
+		size_t length = (dot != NULL) ? (size_t) (dot - label) : strlen(label);
+		query += (char) length;
+		query.append(label, length);
+		label += length + ((dot != NULL) ? 1 : 0);
+	}
+	query += (char) 0;
+
+	QueryHeader qheader;
+	qheader.qType = htons(type);
+	qheader.qClass = htons(DNS_INET);
+	query.append((char*) &qheader, sizeof(qheader));
+
+	if (edns)
+	{
+		char opt[11] = { 0, 0, DNS_OPT, (char) (MAX_UDP_SIZE >> 8), (char) (MAX_UDP_SIZE & 0xFF), 0, 0, 0, 0, 0, 0 };
+		query.append(opt, sizeof(opt));
+	}
+	return query;
+}
+
+// Adds the response of a fake server with the given settings to a query for name
+void ParserBench::AddResponse(std::vector<CorpusMessage>& corpus, const char* label, const char* name,
+	USHORT type, bool edns, const char* settings)
+{
+	FakeConfig config;
+	config.Parse(settings);
+	FakeServer server;
+	server.Configure(config);
+
+	std::string query = MakeQuery(name, type, edns);
+	std::vector<char> reply(MAX_TCP_SIZE);
+	int size = server.Respond(query.data(), (int) query.size(), false, reply.data());
+
+	CorpusMessage message;
+	message.name = label;
+	message.data.assign(reply.data(), (size > 0) ? size : 0);
+	corpus.push_back(message);
+}
+
+// Fills corpus with the well-formed and malformed responses described above
+void ParserBench::Synthetic(std::vector<CorpusMessage>& corpus)
+{
+	const char* ip6_name = "1.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.8.b.d.0.1.0.0.2.ip6.arpa";
+	AddResponse(corpus, "a-1", "www.example.com", DNS_A, true, "answers=1");
+	AddResponse(corpus, "a-8", "www.example.com", DNS_A, true, "answers=8");
+	AddResponse(corpus, "a-32-uncompressed", "www.example.com", DNS_A, true, "answers=32,compress=off");
+	AddResponse(corpus, "a-16-chain", "www.example.com", DNS_A, true, "answers=16,compress=chain");
+	AddResponse(corpus, "a-4-padded", "www.example.com", DNS_A, true, "answers=4,size=1200");
+	AddResponse(corpus, "ptr-8", "4.3.2.1.in-addr.arpa", DNS_PTR, false, "answers=8");
+	AddResponse(corpus, "ptr-ip6-8-chain", ip6_name, DNS_PTR, false, "answers=8,compress=chain");
+	AddResponse(corpus, "truncated-tc", "www.example.com", DNS_A, false, "answers=1,truncate=100");
+
+	// the malformed responses are made from a plain one: header, question, then one A record
+	// whose owner is a pointer to the question
+	AddResponse(corpus, "base", "www.example.com", DNS_A, false, "answers=1");
+	std::string base = corpus.back().data;
+	corpus.pop_back();
+	size_t answer = base.size() - sizeof(ResourceRecord) - 2 - sizeof(DWORD);
+	auto add = [&corpus](const char* label, std::string data)
+	{
+		CorpusMessage message;
+		message.name = label;
+		message.data = data;
+		corpus.push_back(message);
+	};
+
+	add("short-header", base.substr(0, sizeof(DNSHeader) - 5));
+	add("truncated-question", base.substr(0, sizeof(DNSHeader) + 6));
+	add("truncated-record", base.substr(0, answer + 7));
+
+	std::string oversized = base;
+	oversized[answer + 10] = (char) 0xFF;
+	oversized[answer + 11] = (char) 0xFF;
+	add("rdata-beyond-message", oversized);
+
+	std::string short_rdata = base;
+	short_rdata[answer + 11] = 3;
+	add("a-rdata-too-short", short_rdata);
+
+	std::string self_loop = base;
+	self_loop[answer] = (char) (0xC0 | (answer >> 8));
+	self_loop[answer + 1] = (char) (answer & 0xFF);
+	add("compression-self-loop", self_loop);
+
+	std::string forward = base;
+	forward[answer + 1] = (char) ((answer + 12) & 0xFF);
+	add("compression-forward", forward);
+
+	std::string into_header = base;
+	into_header[answer + 1] = 2;
+	add("compression-into-header", into_header);
+
+	std::string beyond = base;
+	beyond[answer] = (char) 0xFF;
+	beyond[answer + 1] = (char) 0xFF;
+	add("compression-beyond", beyond);
+
+	// the question name points at a pointer that points back at it
+	std::string loop = base.substr(0, sizeof(DNSHeader));
+	loop[7] = 0;
+	loop += std::string("\xC0\x0E\xC0\x0C\x00\x01\x00\x01", 8);
+	add("compression-two-step-loop", loop);
+
+	std::string bad_label = base;
+	bad_label[sizeof(DNSHeader)] = 0x41;
+	add("label-type-reserved", bad_label);
+
+	// 128 one-character labels make a name over MAX_NAME_SIZE characters
+	std::string long_name = base.substr(0, sizeof(DNSHeader));
+	long_name[7] = 0;
+	for (int i = 0; i < 128; i++)
+		long_name += std::string("\1a", 2);
+	long_name += std::string("\0\0\1\0\1", 5);
+	add("name-too-long", long_name);
+
+	std::string count_overflow = base;
+	count_overflow[6] = (char) 0xFF;
+	count_overflow[7] = (char) 0xFF;
+	add("answer-count-beyond", count_overflow);
+}
+
+// Reads every file of a directory into corpus, in order of name. Returns the number of
+// messages read or -1 if the directory cannot be listed.
+int ParserBench::LoadCorpus(const char* directory, std::vector<CorpusMessage>& corpus)
+{
+	WIN32_FIND_DATAA found;
+	HANDLE find = FindFirstFileA((std::string(directory) + "/*").c_str(), &found);
+	if (find == INVALID_HANDLE_VALUE)
+		return -1;
+
+	std::vector<std::string> names;
+	do
+	{
+		if ((found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+			names.push_back(found.cFileName);
+	} while (FindNextFileA(find, &found));
+	FindClose(find);
+	std::sort(names.begin(), names.end());
+
+	int loaded = 0;
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		FILE* input = NULL;
+		if (fopen_s(&input, (std::string(directory) + "/" + names[i]).c_str(), "rb") != 0)
+			continue;
+
+		// a message longer than a TCP message cannot have been received, the rest is ignored
+		CorpusMessage message;
+		message.name = names[i];
+		message.data.resize(MAX_TCP_SIZE);
+		message.data.resize(fread(&message.data[0], 1, MAX_TCP_SIZE, input));
+		fclose(input);
+		corpus.push_back(message);
+		loaded++;
+	}
+	return loaded;
+}
+
+// Writes the synthetic corpus to a directory, one file per message, as the seed corpus of
+// the fuzzer. Returns the number of files written or -1 if one could not be written.
+int ParserBench::WriteCorpus(const char* directory)
+{
+	CreateDirectoryA(directory, NULL);
+	std::vector<CorpusMessage> corpus;
+	Synthetic(corpus);
+
+	for (size_t i = 0; i < corpus.size(); i++)
+	{
+		char file_name[MAX_PATH];
+		sprintf_s(file_name, MAX_PATH, "%s/%02zu-%s.bin", directory, i, corpus[i].name.c_str());
+		FILE* output = NULL;
+		if (fopen_s(&output, file_name, "wb") != 0)
+			return -1;
+		size_t written = fwrite(corpus[i].data.data(), 1, corpus[i].data.size(), output);
+		if (fclose(output) != 0 || written != corpus[i].data.size())
+			return -1;
+	}
+	return (int) corpus.size();
+}
+
+// Runs every parser entry point over a message: the checks of the resolver, decoding and
+// expanding every name, reading EDNS and skipping names. Returns a checksum of the results
+// so that none of the work can be left out.
+int ParserBench::Exercise(const char* buf, int size)
+{
+	int checksum = DNSResolver::CheckResponse(buf, size);
+
+	char text[MAX_DNS_SIZE], wire[MAX_NAME_SIZE];
+	DNSMessage message(buf, size);
+	DNSRecord record;
+	EDNSInfo edns;
+	while (message.Next(record))
+	{
+		checksum += record.name.Decode(text, MAX_DNS_SIZE) + record.name.Expand(wire, MAX_NAME_SIZE);
+		if (record.type == DNS_PTR || record.type == DNS_CNAME || record.type == DNS_NS)
+			checksum += record.RdataName().Decode(text, MAX_DNS_SIZE) + record.RdataName().Expand(wire, MAX_NAME_SIZE);
+		if (record.ReadEDNS(edns))
+			checksum += edns.payload_size;
+	}
+	checksum += message.Error() + DNSMessage::FindEDNS(buf, size, edns);
+	if (size > (int) sizeof(DNSHeader))
+		checksum += DNSMessage::SkipName(buf, size, sizeof(DNSHeader));
+
+	// the cache rewrites TTLs in place, so it gets a copy
+	std::vector<char> copy(buf, buf + size);
+	UINT min_ttl = 0;
+	int soa_offset = -1;
+	checksum += DNSCache::ScanRecords(copy.data(), size, 1, min_ttl, soa_offset) + (int) min_ttl + soa_offset;
+	return checksum;
+}
+
+// Parses every message of the corpus read from directory (or the synthetic one if it is NULL)
+// 'iterations' times and prints the time per message and per record of each and of all.
+// Returns -1 if the corpus could not be read or 0 otherwise.
+int ParserBench::Run(const char* directory, int iterations)
+{
+	std::vector<CorpusMessage> corpus;
+	if (directory == NULL)
+		Synthetic(corpus);
+	else if (LoadCorpus(directory, corpus) <= 0)
+	{
+		printf("error: no messages could be read from %s\n", directory);
+		return -1;
+	}
+
+	printf("Corpus  : %zu messages from %s, %d iterations each\n", corpus.size(), (directory != NULL) ? directory : "the synthetic set", iterations);
+	printf("********************************\n");
+	double total_ns = 0;
+	long long total_records = 0;
+	int checksum = 0;
+	for (size_t i = 0; i < corpus.size(); i++)
+	{
+		// an exact-size copy, as a received message would be
+		std::vector<char> buf(corpus[i].data.begin(), corpus[i].data.end());
+		const char* data = buf.empty() ? "" : buf.data();
+		int size = (int) buf.size();
+
+		// records read before the end of the message or the first error
+		int records = 0;
+		DNSMessage message(data, size);
+		DNSRecord record;
+		while (message.Next(record))
+			records++;
+		int status = DNSResolver::CheckResponse(data, size);
+
+		auto start = std::chrono::steady_clock::now();
+		for (int n = 0; n < iterations; n++)
+			checksum += DNSResolver::CheckResponse(data, size);
+		double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		total_ns += ns;
+		total_records += records;
+
+		printf("Parse   : %-28s %5d bytes, %3d records, %-9s %8.1f ns/message, %6.1f ns/record\n", corpus[i].name.c_str(), size,
+			records, (status == 0) ? "valid," : (message.Error() != PARSE_OK) ? "malformed," : "rejected,", ns / iterations,
+			(records > 0) ? ns / iterations / records : 0.0);
+	}
+
+	printf("********************************\n");
+	printf("Parse   : %zu messages, %lld records, %.1f ns/message, %.1f ns/record on average (checksum %d)\n", corpus.size(),
+		total_records, (corpus.size() > 0) ? total_ns / iterations / corpus.size() : 0.0,
+		(total_records > 0) ? total_ns / iterations / total_records : 0.0, checksum);
+	return 0;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+// A response the parser is run on, named after what it covers or the file it was read from
+struct CorpusMessage
+{
+	std::string name;
+	std::string data;
+};
+
+/*
+ * The ParserBench class measures the response parser (DNSMessage and DNSName, through
+ * DNSResolver::CheckResponse) on a corpus of messages and reports the time taken per message
+ * and per record. The corpus is either read from a directory of captured responses, one per
+ * file, or made up: well-formed responses of the fake server in every compression mode, and
+ * malformed ones covering compression loops, bad pointers, truncated headers, questions and
+ * records, oversized rdata and overlong names. The same corpus seeds the fuzzer entry point
+ * in ParserFuzz.cpp, which runs every parser entry point on arbitrary input.
+ */
+class ParserBench
+{
+	// Returns a query for name of the given type, with an OPT record if edns is set
+	static std::string MakeQuery(const char* name, USHORT type, bool edns);
+
+	// Adds the response of a fake server with the given settings to a query for name
+	static void AddResponse(std::vector<CorpusMessage>& corpus, const char* label, const char* name,
+		USHORT type, bool edns, const char* settings);
+
+public:
+
+	// Fills corpus with the well-formed and malformed responses described above
+	static void Synthetic(std::vector<CorpusMessage>& corpus);
+
+	// Reads every file of a directory into corpus, in order of name. Returns the number of
+	// messages read or -1 if the directory cannot be listed.
+	static int LoadCorpus(const char* directory, std::vector<CorpusMessage>& corpus);
+
+	// Writes the synthetic corpus to a directory, one file per message, as the seed corpus of
+	// the fuzzer. Returns the number of files written or -1 if one could not be written.
+	static int WriteCorpus(const char* directory);
+
+	// Runs every parser entry point over a message: the checks of the resolver, decoding and
+	// expanding every name, reading EDNS and skipping names. Returns a checksum of the results
+	// so that none of the work can be left out.
+	static int Exercise(const char* buf, int size);
+
+	// Parses every message of the corpus read from directory (or the synthetic one if it is NULL)
+	// 'iterations' times and prints the time per message and per record of each and of all.
+	// Returns -1 if the corpus could not be read or 0 otherwise.
+	static int Run(const char* directory, int iterations);
+};
@@ -0,0 +1,26 @@
+// ParserFuzz.cpp
+// CSCE 463-500
+
+#include "pch.h"
+
+// Only built into fuzzing builds, which link libFuzzer's main instead of the one in Driver.cpp:
+//   clang-cl /DDNS_FUZZER /fsanitize=fuzzer,address *.cpp ws2_32.lib
+// Run it on the seed corpus written by "Driver.exe -writecorpus <dir>":
+//   hw2p1.exe <dir>
+#ifdef DNS_FUZZER
+
+// Entry point of libFuzzer, runs every parser entry point over one input
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	if (size > MAX_TCP_SIZE)
+		return 0;
+
+	// an exact-size copy, so that any read past the end of the message is caught by the sanitizer
+	std::unique_ptr<char[]> buf(new char[(size > 0) ? size : 1]);
+	if (size > 0)
+		memcpy(buf.get(), data, size);
+	ParserBench::Exercise(buf.get(), (int) size);
+	return 0;
+}
+
+#endif
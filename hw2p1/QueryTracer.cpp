@@ -0,0 +1,205 @@
+// QueryTracer.cpp
+// CSCE 463-500
+
+#include "pch.h"
+
+// Time every trace is relative to, shared by the resolvers of a process
+const std::chrono::steady_clock::time_point QueryTracer::origin = std::chrono::steady_clock::now();
+
+// Creates a ring of 'records' records for the resolver of the given worker thread
+QueryTracer::QueryTracer(int records, int worker) : ring(records), worker((USHORT) worker)
+{
+}
+
+// Returns the ticks from 'from' to 'to', TRACE_NONE if 'to' was not reached
+UINT QueryTracer::Ticks(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to)
+{
+	if (to == std::chrono::steady_clock::time_point())
+		return TRACE_NONE;
+	if (to < from)
+		return 0;
+	ULONGLONG ticks = std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count() / TRACE_TICK_NS;
+	return (ticks < TRACE_NONE) ? (UINT) ticks : TRACE_NONE - 1;
+}
+
+// Records a completed lookup. A phase whose time is the default time point was not reached.
+void QueryTracer::Record(PendingQuery& query, std::chrono::steady_clock::time_point encode, std::chrono::steady_clock::time_point enqueue,
+	std::chrono::steady_clock::time_point complete, char* buf, int response_size, UCHAR flags)
+{
+	TraceRecord& record = ring[recorded % ring.size()];
+	recorded++;
+
+	record.encode = std::chrono::duration_cast<std::chrono::nanoseconds>(encode - origin).count() / TRACE_TICK_NS;
+	record.enqueue = Ticks(encode, enqueue);
+
+	// a lookup that joined another was never sent itself
+	record.send = (flags & TRACE_JOINED) ? TRACE_NONE : Ticks(encode, query.send_time);
+	record.receive = Ticks(encode, query.receive_time);
+	record.parse = Ticks(encode, query.parse_time);
+	record.complete = Ticks(encode, complete);
+
+	record.txid = query.txid;
+	record.type = (USHORT) query.type;
+	record.response_size = (response_size > 0) ? (USHORT) response_size : 0;
+	record.worker = worker;
+	record.attempts = (UCHAR) query.attempts;
+	record.upstream = (query.upstream >= 0 && !(flags & TRACE_CACHE_HIT)) ? (UCHAR) query.upstream : 0xFF;
+	record.rcode = (response_size >= (int) sizeof(DNSHeader)) ? (UCHAR) ((DNSHeader*) buf)->result : 0;
+	if (query.tcp)
+		flags |= TRACE_TCP;
+	if (query.prefetch)
+		flags |= TRACE_PREFETCH;
+	if (response_size == 0)
+		flags |= TRACE_TIMEOUT;
+	else if (response_size < 0)
+		flags |= TRACE_ERROR;
+	record.flags = flags;
+}
+
+// Saves the rings of the given tracers to path. Returns the number of records saved or -1
+// if the file could not be written.
+int QueryTracer::Save(const char* path, std::vector<QueryTracer*>& tracers)
+{
+	TraceHeader header;
+	header.magic = TRACE_MAGIC;
+	header.version = TRACE_VERSION;
+	header.header_size = sizeof(TraceHeader);
+	header.record_size = sizeof(TraceRecord);
+	header.tick_ns = TRACE_TICK_NS;
+	header.records = 0;
+	for (size_t i = 0; i < tracers.size(); i++)
+		header.records += (UINT) std::min<ULONGLONG>(tracers[i]->recorded, tracers[i]->ring.size());
+
+	FILE* output = NULL;
+	if (fopen_s(&output, path, "wb") != 0)
+		return -1;
+	bool failed = fwrite(&header, sizeof(header), 1, output) != 1;
+
+	// a ring that wrapped around starts at its oldest record, the next to be overwritten
+	for (size_t i = 0; i < tracers.size() && !failed; i++)
+	{
+		QueryTracer& tracer = *tracers[i];
+		size_t size = tracer.ring.size();
+		size_t count = (size_t) std::min<ULONGLONG>(tracer.recorded, size);
+		size_t oldest = (tracer.recorded > size) ? (size_t) (tracer.recorded % size) : 0;
+		size_t first_part = std::min(count, size - oldest);
+		failed = fwrite(&tracer.ring[oldest], sizeof(TraceRecord), first_part, output) != first_part
+			|| fwrite(tracer.ring.data(), sizeof(TraceRecord), count - first_part, output) != count - first_part;
+	}
+	if (fclose(output) != 0 || failed)
+		return -1;
+	return (int) header.records;
+}
+
+// Returns the ticks a lookup spent in a phase (0 to 4, or 5 for all of them) from the last point
+// it reached before the end of the phase, TRACE_NONE if it did not reach the end
+UINT QueryTracer::PhaseTime(TraceRecord& record, int phase)
+{
+	UINT points[6] = { 0, record.enqueue, record.send, record.receive, record.parse, record.complete };
+	int end = (phase == 5) ? 5 : phase + 1;
+	if (points[end] == TRACE_NONE)
+		return TRACE_NONE;
+	int start = (phase == 5) ? 0 : phase;
+	while (points[start] == TRACE_NONE)
+		start--;
+	return (points[end] >= points[start]) ? points[end] - points[start] : 0;
+}
+
+// Reads a trace file and prints the count of every outcome, the percentiles of the time taken
+// by every phase, and the slowest lookups. Returns -1 if the file is not a trace or 0 otherwise.
+int QueryTracer::Report(const char* path)
+{
+	FILE* input = NULL;
+	if (fopen_s(&input, path, "rb") != 0)
+	{
+		printf("error: unable to open trace file '%s'\n", path);
+		return -1;
+	}
+
+	TraceHeader header;
+	std::vector<TraceRecord> records;
+	bool valid = fread(&header, sizeof(header), 1, input) == 1 && header.magic == TRACE_MAGIC && header.version == TRACE_VERSION
+		&& header.header_size == sizeof(TraceHeader) && header.record_size == sizeof(TraceRecord) && header.tick_ns > 0;
+
+	// the record count comes from the file, a corrupt one must not decide how much is allocated
+	long long offset = valid ? _ftelli64(input) : -1;
+	valid = valid && offset >= 0 && _fseeki64(input, 0, SEEK_END) == 0
+		&& (ULONGLONG) header.records * sizeof(TraceRecord) <= (ULONGLONG) (_ftelli64(input) - offset)
+		&& _fseeki64(input, offset, SEEK_SET) == 0;
+	if (valid)
+	{
+		records.resize(header.records);
+		valid = fread(records.data(), sizeof(TraceRecord), records.size(), input) == records.size();
+	}
+	fclose(input);
+	if (!valid)
+	{
+		printf("error: '%s' is not a trace file written by this version\n", path);
+		return -1;
+	}
+
+	int cache_hits = 0, joined = 0, tcp = 0, timeouts = 0, errors = 0, prefetches = 0, workers = 0;
+	for (size_t i = 0; i < records.size(); i++)
+	{
+		UCHAR flags = records[i].flags;
+		cache_hits += (flags & TRACE_CACHE_HIT) ? 1 : 0;
+		joined += (flags & TRACE_JOINED) ? 1 : 0;
+		tcp += (flags & TRACE_TCP) ? 1 : 0;
+		timeouts += (flags & TRACE_TIMEOUT) ? 1 : 0;
+		errors += (flags & TRACE_ERROR) ? 1 : 0;
+		prefetches += (flags & TRACE_PREFETCH) ? 1 : 0;
+		workers = std::max(workers, records[i].worker + 1);
+	}
+	printf("Trace   : %zu lookups from %d worker%s in %s\n", records.size(), workers, (workers == 1) ? "" : "s", path);
+	printf("Outcome : %d cache hits, %d joined another lookup, %d over TCP, %d timed out, %d failed, %d prefetches\n",
+		cache_hits, joined, tcp, timeouts, errors, prefetches);
+	printf("********************************\n");
+
+	// every phase ends at a point of the lookup and runs from the last point the lookup reached
+	// before it, so the check of a cache hit is its lookup and the wire time of a lookup that
+	// joined another is the time it waited
+	static const char* phase_names[] = { "encode", "send", "wire", "check", "callback", "total" };
+	double tick_us = header.tick_ns / 1000.0;
+	for (int phase = 0; phase < 6; phase++)
+	{
+		std::vector<UINT> times;
+		for (size_t i = 0; i < records.size(); i++)
+		{
+			UINT duration = PhaseTime(records[i], phase);
+			if (duration != TRACE_NONE)
+				times.push_back(duration);
+		}
+		if (times.empty())
+			continue;
+
+		std::sort(times.begin(), times.end());
+		size_t count = times.size();
+		printf("Phase   : %-8s p50 %10.1f us, p99 %10.1f us, p99.9 %10.1f us, max %10.1f us over %zu lookups\n", phase_names[phase],
+			times[(count - 1) / 2] * tick_us, times[(count - 1) * 99 / 100] * tick_us, times[(count - 1) * 999 / 1000] * tick_us,
+			times[count - 1] * tick_us, count);
+	}
+
+	// the slowest lookups, phase by phase
+	std::vector<size_t> order(records.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+	auto total = [&records](size_t i) { return (records[i].complete == TRACE_NONE) ? 0 : records[i].complete; };
+	size_t slowest = std::min<size_t>(TRACE_SLOWEST, order.size());
+	std::partial_sort(order.begin(), order.begin() + slowest, order.end(), [&total](size_t a, size_t b) { return total(a) > total(b); });
+
+	printf("********************************\n");
+	for (size_t n = 0; n < slowest; n++)
+	{
+		TraceRecord& record = records[order[n]];
+		printf("Slowest : worker %d, TXID 0x%.4X, type %d, %d attempts, server %d, rcode %d, flags 0x%.2X:", record.worker, record.txid,
+			record.type, record.attempts, (record.upstream == 0xFF) ? -1 : record.upstream, record.rcode, record.flags);
+		for (int phase = 0; phase < 5; phase++)
+		{
+			UINT duration = PhaseTime(record, phase);
+			if (duration != TRACE_NONE)
+				printf(" %s %.1f us,", phase_names[phase], duration * tick_us);
+		}
+		printf(" total %.1f us\n", total(order[n]) * tick_us);
+	}
+	return 0;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#define TRACE_MAGIC     0x52544E44 /* "DNTR" in host byte order */
+#define TRACE_VERSION   1
+#define TRACE_NONE      0xFFFFFFFF /* phase a lookup never went through */
+
+// Flags of a trace record
+#define TRACE_CACHE_HIT 0x01
+#define TRACE_JOINED    0x02      /* waited on the query of an identical lookup */
+#define TRACE_TCP       0x04
+#define TRACE_TIMEOUT   0x08
+#define TRACE_ERROR     0x10
+#define TRACE_PREFETCH  0x20
+
+// Start of a trace file, followed by the records of every resolver traced, oldest first.
+// Files are written in host byte order and rejected unless the magic, version and sizes match.
+struct TraceHeader
+{
+	UINT magic;
+	USHORT version;
+	USHORT header_size;
+	USHORT record_size;
+	USHORT tick_ns;
+	UINT records;
+};
+
+// One traced lookup. The encode time is in ticks of TRACE_TICK_NS since the trace was started,
+// the later phases in ticks after it (TRACE_NONE if skipped): the question was encoded and the
+// packet queued in the in-flight table, first handed to the socket, the reply that completed
+// it was read from the socket, then matched, checked and cached, and finally its callback (which
+// prints or checks the response) returned.
+struct TraceRecord
+{
+	ULONGLONG encode;
+	UINT enqueue, send, receive, parse, complete;
+	USHORT txid;
+	USHORT type;
+	USHORT response_size;
+	USHORT worker;
+	UCHAR attempts;
+	UCHAR upstream;           /* index of the server that answered, 0xFF for none */
+	UCHAR rcode;
+	UCHAR flags;
+};
+
+/*
+ * The QueryTracer class records the phases of every lookup of a resolver with monotonic
+ * timestamps in a ring of fixed-size binary records, overwriting the oldest once full, so
+ * tracing costs a few clock reads per lookup and no allocation. The rings of several
+ * resolvers are saved to one file once they are done, and a saved file is read back into a
+ * breakdown of where the time of the lookups went: encoding and queueing, waiting on the
+ * wire, checking the reply, or the callback that consumes it.
+ */
+class QueryTracer
+{
+	std::vector<TraceRecord> ring;
+	ULONGLONG recorded = 0;
+	USHORT worker;
+
+	// Returns the ticks from 'from' to 'to', TRACE_NONE if 'to' was not reached
+	static UINT Ticks(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to);
+
+	// Returns the ticks a lookup spent in a phase (0 to 4, or 5 for all of them) from the last point
+	// it reached before the end of the phase, TRACE_NONE if it did not reach the end
+	static UINT PhaseTime(TraceRecord& record, int phase);
+
+public:
+
+	// Time every trace is relative to, shared by the resolvers of a process
+	static const std::chrono::steady_clock::time_point origin;
+
+	// Creates a ring of 'records' records for the resolver of the given worker thread
+	QueryTracer(int records, int worker);
+
+	// Records a completed lookup. A phase whose time is the default time point was not reached.
+	void Record(PendingQuery& query, std::chrono::steady_clock::time_point encode, std::chrono::steady_clock::time_point enqueue,
+		std::chrono::steady_clock::time_point complete, char* buf, int response_size, UCHAR flags);
+
+	// Saves the rings of the given tracers to path. Returns the number of records saved or -1
+	// if the file could not be written.
+	static int Save(const char* path, std::vector<QueryTracer*>& tracers);
+
+	// Reads a trace file and prints the count of every outcome, the percentiles of the time taken
+	// by every phase, and the slowest lookups. Returns -1 if the file is not a trace or 0 otherwise.
+	static int Report(const char* path);
+};
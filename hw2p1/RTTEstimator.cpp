@@ -0,0 +1,76 @@
+// RTTEstimator.cpp
+// CSCE 463-500
+
+#include "pch.h"
+
+// Updates the estimate with the RTT (in milliseconds) of a query that was answered on its
+// first attempt. Replies to retransmitted queries are ambiguous and must not be sampled.
+void RTTEstimator::Sample(double rtt_ms)
+{
+	if (!has_sample)
+	{
+		srtt = rtt_ms;
+		rttvar = rtt_ms / 2;
+		has_sample = true;
+	}
+	else
+	{
+		// beta = 1/4, alpha = 1/8
+		rttvar = 0.75 * rttvar + 0.25 * fabs(srtt - rtt_ms);
+		srtt = 0.875 * srtt + 0.125 * rtt_ms;
+	}
+	samples++;
+
+	// the variance term is at least the one millisecond granularity of the timer wheel
+	rto = srtt + ((4 * rttvar > 1.0) ? 4 * rttvar : 1.0);
+	if (rto < MIN_RTO_MS)
+		rto = MIN_RTO_MS;
+	else if (rto > MAX_RTO_MS)
+		rto = MAX_RTO_MS;
+}
+
+// Returns the retransmission timeout in milliseconds for the given attempt (0 for the
+// first transmission), backed off exponentially and capped at MAX_RTO_MS
+long long RTTEstimator::Timeout(int attempt)
+{
+	double timeout = rto;
+	for (int i = 0; i < attempt && timeout < MAX_RTO_MS; i++)
+		timeout *= 2;
+	if (timeout > MAX_RTO_MS)
+		timeout = MAX_RTO_MS;
+	return (long long) ceil(timeout);
+}
+
+// Records the answer time (in milliseconds) of a query
+void LatencyWindow::Add(double rtt_ms)
+{
+	samples[next] = rtt_ms;
+	next = (next + 1) % LATENCY_WINDOW;
+	if (count < LATENCY_WINDOW)
+		count++;
+	stale++;
+}
+
+// Returns the given percentile (0 to 100) of the recent answer times in milliseconds,
+// or -1 if fewer than MIN_LATENCY_SAMPLES answers have been recorded
+double LatencyWindow::Percentile(double percentile)
+{
+	if (count < MIN_LATENCY_SAMPLES)
+		return -1;
+	if (percentile == cached_percentile && stale < LATENCY_REFRESH)
+		return cached_value;
+
+	double sorted[LATENCY_WINDOW];
+	memcpy(sorted, samples, count * sizeof(double));
+	int rank = (int) ceil(percentile / 100.0 * count) - 1;
+	if (rank < 0)
+		rank = 0;
+	else if (rank >= count)
+		rank = count - 1;
+	std::nth_element(sorted, sorted + rank, sorted + count);
+
+	cached_percentile = percentile;
+	cached_value = sorted[rank];
+	stale = 0;
+	return cached_value;
+}
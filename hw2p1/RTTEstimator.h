@@ -0,0 +1,58 @@
+#pragma once
+
+/*
+ * The RTTEstimator class tracks the round trip time to one DNS server in the same way TCP 
+ * does (RFC 6298): a smoothed RTT and an RTT variance are updated from every unambiguous 
+ * sample and the retransmission timeout is SRTT + 4 * RTTVAR, kept between MIN_RTO_MS and 
+ * MAX_RTO_MS. Each retransmission of a query doubles the timeout of the previous attempt.
+ */
+class RTTEstimator
+{
+	double srtt = 0;
+	double rttvar = 0;
+	double rto = INITIAL_RTO_MS;
+	bool has_sample = false;
+	ULONGLONG samples = 0;
+
+public:
+
+	// Updates the estimate with the RTT (in milliseconds) of a query that was answered on its
+	// first attempt. Replies to retransmitted queries are ambiguous and must not be sampled.
+	void Sample(double rtt_ms);
+
+	// Returns the retransmission timeout in milliseconds for the given attempt (0 for the
+	// first transmission), backed off exponentially and capped at MAX_RTO_MS
+	long long Timeout(int attempt);
+
+	double SRTT() { return srtt; }
+	double RTTVar() { return rttvar; }
+	double RTO() { return rto; }
+	ULONGLONG Samples() { return samples; }
+};
+
+/*
+ * The LatencyWindow class keeps the most recent LATENCY_WINDOW answer times of one DNS server 
+ * in a ring so that percentiles of its recent latency (e.g. the p95 used as the hedging delay)
+ * can be read. A percentile is recomputed at most once every LATENCY_REFRESH samples.
+ */
+class LatencyWindow
+{
+	double samples[LATENCY_WINDOW];
+	int count = 0;
+	int next = 0;
+
+	double cached_percentile = -1;
+	double cached_value = 0;
+	int stale = 0;
+
+public:
+
+	// Records the answer time (in milliseconds) of a query
+	void Add(double rtt_ms);
+
+	// Returns the given percentile (0 to 100) of the recent answer times in milliseconds,
+	// or -1 if fewer than MIN_LATENCY_SAMPLES answers have been recorded
+	double Percentile(double percentile);
+
+	int Count() { return count; }
+};
@@ -0,0 +1,190 @@
+// ReverseSweep.cpp
+// CSCE 463-500
+
+#include "pch.h"
+
+// Parses one block ("a.b.c.d/n" or "x:x::x/n", a single address without a prefix length)
+// and adds it. Returns -1 if the block is invalid or larger than MAX_SWEEP_SIZE addresses.
+int ReverseSweep::AddBlock(const char* cidr)
+{
+	char address_text[MAX_NAME_SIZE];
+	if (strcpy_s(address_text, MAX_NAME_SIZE, cidr) != 0)
+		return -1;
+
+	Block added;
+	memset(added.base, 0, sizeof(added.base));
+	char* slash = strchr(address_text, '/');
+	if (slash != NULL)
+		*slash = 0;
+	if (!ParseAddress(address_text, added.base, added.ipv6))
+		return -1;
+
+	int bits = added.ipv6 ? 128 : 32;
+	added.prefix = bits;
+	if (slash != NULL)
+	{
+		char* end;
+		long prefix = strtol(slash + 1, &end, 10);
+		if (slash[1] == 0 || *end != 0 || prefix < 0 || prefix > bits)
+			return -1;
+		added.prefix = (int) prefix;
+	}
+	if (bits - added.prefix > 62 || (1ULL << (bits - added.prefix)) > MAX_SWEEP_SIZE)
+		return -1;
+	added.size = 1ULL << (bits - added.prefix);
+
+	// the block starts at its network address, whatever host bits were given
+	for (int i = 0; i < bits / 8; i++)
+	{
+		int kept = added.prefix - i * 8;
+		if (kept <= 0)
+			added.base[i] = 0;
+		else if (kept < 8)
+			added.base[i] &= (UCHAR) (0xFF << (8 - kept));
+	}
+
+	blocks.push_back(added);
+	total += added.size;
+	return 0;
+}
+
+// Adds the blocks of a comma separated list of CIDR blocks. Returns the number of blocks
+// added or -1 if the list is invalid.
+int ReverseSweep::AddList(const char* list)
+{
+	std::string remaining(list);
+	int added = 0;
+	size_t start = 0;
+	while (start <= remaining.size())
+	{
+		size_t end = remaining.find(',', start);
+		if (end == std::string::npos)
+			end = remaining.size();
+		if (AddBlock(remaining.substr(start, end - start).c_str()) != 0)
+			return -1;
+		added++;
+		start = end + 1;
+	}
+	return added;
+}
+
+// Makes this sweep take only every 'count'th address, starting with address 'index'
+void ReverseSweep::Split(int index, int count)
+{
+	block = 0;
+	offset = (ULONGLONG) index;
+	stride = count;
+}
+
+// Writes the text of the next address into lookup (MAX_NAME_SIZE bytes) and its PTR question
+// into question. Returns false once every address has been returned.
+bool ReverseSweep::Next(char* lookup, DNSQuestion& question)
+{
+	while (block < blocks.size() && offset >= blocks[block].size)
+	{
+		offset -= blocks[block].size;
+		block++;
+	}
+	if (block >= blocks.size())
+		return false;
+
+	// the offset only reaches into the host bits, which the network address leaves at 0
+	Block& current = blocks[block];
+	UCHAR address[16];
+	memcpy(address, current.base, sizeof(address));
+	int length = current.ipv6 ? 16 : 4;
+	ULONGLONG carry = offset;
+	for (int i = length - 1; i >= 0 && carry != 0; i--)
+	{
+		carry += address[i];
+		address[i] = (UCHAR) (carry & 0xFF);
+		carry >>= 8;
+	}
+	offset += stride;
+
+	if (current.ipv6)
+	{
+		sprintf_s(lookup, MAX_NAME_SIZE, "%x:%x:%x:%x:%x:%x:%x:%x", address[0] << 8 | address[1], address[2] << 8 | address[3],
+			address[4] << 8 | address[5], address[6] << 8 | address[7], address[8] << 8 | address[9], address[10] << 8 | address[11],
+			address[12] << 8 | address[13], address[14] << 8 | address[15]);
+	}
+	else
+		sprintf_s(lookup, MAX_NAME_SIZE, "%u.%u.%u.%u", address[0], address[1], address[2], address[3]);
+	EncodeReverse(address, current.ipv6, question);
+	return true;
+}
+
+// Writes the PTR question of an IPv4 (4 bytes, network order) or IPv6 (16 bytes) address into
+// question, the dotted reverse name included
+void ReverseSweep::EncodeReverse(const UCHAR* address, bool ipv6, DNSQuestion& question)
+{
+	static const char hex_digits[] = "0123456789abcdef";
+	char* wire = question.wire;
+	char* text = question.text;
+	int position = 0, text_position = 0;
+
+	if (!ipv6)
+	{
+		// one label per octet in decimal, least significant octet first
+		for (int i = 3; i >= 0; i--)
+		{
+			char digits[3];
+			int count = 0;
+			UCHAR octet = address[i];
+			do
+			{
+				digits[count++] = (char) ('0' + octet % 10);
+				octet /= 10;
+			} while (octet != 0);
+
+			wire[position++] = (char) count;
+			while (count > 0)
+			{
+				wire[position++] = digits[--count];
+				text[text_position++] = wire[position - 1];
+			}
+			text[text_position++] = '.';
+		}
+		memcpy(wire + position, "\7in-addr\4arpa", 14);
+		position += 14;
+		memcpy(text + text_position, "in-addr.arpa", 13);
+	}
+	else
+	{
+		// one label per nibble in hex, least significant nibble first
+		for (int i = 15; i >= 0; i--)
+		{
+			for (int shift = 0; shift <= 4; shift += 4)
+			{
+				wire[position++] = 1;
+				wire[position++] = hex_digits[(address[i] >> shift) & 0xF];
+				text[text_position++] = wire[position - 1];
+				text[text_position++] = '.';
+			}
+		}
+		memcpy(wire + position, "\3ip6\4arpa", 10);
+		position += 10;
+		memcpy(text + text_position, "ip6.arpa", 9);
+	}
+
+	QueryHeader* qheader = (QueryHeader*) (wire + position);
+	qheader->qType = htons(DNS_PTR);
+	qheader->qClass = htons(DNS_INET);
+	question.type = DNS_PTR;
+	question.size = position + (int) sizeof(QueryHeader);
+}
+
+// Parses an IPv4 or IPv6 address into address (16 bytes) and sets ipv6 accordingly.
+// Returns false if the text is not an address.
+bool ReverseSweep::ParseAddress(const char* text, UCHAR* address, bool& ipv6)
+{
+	ipv6 = (strchr(text, ':') != NULL);
+	if (ipv6)
+		return InetPtonA(AF_INET6, text, address) == 1;
+
+	DWORD ip = inet_addr(text);
+	if (ip == INADDR_NONE)
+		return false;
+	memcpy(address, &ip, sizeof(ip));
+	return true;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+/*
+ * The ReverseSweep class walks every address of a list of CIDR blocks (IPv4 or IPv6) and
+ * writes the PTR question of each one straight into wire format: the labels of the reversed
+ * octets under in-addr.arpa, or of the reversed nibbles under ip6.arpa (RFC 3596). Addresses
+ * are generated one at a time, so a block costs no memory however large it is. A sweep can
+ * be split between workers, each taking every Nth address.
+ */
+class ReverseSweep
+{
+	struct Block
+	{
+		bool ipv6 = false;
+		int prefix = 0;
+		UCHAR base[16];
+		ULONGLONG size = 0;
+	};
+
+	std::vector<Block> blocks;
+	ULONGLONG total = 0;
+
+	// Block and address within it that Next returns, and the distance between addresses
+	size_t block = 0;
+	ULONGLONG offset = 0;
+	int stride = 1;
+
+	// Parses one block ("a.b.c.d/n" or "x:x::x/n", a single address without a prefix length)
+	// and adds it. Returns -1 if the block is invalid or larger than MAX_SWEEP_SIZE addresses.
+	int AddBlock(const char* cidr);
+
+public:
+
+	// Adds the blocks of a comma separated list of CIDR blocks. Returns the number of blocks
+	// added or -1 if the list is invalid.
+	int AddList(const char* list);
+
+	// Makes this sweep take only every 'count'th address, starting with address 'index'
+	void Split(int index, int count);
+
+	// Returns the number of addresses in all blocks
+	ULONGLONG Size() { return total; }
+
+	// Writes the text of the next address into lookup (MAX_NAME_SIZE bytes) and its PTR question
+	// into question. Returns false once every address has been returned.
+	bool Next(char* lookup, DNSQuestion& question);
+
+	// Writes the PTR question of an IPv4 (4 bytes, network order) or IPv6 (16 bytes) address into
+	// question, the dotted reverse name included
+	static void EncodeReverse(const UCHAR* address, bool ipv6, DNSQuestion& question);
+
+	// Parses an IPv4 or IPv6 address into address (16 bytes) and sets ipv6 accordingly.
+	// Returns false if the text is not an address.
+	static bool ParseAddress(const char* text, UCHAR* address, bool& ipv6);
+};
@@ -0,0 +1,152 @@
+// ShardedResolver.cpp
+// CSCE 463-500
+
+#include "pch.h"
+
+// Creates one resolver per worker thread, each with an I/O engine using the given backend
+ShardedResolver::ShardedResolver(int threads, IOBackend backend)
+{
+	for (int i = 0; i < threads; i++)
+	{
+		shards.emplace_back(new DNSResolver(backend));
+		shards.back()->SetOutputLock(&output_lock);
+	}
+}
+
+// Runs a batch on every worker with an equal share of the window, taking the lookups of
+// worker i from sources[i], and adds the outcome and counters of all workers to totals without
+// printing a summary. Returns -1 if a socket error stopped a worker or 0 otherwise.
+int ShardedResolver::RunBatch(int window, std::vector<BatchSource>& sources, BatchStats& totals)
+{
+	int threads = (int) shards.size();
+	int shard_window = (window + threads - 1) / threads;
+	for (int i = 0; i < threads; i++)
+	{
+		if (shards[i]->SetWindow(shard_window) != 0)
+		{
+			printf("  ++ program error: cannot resize the window while queries are outstanding\n");
+			return -1;
+		}
+	}
+
+	std::vector<BatchStats> stats(threads);
+	std::vector<int> status(threads, 0);
+	std::vector<std::thread> workers;
+	for (int i = 0; i < threads; i++)
+	{
+		workers.emplace_back([this, i, &sources, &stats, &status]()
+		{
+			status[i] = shards[i]->RunBatch(sources[i], stats[i]);
+		});
+	}
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+
+	// combine the outcome of every worker
+	int result = 0;
+	for (int i = 0; i < threads; i++)
+	{
+		BatchStats& shard = stats[i];
+		totals.lookups += shard.lookups;
+		totals.replies += shard.replies;
+		totals.failures += shard.failures;
+		totals.latencies.insert(totals.latencies.end(), shard.latencies.begin(), shard.latencies.end());
+		totals.hits += shard.hits;
+		totals.negative_hits += shard.negative_hits;
+		totals.misses += shard.misses;
+		totals.evictions += shard.evictions;
+		totals.cache_dropped += shard.cache_dropped;
+		totals.sent += shard.sent;
+		totals.hedges_sent += shard.hedges_sent;
+		totals.hedges_won += shard.hedges_won;
+		totals.tcp_queries += shard.tcp_queries;
+		totals.tcp_opened += shard.tcp_opened;
+		totals.tcp_reused += shard.tcp_reused;
+		totals.syscalls += shard.syscalls;
+		totals.datagrams_sent += shard.datagrams_sent;
+		totals.datagrams_received += shard.datagrams_received;
+		totals.send_calls += shard.send_calls;
+		totals.receive_calls += shard.receive_calls;
+		totals.coalesced += shard.coalesced;
+		totals.prefetches += shard.prefetches;
+		totals.prefetches_used += shard.prefetches_used;
+		totals.snapshot_hits += shard.snapshot_hits;
+		totals.snapshot_expired += shard.snapshot_expired;
+		if (status[i] != 0)
+			result = -1;
+	}
+	return result;
+}
+
+// Runs a batch on every worker, taking the lookups of worker i from sources[i], and prints
+// the summary of all workers. Steals are taken from queue if the lookups came from one.
+// Returns -1 if a socket error stopped a worker or 0 otherwise.
+int ShardedResolver::RunWorkers(int window, std::vector<BatchSource>& sources, WorkQueue* queue)
+{
+	shards[0]->PrintBatchHeader(window);
+	auto batch_start = std::chrono::steady_clock::now();
+	BatchStats totals;
+	int result = RunBatch(window, sources, totals);
+	long long elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>
+		(std::chrono::steady_clock::now() - batch_start).count();
+
+	std::vector<DNSResolver*> resolvers;
+	for (size_t i = 0; i < shards.size(); i++)
+		resolvers.push_back(shards[i].get());
+	totals.steals = (queue != NULL) ? queue->Steals() : 0;
+	if (resolvers[0]->SnapshotPath() != NULL)
+		totals.snapshot_saved = DNSResolver::SaveSnapshot(resolvers);
+
+	DNSResolver::PrintBatchSummary(resolvers, totals, elapsed_ms);
+	return result;
+}
+
+// Reads lookups (one hostname or IP per line) from input and resolves all of them on the
+// worker threads, keeping up to 'window' queries in flight in total. Prints the parsed
+// response (or failure) of every lookup as it completes, in no particular order, followed
+// by a summary of all workers. Returns -1 if a socket error stopped a worker or 0 otherwise.
+int ShardedResolver::ResolveBatch(FILE* input, int window)
+{
+	// the input is dealt out up front, workers then only contend when stealing
+	int threads = (int) shards.size();
+	WorkQueue queue(threads);
+	char line[MAX_NAME_SIZE];
+	int length;
+	while ((length = DNSResolver::ReadBatchLine(input, line, MAX_NAME_SIZE)) >= 0)
+	{
+		if (length > 0)
+			queue.Push(line);
+	}
+
+	std::vector<BatchSource> sources;
+	for (int i = 0; i < threads; i++)
+	{
+		sources.push_back([i, &queue](char* line, int line_size, DNSQuestion& question)
+		{
+			return queue.Pop(i, line, line_size) ? (int) strlen(line) : -1;
+		});
+	}
+	return RunWorkers(window, sources, &queue);
+}
+
+// Resolves the PTR question of every address of a reverse sweep on the worker threads as
+// ResolveBatch does, each worker taking every Nth address of the sweep
+int ShardedResolver::ResolveBatch(ReverseSweep& sweep, int window)
+{
+	// addresses are generated, not read, so each worker walks its own copy of the sweep
+	int threads = (int) shards.size();
+	std::vector<ReverseSweep> parts(threads, sweep);
+	std::vector<BatchSource> sources;
+	for (int i = 0; i < threads; i++)
+	{
+		parts[i].Split(i, threads);
+		ReverseSweep* part = &parts[i];
+		sources.push_back([part](char* line, int line_size, DNSQuestion& question)
+		{
+			return part->Next(line, question) ? (int) strlen(line) : -1;
+		});
+	}
+
+	printf("Sweep   : %llu addresses\n", sweep.Size());
+	return RunWorkers(window, sources, NULL);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+/*
+ * The ShardedResolver class spreads a batch over several worker threads, each driving a
+ * DNSResolver of its own: its own socket on its own ephemeral port, I/O engine, in-flight
+ * table, TXID generator, cache and server statistics, so workers share nothing but the work
+ * queue and the output. Lookups are dealt out round-robin and rebalanced by work stealing.
+ */
+class ShardedResolver
+{
+	std::vector<std::unique_ptr<DNSResolver>> shards;
+	std::mutex output_lock;
+
+	// Runs a batch on every worker, taking the lookups of worker i from sources[i], and prints
+	// the summary of all workers. Steals are taken from queue if the lookups came from one.
+	// Returns -1 if a socket error stopped a worker or 0 otherwise.
+	int RunWorkers(int window, std::vector<BatchSource>& sources, WorkQueue* queue);
+
+public:
+
+	// Creates one resolver per worker thread, each with an I/O engine using the given backend
+	ShardedResolver(int threads, IOBackend backend = IO_POLL);
+
+	// Returns the number of worker threads
+	int Size() { return (int) shards.size(); }
+
+	// Returns the resolver of a worker, e.g. to configure it. All of them must be configured alike.
+	DNSResolver& At(int index) { return *shards[index]; }
+
+	// Runs a batch on every worker with an equal share of the window, taking the lookups of
+	// worker i from sources[i], and adds the outcome and counters of all workers to totals without
+	// printing a summary. Returns -1 if a socket error stopped a worker or 0 otherwise.
+	int RunBatch(int window, std::vector<BatchSource>& sources, BatchStats& totals);
+
+	// Reads lookups (one hostname or IP per line) from input and resolves all of them on the
+	// worker threads, keeping up to 'window' queries in flight in total. Prints the parsed
+	// response (or failure) of every lookup as it completes, in no particular order, followed
+	// by a summary of all workers. Returns -1 if a socket error stopped a worker or 0 otherwise.
+	int ResolveBatch(FILE* input, int window);
+
+	// Resolves the PTR question of every address of a reverse sweep on the worker threads as
+	// ResolveBatch does, each worker taking every Nth address of the sweep
+	int ResolveBatch(ReverseSweep& sweep, int window);
+};
@@ -0,0 +1,252 @@
+// TCPPool.cpp
+// CSCE 463-500
+
+#include "pch.h"
+
+TCPPool::TCPPool(IOEngine& engine) : engine(engine)
+{
+	// fixed slots, so that handlers can refer to a connection by its index
+	connections.resize(MAX_UPSTREAMS * TCP_CONNECTIONS);
+}
+
+// Sends a query to the server with the given index on one of its connections, opening one
+// if none has room. Returns -1 if no connection could be opened or 0 for success.
+int TCPPool::Send(int upstream, struct sockaddr_in& addr, const char* buf, int size)
+{
+	if (upstream < 0 || upstream >= MAX_UPSTREAMS || size > MAX_TCP_SIZE)
+		return -1;
+
+	// the least loaded live connection with room, else a free slot, else the least loaded one
+	Connection* best = NULL;
+	Connection* free_slot = NULL;
+	for (int i = 0; i < TCP_CONNECTIONS; i++)
+	{
+		Connection& connection = connections[upstream * TCP_CONNECTIONS + i];
+		if (connection.state == TCP_CLOSED)
+		{
+			if (free_slot == NULL)
+				free_slot = &connection;
+		}
+		else if (best == NULL || connection.outstanding < best->outstanding)
+			best = &connection;
+	}
+
+	if ((best == NULL || best->outstanding >= TCP_PIPELINE) && free_slot != NULL)
+	{
+		if (Open(*free_slot, addr) != 0)
+			return -1;
+		free_slot->upstream = upstream;
+		best = free_slot;
+	}
+	else
+		reused++;
+
+	// two byte length prefix followed by the message
+	best->send_buf.push_back((char) (size >> 8));
+	best->send_buf.push_back((char) (size & 0xFF));
+	best->send_buf.insert(best->send_buf.end(), buf, buf + size);
+	best->outstanding++;
+	queries++;
+
+	if (best->state == TCP_OPEN && Flush(*best) != 0)
+	{
+		Close(*best);
+		return 0;
+	}
+	UpdateEvents(*best);
+	return 0;
+}
+
+// Opens a non-blocking connection to the given address in a free slot.
+// Returns -1 if the socket could not be created or 0 for success.
+int TCPPool::Open(Connection& connection, struct sockaddr_in& addr)
+{
+	SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sock == INVALID_SOCKET)
+	{
+		printf("  ++ program error: socket() generated error %d\n", WSAGetLastError());
+		return -1;
+	}
+
+	u_long non_blocking = 1;
+	int no_delay = 1;
+	ioctlsocket(sock, FIONBIO, &non_blocking);
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*) &no_delay, sizeof(no_delay));
+
+	if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) == SOCKET_ERROR)
+	{
+		int error = WSAGetLastError();
+		if (error != WSAEWOULDBLOCK && error != WSAEINPROGRESS)
+		{
+			closesocket(sock);
+			printf("  ++ program error: connect() generated error %d\n", error);
+			return -1;
+		}
+	}
+
+	connection.sock = sock;
+	connection.state = TCP_CONNECTING;
+	connection.outstanding = 0;
+	connection.send_buf.clear();
+	connection.send_offset = 0;
+	connection.recv_buf.resize(2 + MAX_TCP_SIZE);
+	connection.recv_size = 0;
+	connection.last_activity = std::chrono::steady_clock::now();
+	opened++;
+
+	int slot = (int) (&connection - connections.data());
+	engine.Watch(sock, POLLRDNORM | POLLWRNORM, [this, slot](short revents) { OnEvents(slot, revents); });
+	if (idle_timer == 0)
+		idle_timer = engine.AddTimer(TCP_IDLE_MS / 2, [this]() { OnIdleCheck(); });
+	return 0;
+}
+
+// Closes a connection, queries outstanding on it are left to their timers
+void TCPPool::Close(Connection& connection)
+{
+	if (connection.state == TCP_CLOSED)
+		return;
+
+	engine.Unwatch(connection.sock);
+	closesocket(connection.sock);
+	connection.sock = INVALID_SOCKET;
+	connection.state = TCP_CLOSED;
+	connection.outstanding = 0;
+	connection.send_buf.clear();
+	connection.send_offset = 0;
+	connection.recv_size = 0;
+}
+
+// Closes every connection. Must be called before the engine is closed.
+void TCPPool::CloseAll()
+{
+	for (size_t i = 0; i < connections.size(); i++)
+		Close(connections[i]);
+	engine.CancelTimer(idle_timer);
+	idle_timer = 0;
+}
+
+// Watches a connection for reads, and for writes while queries are waiting to be written
+void TCPPool::UpdateEvents(Connection& connection)
+{
+	if (connection.state == TCP_CLOSED)
+		return;
+
+	bool writing = connection.state == TCP_CONNECTING || connection.send_offset < connection.send_buf.size();
+	engine.SetEvents(connection.sock, writing ? (POLLRDNORM | POLLWRNORM) : POLLRDNORM);
+}
+
+// Handles readiness reported by the engine for the connection in the given slot
+void TCPPool::OnEvents(int slot, short revents)
+{
+	Connection& connection = connections[slot];
+	if (connection.state == TCP_CLOSED)
+		return;
+
+	// a failed connect or a reset connection, the outstanding queries time out and are retried
+	if (revents & (POLLERR | POLLNVAL))
+	{
+		Close(connection);
+		return;
+	}
+
+	if (connection.state == TCP_CONNECTING && (revents & (POLLWRNORM | POLLRDNORM | POLLHUP)))
+		connection.state = TCP_OPEN;
+	if ((revents & POLLWRNORM) && Flush(connection) != 0)
+	{
+		Close(connection);
+		return;
+	}
+	if ((revents & (POLLRDNORM | POLLHUP)) && Drain(connection) != 0)
+	{
+		Close(connection);
+		return;
+	}
+	UpdateEvents(connection);
+}
+
+// Writes as much of the pending queries as the socket accepts. Returns -1 if the
+// connection failed or 0 otherwise.
+int TCPPool::Flush(Connection& connection)
+{
+	while (connection.send_offset < connection.send_buf.size())
+	{
+		int result = send(connection.sock, connection.send_buf.data() + connection.send_offset,
+			(int) (connection.send_buf.size() - connection.send_offset), 0);
+		if (result == SOCKET_ERROR)
+			return (WSAGetLastError() == WSAEWOULDBLOCK) ? 0 : -1;
+		connection.send_offset += result;
+		connection.last_activity = std::chrono::steady_clock::now();
+	}
+
+	// everything was written, reuse the buffer for the next queries
+	connection.send_buf.clear();
+	connection.send_offset = 0;
+	return 0;
+}
+
+// Reads everything available and hands every complete message to the handler. Returns -1
+// if the connection was closed or failed or 0 otherwise.
+int TCPPool::Drain(Connection& connection)
+{
+	while (true)
+	{
+		int result = recv(connection.sock, connection.recv_buf.data() + connection.recv_size,
+			(int) connection.recv_buf.size() - connection.recv_size, 0);
+		if (result == 0)
+			return -1;
+		if (result == SOCKET_ERROR)
+			return (WSAGetLastError() == WSAEWOULDBLOCK) ? 0 : -1;
+		connection.recv_size += result;
+		connection.last_activity = std::chrono::steady_clock::now();
+
+		// deliver every complete length-prefixed message, replies may come in any order
+		int offset = 0;
+		while (connection.recv_size - offset >= 2)
+		{
+			char* frame = connection.recv_buf.data() + offset;
+			int size = ((UCHAR) frame[0] << 8) | (UCHAR) frame[1];
+			if (connection.recv_size - offset < 2 + size)
+				break;
+
+			offset += 2 + size;
+			if (connection.outstanding > 0)
+				connection.outstanding--;
+			messages++;
+			if (on_message)
+				on_message(frame + 2, size, connection.upstream);
+
+			// the handler may have closed the connection
+			if (connection.state == TCP_CLOSED)
+				return 0;
+		}
+
+		if (offset > 0)
+		{
+			memmove(connection.recv_buf.data(), connection.recv_buf.data() + offset, connection.recv_size - offset);
+			connection.recv_size -= offset;
+		}
+	}
+}
+
+// Timer callback that closes connections without traffic for TCP_IDLE_MS
+void TCPPool::OnIdleCheck()
+{
+	idle_timer = 0;
+	auto now = std::chrono::steady_clock::now();
+	bool any_open = false;
+
+	for (size_t i = 0; i < connections.size(); i++)
+	{
+		Connection& connection = connections[i];
+		if (connection.state == TCP_CLOSED)
+			continue;
+		if (now - connection.last_activity >= std::chrono::milliseconds(TCP_IDLE_MS))
+			Close(connection);
+		else
+			any_open = true;
+	}
+
+	if (any_open)
+		idle_timer = engine.AddTimer(TCP_IDLE_MS / 2, [this]() { OnIdleCheck(); });
+}
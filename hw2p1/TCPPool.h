@@ -0,0 +1,88 @@
+#pragma once
+
+// Called with every complete message read from a TCP connection to the server with the given index
+typedef std::function<void(char* buf, int size, int upstream)> StreamMessageHandler;
+
+/*
+ * The TCPPool class keeps up to TCP_CONNECTIONS persistent TCP connections open to each
+ * server for queries whose UDP answer was truncated. Queries are written length-prefixed
+ * (RFC 7766) and pipelined, up to TCP_PIPELINE outstanding per connection before another
+ * connection to the same server is opened, and replies are handed back in whatever order
+ * they arrive to be matched by TXID. Connections are non-blocking and watched by the I/O
+ * engine of the resolver; those without traffic for TCP_IDLE_MS are closed.
+ */
+class TCPPool
+{
+	enum ConnectionState
+	{
+		TCP_CLOSED,
+		TCP_CONNECTING,
+		TCP_OPEN
+	};
+
+	struct Connection
+	{
+		SOCKET sock = INVALID_SOCKET;
+		ConnectionState state = TCP_CLOSED;
+		int upstream = -1;
+		int outstanding = 0;
+
+		// Queries written but not yet accepted by the socket, and replies read so far
+		std::vector<char> send_buf;
+		size_t send_offset = 0;
+		std::vector<char> recv_buf;
+		int recv_size = 0;
+
+		std::chrono::steady_clock::time_point last_activity;
+	};
+
+	IOEngine& engine;
+	std::vector<Connection> connections;
+	StreamMessageHandler on_message;
+	TimerId idle_timer = 0;
+
+	ULONGLONG queries = 0, reused = 0, opened = 0, messages = 0;
+
+	// Opens a non-blocking connection to the given address in a free slot.
+	// Returns -1 if the socket could not be created or 0 for success.
+	int Open(Connection& connection, struct sockaddr_in& addr);
+
+	// Closes a connection, queries outstanding on it are left to their timers
+	void Close(Connection& connection);
+
+	// Handles readiness reported by the engine for the connection in the given slot
+	void OnEvents(int slot, short revents);
+
+	// Writes as much of the pending queries as the socket accepts. Returns -1 if the
+	// connection failed or 0 otherwise.
+	int Flush(Connection& connection);
+
+	// Reads everything available and hands every complete message to the handler. Returns -1
+	// if the connection was closed or failed or 0 otherwise.
+	int Drain(Connection& connection);
+
+	// Watches a connection for reads, and for writes while queries are waiting to be written
+	void UpdateEvents(Connection& connection);
+
+	// Timer callback that closes connections without traffic for TCP_IDLE_MS
+	void OnIdleCheck();
+
+public:
+
+	TCPPool(IOEngine& engine);
+
+	// Sets the handler called for every message read from any connection
+	void SetMessageHandler(StreamMessageHandler handler) { on_message = handler; }
+
+	// Sends a query to the server with the given index on one of its connections, opening one
+	// if none has room. Returns -1 if no connection could be opened or 0 for success.
+	int Send(int upstream, struct sockaddr_in& addr, const char* buf, int size);
+
+	// Closes every connection. Must be called before the engine is closed.
+	void CloseAll();
+
+	ULONGLONG Queries() { return queries; }
+	ULONGLONG Reused() { return reused; }
+	ULONGLONG Opened() { return opened; }
+	ULONGLONG Messages() { return messages; }
+};
@@ -0,0 +1,161 @@
+// UpstreamSet.cpp
+// CSCE 463-500
+
+#include "pch.h"
+
+// Adds a server listening on the given port. Returns -1 if MAX_UPSTREAMS servers have already 
+// been added or 0 for success. Adding a server twice has no effect.
+int UpstreamSet::Add(DWORD server_ip, USHORT port)
+{
+	for (size_t i = 0; i < servers.size(); i++)
+	{
+		if (servers[i].addr.sin_addr.s_addr == server_ip && servers[i].addr.sin_port == htons(port))
+			return 0;
+	}
+
+	if (servers.size() >= MAX_UPSTREAMS)
+		return -1;
+
+	Upstream server;
+	memset(&server.addr, 0, sizeof(server.addr));
+	server.addr.sin_family = AF_INET;
+	server.addr.sin_port = htons(port);
+	server.addr.sin_addr.s_addr = server_ip;
+	servers.push_back(server);
+	return 0;
+}
+
+// Adds every server of a comma separated list of IPv4 addresses, each optionally followed by
+// ":port" (DNS_PORT otherwise). Returns the number of servers added or -1 if an address is
+// invalid or there are too many.
+int UpstreamSet::AddList(const char* list)
+{
+	int added = 0;
+	while (*list != 0)
+	{
+		const char* end = strchr(list, ',');
+		size_t length = (end != NULL) ? (size_t) (end - list) : strlen(list);
+
+		char address[INET_ADDRSTRLEN + 6];
+		if (length == 0 || length >= sizeof(address))
+			return -1;
+		memcpy(address, list, length);
+		address[length] = 0;
+
+		int port = DNS_PORT;
+		char* colon = strchr(address, ':');
+		if (colon != NULL)
+		{
+			*colon = 0;
+			port = atoi(colon + 1);
+			if (port <= 0 || port > 65535)
+				return -1;
+		}
+
+		DWORD server_ip = inet_addr(address);
+		if (server_ip == INADDR_NONE || Add(server_ip, (USHORT) port) != 0)
+			return -1;
+		added++;
+
+		list += length;
+		if (*list == ',')
+			list++;
+	}
+	return added;
+}
+
+// Returns the expected time in milliseconds until a query sent to the server is answered
+double UpstreamSet::Score(Upstream& server)
+{
+	// without a sample the initial retransmission timeout is the only estimate there is
+	if (server.rtt.Samples() == 0)
+		return server.rtt.RTO() * (1.0 + server.loss);
+
+	// an unanswered attempt costs a retransmission timeout on top of the round trip
+	return server.rtt.SRTT() + server.loss * server.rtt.RTO();
+}
+
+// Picks the server for the next transmission, penalizing servers whose bit is set in 
+// exclude_mask (e.g. those a query has already been sent to) by another retransmission 
+// timeout, so a retry moves on unless the other servers are far worse. Returns its index.
+int UpstreamSet::Select(UINT exclude_mask)
+{
+	selections++;
+
+	int best = -1;
+	double best_score = 0;
+	for (int i = 0; i < (int) servers.size(); i++)
+	{
+		bool excluded = (exclude_mask & (1u << i)) != 0;
+
+		// servers that were never sent anything are unknown, try each of them once
+		if (servers[i].sent == 0 && !excluded)
+		{
+			best = i;
+			break;
+		}
+
+		double score = Score(servers[i]) + (excluded ? servers[i].rtt.RTO() : 0);
+		if (best < 0 || score < best_score)
+		{
+			best = i;
+			best_score = score;
+		}
+	}
+
+	servers[best].last_selected = selections;
+	return best;
+}
+
+// Returns the index of the least recently selected server outside of exclude_mask once every 
+// UPSTREAM_PROBE_INTERVAL calls, or -1. Probes are sent in addition to the regular attempt
+// so that a server that has recovered is noticed again without delaying the query.
+int UpstreamSet::Probe(UINT exclude_mask)
+{
+	if (++probes % UPSTREAM_PROBE_INTERVAL != 0)
+		return -1;
+
+	int oldest = -1;
+	for (int i = 0; i < (int) servers.size(); i++)
+	{
+		if ((exclude_mask & (1u << i)) == 0 && (oldest < 0 || servers[i].last_selected < servers[oldest].last_selected))
+			oldest = i;
+	}
+
+	if (oldest >= 0)
+		servers[oldest].last_selected = selections;
+	return oldest;
+}
+
+// Returns the index of the server a datagram was received from, or -1 if it did not
+// come from the address and port of any server
+int UpstreamSet::Find(struct sockaddr_in& from)
+{
+	for (size_t i = 0; i < servers.size(); i++)
+	{
+		if (servers[i].addr.sin_addr.s_addr == from.sin_addr.s_addr && servers[i].addr.sin_port == from.sin_port)
+			return (int) i;
+	}
+	return -1;
+}
+
+// Updates the statistics of a server with an answer, sampling the RTT if it is unambiguous
+void UpstreamSet::OnAnswer(int index, double rtt_ms, bool sample)
+{
+	Upstream& server = servers[index];
+	server.answered++;
+	server.loss *= (1.0 - LOSS_WEIGHT);
+	if (sample)
+	{
+		server.rtt.Sample(rtt_ms);
+		server.latency.Add(rtt_ms);
+	}
+}
+
+// Updates the statistics of a server with an attempt that went unanswered
+void UpstreamSet::OnTimeout(int index)
+{
+	Upstream& server = servers[index];
+	server.timeouts++;
+	server.loss = server.loss * (1.0 - LOSS_WEIGHT) + LOSS_WEIGHT;
+}
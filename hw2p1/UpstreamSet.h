@@ -0,0 +1,66 @@
+#pragma once
+
+// A DNS server queries can be sent to, along with its latency and loss statistics
+struct Upstream
+{
+	struct sockaddr_in addr;
+	RTTEstimator rtt;
+	LatencyWindow latency;
+
+	// Exponentially weighted fraction of attempts that went unanswered
+	double loss = 0;
+
+	ULONGLONG sent = 0, answered = 0, timeouts = 0;
+	ULONGLONG last_selected = 0;
+};
+
+/*
+ * The UpstreamSet class holds the list of servers the resolver may query and picks the one 
+ * with the lowest expected answer time for each attempt, taking both its smoothed RTT and 
+ * its recent loss rate into account. Every server is tried once before the estimates are 
+ * relied upon, and every UPSTREAM_PROBE_INTERVAL attempts the least recently used server is 
+ * probed alongside so that a server that has recovered is noticed again.
+ */
+class UpstreamSet
+{
+	std::vector<Upstream> servers;
+	ULONGLONG selections = 0;
+	ULONGLONG probes = 0;
+
+	// Returns the expected time in milliseconds until a query sent to the server is answered
+	double Score(Upstream& server);
+
+public:
+
+	// Adds a server listening on the given port. Returns -1 if MAX_UPSTREAMS servers have already 
+	// been added or 0 for success. Adding a server twice has no effect.
+	int Add(DWORD server_ip, USHORT port = DNS_PORT);
+
+	// Adds every server of a comma separated list of IPv4 addresses, each optionally followed by
+	// ":port" (DNS_PORT otherwise). Returns the number of servers added or -1 if an address is
+	// invalid or there are too many.
+	int AddList(const char* list);
+
+	// Picks the server for the next transmission, penalizing servers whose bit is set in 
+	// exclude_mask (e.g. those a query has already been sent to) by another retransmission 
+	// timeout, so a retry moves on unless the other servers are far worse. Returns its index.
+	int Select(UINT exclude_mask);
+
+	// Returns the index of the least recently selected server outside of exclude_mask once every 
+	// UPSTREAM_PROBE_INTERVAL calls, or -1. Probes are sent in addition to the regular attempt
+	// so that a server that has recovered is noticed again without delaying the query.
+	int Probe(UINT exclude_mask);
+
+	// Returns the index of the server a datagram was received from, or -1 if it did not
+	// come from the address and port of any server
+	int Find(struct sockaddr_in& from);
+
+	// Updates the statistics of a server with an answer, sampling the RTT if it is unambiguous
+	void OnAnswer(int index, double rtt_ms, bool sample);
+
+	// Updates the statistics of a server with an attempt that went unanswered
+	void OnTimeout(int index);
+
+	Upstream& At(int index) { return servers[index]; }
+	int Size() { return (int) servers.size(); }
+};
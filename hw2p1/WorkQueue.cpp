@@ -0,0 +1,49 @@
+// WorkQueue.cpp
+// CSCE 463-500
+
+#include "pch.h"
+
+WorkQueue::WorkQueue(int workers) : steals(0)
+{
+	for (int i = 0; i < workers; i++)
+		shards.emplace_back(new Shard());
+}
+
+// Adds a lookup to the deque of the next worker in turn. Not safe while workers are popping.
+void WorkQueue::Push(const char* item)
+{
+	shards[next]->items.push_back(item);
+	next = (next + 1) % shards.size();
+}
+
+// Copies the next lookup for the given worker into out (of out_size bytes), stealing one
+// from another worker if its own deque is empty. Returns false once no work is left anywhere.
+bool WorkQueue::Pop(int worker, char* out, int out_size)
+{
+	// own work is taken from the front, in input order
+	Shard& own = *shards[worker];
+	{
+		std::lock_guard<std::mutex> guard(own.lock);
+		if (!own.items.empty())
+		{
+			strcpy_s(out, out_size, own.items.front().c_str());
+			own.items.pop_front();
+			return true;
+		}
+	}
+
+	// steal from the back of the others, starting with the neighbour so thieves spread out
+	for (size_t i = 1; i < shards.size(); i++)
+	{
+		Shard& victim = *shards[(worker + i) % shards.size()];
+		std::lock_guard<std::mutex> guard(victim.lock);
+		if (!victim.items.empty())
+		{
+			strcpy_s(out, out_size, victim.items.back().c_str());
+			victim.items.pop_back();
+			steals++;
+			return true;
+		}
+	}
+	return false;
+}
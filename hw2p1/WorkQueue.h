@@ -0,0 +1,35 @@
+#pragma once
+
+/*
+ * The WorkQueue class hands batch lookups to a fixed number of worker threads. Every worker
+ * has its own deque, which lookups are dealt into round-robin, and takes work from the front
+ * of it. A worker whose deque runs dry steals from the back of the others, so a worker stuck
+ * behind slow servers does not hold up lookups the rest could be resolving.
+ */
+class WorkQueue
+{
+	struct Shard
+	{
+		std::mutex lock;
+		std::deque<std::string> items;
+	};
+
+	// mutexes cannot be moved, so shards are kept behind pointers
+	std::vector<std::unique_ptr<Shard>> shards;
+	size_t next = 0;
+	std::atomic<ULONGLONG> steals;
+
+public:
+
+	WorkQueue(int workers);
+
+	// Adds a lookup to the deque of the next worker in turn. Not safe while workers are popping.
+	void Push(const char* item);
+
+	// Copies the next lookup for the given worker into out (of out_size bytes), stealing one
+	// from another worker if its own deque is empty. Returns false once no work is left anywhere.
+	bool Pop(int worker, char* out, int out_size);
+
+	// Returns the number of lookups taken from the deque of another worker
+	ULONGLONG Steals() { return steals; }
+};
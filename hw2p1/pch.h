@@ -7,14 +7,49 @@
 #ifndef PCH_H
 #define PCH_H
 
+#define _WINSOCK_DEPRECATED_NO_WARNINGS
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <mswsock.h>
 #include <windows.h>
 
 #include <iostream>
 #include <string>
 #include <chrono>
+#include <cmath>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <algorithm>
+#include <random>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
 
 #include "Constants.h"
 #include "Headers.h"
+#include "Metrics.h"
+#include "IOEngine.h"
+#include "DNSMessage.h"
+#include "RTTEstimator.h"
+#include "UpstreamSet.h"
+#include "TCPPool.h"
+#include "CacheSnapshot.h"
+#include "CacheArena.h"
+#include "DNSCache.h"
+#include "InFlightTable.h"
+#include "QueryTracer.h"
+#include "OutputWriter.h"
+#include "ReverseSweep.h"
 #include "DNSResolver.h"
+#include "WorkQueue.h"
+#include "ShardedResolver.h"
+#include "FakeServer.h"
+#include "Benchmark.h"
+#include "ParserBench.h"
 
 #endif //PCH_H